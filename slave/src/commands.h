@@ -0,0 +1,40 @@
+// Answers of the firmware to the built-in commands, shared with the macro engine and with the host
+// build of the firmware in `tools/macro-bench.c`. Plain C without Arduino dependencies.
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stddef.h>
+#include <string.h>
+
+// Identifies the board during the device discovery of MULTIFACE. Give every board its own ID with
+// `build_flags = -DDEVICE_ID=\"...\"`.
+#ifndef DEVICE_ID
+#define DEVICE_ID "slave0"
+#endif
+
+static inline int commands_is(const char* line, size_t length, const char* command)
+{
+    return length >= strlen(command) && strncmp(line, command, strlen(command)) == 0;
+}
+
+// Answer to the command `line`, without its line ending. NULL for an invalid command.
+static inline const char* commands_answer(const char* line, size_t length)
+{
+    if (commands_is(line, length, "give me a long string!"))
+    {
+        return "This is a very long string but you should not crop it or wrap it or crap it! - "
+               "This is a very long string but you should not crop it or wrap it or crap it! - "
+               "This is a very long string but you should not crop it or wrap it or crap it!";
+    }
+    if (commands_is(line, length, "stop"))
+    {
+        return "Stopped";
+    }
+    if (commands_is(line, length, "who are you?"))
+    {
+        return "ID " DEVICE_ID " CAPS poll,stop,macro";
+    }
+    return NULL;
+}
+
+#endif // COMMANDS_H
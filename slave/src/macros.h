@@ -0,0 +1,172 @@
+// Command macros: named sequences of commands kept by the firmware, so that `run <name>` executes
+// every step without a round trip to the host in between. They are defined with
+// `macro <name> <command>;<command>;...`, persisted in EEPROM, and forgotten with `macro clear`,
+// which the host sends before uploading its own.
+//
+// Plain C without Arduino dependencies, so that the engine also builds on the host (see
+// `tools/macro-bench.c`).
+#ifndef MACROS_H
+#define MACROS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MACROS_MAX
+#define MACROS_MAX (4)
+#endif
+#define MACROS_NAME_SIZE (16)
+#ifndef MACROS_BODY_SIZE
+#define MACROS_BODY_SIZE (200) /* 4 macros of 216 bytes fit in the 1 KiB EEPROM of an UNO */
+#endif
+#define MACROS_MAX_STEPS (20)
+#define MACROS_MAGIC (0x4d)
+#define MACROS_SEPARATOR ';'
+
+typedef struct
+{
+    char name[MACROS_NAME_SIZE]; /* Empty for a free slot */
+    char body[MACROS_BODY_SIZE]; /* Steps separated by MACROS_SEPARATOR */
+} Macro;
+
+typedef struct
+{
+    uint8_t magic;
+    Macro macros[MACROS_MAX];
+} MacroTable;
+
+typedef enum
+{
+    MACROS_OK,
+    MACROS_INVALID,  /* Empty name or step, or a step that is itself `run` or `macro` */
+    MACROS_TOO_LONG, /* Name, body or number of steps */
+    MACROS_FULL,
+} MacroStatus;
+
+// Start from an empty table unless `table_p` holds a table saved before.
+static inline void macros_init(MacroTable* table_p)
+{
+    if (table_p->magic != MACROS_MAGIC)
+    {
+        memset(table_p, 0, sizeof(MacroTable));
+        table_p->magic = MACROS_MAGIC;
+    }
+}
+
+// Free every slot.
+static inline void macros_clear(MacroTable* table_p)
+{
+    memset(table_p->macros, 0, sizeof(table_p->macros));
+}
+
+static inline const Macro* macros_find(const MacroTable* table_p, const char* name, size_t length)
+{
+    for (size_t i = 0; i < MACROS_MAX; i++)
+    {
+        const Macro* macro_p = &table_p->macros[i];
+        if (macro_p->name[0] && strlen(macro_p->name) == length
+            && strncmp(macro_p->name, name, length) == 0)
+        {
+            return macro_p;
+        }
+    }
+    return NULL;
+}
+
+// Iterate over the steps of a body: `*cursor_pp` starts at the body and is advanced past the step
+// returned in `*step_pp` and `*length_p`. Returns 0 after the last step.
+static inline int macros_next_step(const char** cursor_pp, const char** step_pp, size_t* length_p)
+{
+    const char* cursor = *cursor_pp;
+    if (*cursor == 0)
+    {
+        return 0;
+    }
+    size_t length = 0;
+    while (cursor[length] && cursor[length] != MACROS_SEPARATOR)
+    {
+        length++;
+    }
+    *step_pp   = cursor;
+    *length_p  = length;
+    *cursor_pp = cursor[length] ? cursor + length + 1 : cursor + length;
+    return 1;
+}
+
+// Whether `step` would be dispatched as `run <name>` or `macro ...`, as in `main.cpp`.
+static inline int _macros_is_nested(const char* step, size_t length)
+{
+    return (length >= 4 && strncmp(step, "run ", 4) == 0)
+           || (length >= 6 && strncmp(step, "macro ", 6) == 0);
+}
+
+// Define, or redefine, a macro from `<name> <body>`, where `length` excludes the line ending.
+static inline MacroStatus macros_define(MacroTable* table_p, const char* line, size_t length)
+{
+    size_t name_length = 0;
+    while (name_length < length && line[name_length] != ' ')
+    {
+        name_length++;
+    }
+    if (name_length == 0 || name_length + 1 >= length)
+    {
+        return MACROS_INVALID;
+    }
+    const char* body   = line + name_length + 1;
+    size_t body_length = length - name_length - 1;
+    if (name_length >= MACROS_NAME_SIZE || body_length >= MACROS_BODY_SIZE)
+    {
+        return MACROS_TOO_LONG;
+    }
+    size_t num_steps = 0;
+    size_t start     = 0;
+    for (size_t i = 0; i <= body_length; i++)
+    {
+        if (i < body_length && body[i] != MACROS_SEPARATOR)
+        {
+            continue;
+        }
+        if (i == start || _macros_is_nested(body + start, i - start))
+        {
+            return MACROS_INVALID;
+        }
+        num_steps++;
+        start = i + 1;
+    }
+    if (num_steps > MACROS_MAX_STEPS)
+    {
+        return MACROS_TOO_LONG;
+    }
+    Macro* macro_p = (Macro*)macros_find(table_p, line, name_length);
+    for (size_t i = 0; macro_p == NULL && i < MACROS_MAX; i++)
+    {
+        macro_p = table_p->macros[i].name[0] ? NULL : &table_p->macros[i];
+    }
+    if (macro_p == NULL)
+    {
+        return MACROS_FULL;
+    }
+    memcpy(macro_p->name, line, name_length);
+    macro_p->name[name_length] = 0;
+    memcpy(macro_p->body, body, body_length);
+    macro_p->body[body_length] = 0;
+    return MACROS_OK;
+}
+
+static inline const char* macros_status_name(MacroStatus status)
+{
+    switch (status)
+    {
+    case MACROS_OK:
+        return "OK";
+    case MACROS_INVALID:
+        return "invalid";
+    case MACROS_TOO_LONG:
+        return "too long";
+    case MACROS_FULL:
+        return "table full";
+    }
+    return "?";
+}
+
+#endif // MACROS_H
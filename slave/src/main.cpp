@@ -1,4 +1,69 @@
 #include <Arduino.h>
+#include <EEPROM.h>
+
+#include "commands.h"
+#include "macros.h"
+
+static MacroTable macros;
+
+static void load_macros(void)
+{
+#ifdef ARDUINO_ARCH_ESP32
+    EEPROM.begin(sizeof(MacroTable));
+#endif
+    EEPROM.get(0, macros);
+    macros_init(&macros);
+}
+
+static void save_macros(void)
+{
+    // Only the bytes that changed are written.
+    EEPROM.put(0, macros);
+#ifdef ARDUINO_ARCH_ESP32
+    EEPROM.commit();
+#endif
+}
+
+// Print the answer to one command, without its line ending.
+static void answer(const char* line, size_t length)
+{
+    const char* reply = commands_answer(line, length);
+    if (reply != NULL)
+    {
+        Serial.print(reply);
+        return;
+    }
+    Serial.print("Invalid command `");
+    Serial.write(line, length);
+    Serial.print("`");
+}
+
+// Run every step of a macro and answer a single line: the answers of the steps separated by tabs.
+static void run_macro(const char* name, size_t length)
+{
+    const Macro* macro_p = macros_find(&macros, name, length);
+    if (macro_p == NULL)
+    {
+        Serial.print("Unknown macro `");
+        Serial.write(name, length);
+        Serial.println("`");
+        return;
+    }
+    const char* cursor = macro_p->body;
+    const char* step;
+    size_t step_length;
+    bool first = true;
+    while (macros_next_step(&cursor, &step, &step_length))
+    {
+        if (!first)
+        {
+            Serial.print('\t');
+        }
+        answer(step, step_length);
+        first = false;
+    }
+    Serial.println();
+}
 
 void setup(void)
 {
@@ -7,6 +72,9 @@ void setup(void)
     while(Serial.available()) {
         Serial.read();
     }
+    load_macros();
+    // Unsolicited message: MULTIFACE publishes it to the event subscribers.
+    Serial.println("!ready");
 }
 
 void loop(void)
@@ -15,20 +83,40 @@ void loop(void)
     if (receivedData.length() <= 0) {
         return;
     }
-    if (strncmp(receivedData.c_str(), "give me a long string!", strlen("give me a long string!"))
-        == 0)
+    const char* line = receivedData.c_str();
+    size_t length    = receivedData.length();
+    while (length && line[length - 1] == '\r')
     {
-        Serial.print(
-            "This is a very long string but you should not crop it or wrap it or crap it! - ");
-        Serial.print(
-            "This is a very long string but you should not crop it or wrap it or crap it! - ");
-        Serial.println(
-            "This is a very long string but you should not crop it or wrap it or crap it!");
+        length--;
+    }
+    if (commands_is(line, length, "run "))
+    {
+        run_macro(line + 4, length - 4);
+    }
+    else if (length == 11 && commands_is(line, length, "macro clear"))
+    {
+        // In RAM only: the host defines its macros right after, and saving them then writes only
+        // the bytes that differ, so the EEPROM is not rewritten at every startup.
+        macros_clear(&macros);
+        Serial.println("OK");
+    }
+    else if (commands_is(line, length, "macro "))
+    {
+        MacroStatus status = macros_define(&macros, line + 6, length - 6);
+        if (status == MACROS_OK)
+        {
+            save_macros();
+            Serial.println("OK");
+        }
+        else
+        {
+            Serial.print("Rejected macro: ");
+            Serial.println(macros_status_name(status));
+        }
     }
     else
     {
-        Serial.print("Invalid command `");
-        Serial.print(receivedData);
-        Serial.println("`");
+        answer(line, length);
+        Serial.println();
     }
 }
@@ -0,0 +1,155 @@
+// Pool of reference-counted message buffers.
+// Buffers come in a few size classes, each backed by a static slab, so that nothing is allocated
+// at run time. A buffer is handed from one stage to the next (serial reader, logger, output FIFO,
+// caches...) by taking a reference instead of copying it, and goes back to its free list when the
+// last reference is released. The pool is only used from the main loop: it is not thread-safe.
+#define BUFFER_NUM_CLASSES (4)
+
+typedef struct MessageBuffer
+{
+    char* data;
+    size_t size;
+    uint32_t refcount;
+    uint8_t size_class;
+    struct MessageBuffer* next_free;
+} MessageBuffer;
+
+typedef struct
+{
+    size_t capacity; /* Bytes per buffer, including room for a terminating null character */
+    size_t count;
+    MessageBuffer* headers;
+    char* slab;
+    MessageBuffer* free_p;
+    size_t in_use;
+    size_t high_water;
+    uint64_t acquired;
+    uint64_t exhausted;
+} BufferClass;
+
+static MessageBuffer buffer_headers_64[64];
+static MessageBuffer buffer_headers_256[32];
+static MessageBuffer buffer_headers_1k[16];
+static MessageBuffer buffer_headers_4k[8];
+static char buffer_slab_64[64][64];
+static char buffer_slab_256[32][256];
+static char buffer_slab_1k[16][1024];
+static char buffer_slab_4k[8][COMMUNICATION_BUFF_IN_SIZE];
+
+static BufferClass buffer_classes[BUFFER_NUM_CLASSES] = {
+    {.capacity = 64, .count = 64, .headers = buffer_headers_64, .slab = &buffer_slab_64[0][0]},
+    {.capacity = 256, .count = 32, .headers = buffer_headers_256, .slab = &buffer_slab_256[0][0]},
+    {.capacity = 1024, .count = 16, .headers = buffer_headers_1k, .slab = &buffer_slab_1k[0][0]},
+    {
+        .capacity = COMMUNICATION_BUFF_IN_SIZE,
+        .count    = 8,
+        .headers  = buffer_headers_4k,
+        .slab     = &buffer_slab_4k[0][0],
+    },
+};
+
+void buffer_utils_init(void)
+{
+    for (uint8_t c = 0; c < BUFFER_NUM_CLASSES; c++)
+    {
+        BufferClass* class_p = &buffer_classes[c];
+        class_p->free_p      = NULL;
+        for (size_t i = class_p->count; i-- > 0;)
+        {
+            MessageBuffer* buffer_p = &class_p->headers[i];
+            buffer_p->data          = class_p->slab + i * class_p->capacity;
+            buffer_p->size          = 0;
+            buffer_p->refcount      = 0;
+            buffer_p->size_class    = c;
+            buffer_p->next_free     = class_p->free_p;
+            class_p->free_p         = buffer_p;
+        }
+        class_p->in_use     = 0;
+        class_p->high_water = 0;
+        class_p->acquired   = 0;
+        class_p->exhausted  = 0;
+    }
+}
+
+// Take a buffer that can hold `size` bytes plus a terminating null character, with one reference.
+// If its size class is exhausted, a larger class is used. Returns NULL if none is left.
+MessageBuffer* buffer_utils_acquire(size_t size)
+{
+    for (uint8_t c = 0; c < BUFFER_NUM_CLASSES; c++)
+    {
+        BufferClass* class_p = &buffer_classes[c];
+        if (class_p->capacity <= size)
+        {
+            continue;
+        }
+        if (class_p->free_p == NULL)
+        {
+            class_p->exhausted++;
+            continue;
+        }
+        MessageBuffer* buffer_p = class_p->free_p;
+        class_p->free_p         = buffer_p->next_free;
+        buffer_p->next_free     = NULL;
+        buffer_p->refcount      = 1;
+        buffer_p->size          = 0;
+        buffer_p->data[0]       = 0;
+        class_p->acquired++;
+        class_p->in_use++;
+        if (class_p->in_use > class_p->high_water)
+        {
+            class_p->high_water = class_p->in_use;
+        }
+        return buffer_p;
+    }
+    return NULL;
+}
+
+// Take a buffer holding a null-terminated copy of `data`.
+MessageBuffer* buffer_utils_from(const char* data, size_t size)
+{
+    MessageBuffer* buffer_p = buffer_utils_acquire(size);
+    if (buffer_p != NULL)
+    {
+        memcpy(buffer_p->data, data, size);
+        buffer_p->data[size] = 0;
+        buffer_p->size       = size;
+    }
+    return buffer_p;
+}
+
+MessageBuffer* buffer_utils_ref(MessageBuffer* buffer_p)
+{
+    buffer_p->refcount++;
+    return buffer_p;
+}
+
+// Drop one reference. `buffer_p` may be NULL.
+void buffer_utils_release(MessageBuffer* buffer_p)
+{
+    if (buffer_p == NULL || --buffer_p->refcount)
+    {
+        return;
+    }
+    BufferClass* class_p = &buffer_classes[buffer_p->size_class];
+    buffer_p->next_free  = class_p->free_p;
+    class_p->free_p      = buffer_p;
+    class_p->in_use--;
+}
+
+void buffer_utils_print_stats(void)
+{
+    for (int c = 0; c < BUFFER_NUM_CLASSES; c++)
+    {
+        const BufferClass* class_p = &buffer_classes[c];
+        UNUSED(class_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        LOG_INFO(
+            "Buffers %4zu B | in use %2zu/%2zu high water %2zu | acquired %8" PRIu64
+            " exhausted %4" PRIu64,
+            class_p->capacity,
+            class_p->in_use,
+            class_p->count,
+            class_p->high_water,
+            class_p->acquired,
+            class_p->exhausted);
+    }
+}
@@ -0,0 +1,122 @@
+#define COMMAND_NAME_MAX_LEN (32)
+#define COMMAND_MAX_MACROS (4) /* Commands defined at startup, see `src/macroutils.c` */
+#define NUM_BUILTIN_COMMANDS (2)
+
+// The priority of a request decides which queue it waits in. Higher values are served first.
+typedef enum
+{
+    PRIORITY_BULK,
+    PRIORITY_NORMAL,
+    PRIORITY_URGENT,
+    NUM_PRIORITIES,
+} Priority;
+
+static const char* priority_names[NUM_PRIORITIES] = {"bulk", "normal", "urgent"};
+
+typedef struct
+{
+    const char* name;
+    const char* serial_message;
+    Priority priority;
+    bool read_only; /* Safe to send twice, see `src/hedgeutils.c` */
+} Command;
+
+// FIFO instruction -> message sent to the Serial Device. The entries after the built-in commands
+// are filled by command_utils_add().
+static Command g_commands[NUM_BUILTIN_COMMANDS + COMMAND_MAX_MACROS] = {
+    {
+        .name           = "POLL",
+        .serial_message = "give me a long string!\n",
+        .priority       = PRIORITY_NORMAL,
+        .read_only      = true,
+    },
+    {
+        .name           = "STOP",
+        .serial_message = "stop\n",
+        .priority       = PRIORITY_URGENT,
+        .read_only      = false,
+    },
+};
+
+static size_t g_num_commands = NUM_BUILTIN_COMMANDS;
+
+// Capacity of g_commands, which sizes the tables indexed by command.
+#define NUM_COMMANDS (sizeof(g_commands) / sizeof(g_commands[0]))
+
+const Command* command_utils_find(const char* name, size_t name_len)
+{
+    for (size_t i = 0; i < g_num_commands; i++)
+    {
+        if (strlen(g_commands[i].name) == name_len
+            && strncmp(g_commands[i].name, name, name_len) == 0)
+        {
+            return &g_commands[i];
+        }
+    }
+    return NULL;
+}
+
+// Define a new command. Its strings must outlive the application.
+Error command_utils_add(const Command* command_p)
+{
+    if (command_utils_find(command_p->name, strlen(command_p->name)) != NULL)
+    {
+        return ERR_INVALID;
+    }
+    if (g_num_commands == NUM_COMMANDS)
+    {
+        return ERR_OUT_OF_RANGE;
+    }
+    g_commands[g_num_commands++] = *command_p;
+    return ERR_ALL_GOOD;
+}
+
+Error command_utils_parse_priority(const char* name, size_t name_len, Priority* priority_p)
+{
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+    {
+        if (strlen(priority_names[i]) == name_len
+            && strncmp(priority_names[i], name, name_len) == 0)
+        {
+            *priority_p = (Priority)i;
+            return ERR_ALL_GOOD;
+        }
+    }
+    return ERR_INVALID;
+}
+
+// Split an instruction line of the form `[!<priority> ]<command>[\n]` into its command and
+// priority. The priority defaults to the one found in the command table.
+Error command_utils_parse_line(
+    const char* line,
+    size_t line_len,
+    const Command** command_pp,
+    Priority* priority_p)
+{
+    bool has_priority = false;
+    Priority priority = PRIORITY_NORMAL;
+    while (line_len && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+    {
+        line_len--;
+    }
+    if (line_len && line[0] == '!')
+    {
+        const char* space_p = memchr(line, ' ', line_len);
+        if (space_p == NULL
+            || is_err(command_utils_parse_priority(line + 1, space_p - line - 1, &priority)))
+        {
+            LOG_WARNING("Invalid priority prefix in `%.*s`", (int)line_len, line);
+            return ERR_INVALID;
+        }
+        has_priority = true;
+        line_len -= space_p + 1 - line;
+        line = space_p + 1;
+    }
+    *command_pp = command_utils_find(line, line_len);
+    if (*command_pp == NULL)
+    {
+        return ERR_NOT_FOUND;
+    }
+    *priority_p = has_priority ? priority : (*command_pp)->priority;
+    return ERR_ALL_GOOD;
+}
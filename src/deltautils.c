@@ -0,0 +1,135 @@
+// Delta suppression: for the commands it is enabled on, a response identical to the previous one
+// is neither logged nor forwarded to the output FIFO. A heartbeat carrying the number of identical
+// responses since the last forwarded one still goes out every `heartbeat_ms`, so that consumers can
+// tell a steady device from a silent one. Responses are compared by their 64-bit FNV-1a hash, and
+// byte by byte when the hashes match: the previous response is kept by reference, not copied. A
+// failed request forgets it, so that the response after a timeout or an error always goes out.
+#define DELTA_FNV_OFFSET (14695981039346656037ULL)
+#define DELTA_FNV_PRIME (1099511628211ULL)
+
+typedef enum
+{
+    DELTA_FORWARD,   /* First or changed response */
+    DELTA_SUPPRESS,  /* Same as the previous one */
+    DELTA_HEARTBEAT, /* Same as the previous one, but a heartbeat is due */
+} DeltaVerdict;
+
+typedef struct
+{
+    bool enabled;
+    uint64_t heartbeat_ns;
+    uint64_t hash;
+    MessageBuffer* previous_p;
+    uint64_t forwarded_ns;
+    uint32_t unchanged; /* Since the last forwarded response or heartbeat */
+    uint64_t forwarded;
+    uint64_t suppressed;
+    uint64_t heartbeats;
+} DeltaFilter;
+
+static DeltaFilter delta_filters[NUM_COMMANDS];
+
+static uint64_t _delta_utils_hash(const char* data, size_t size)
+{
+    uint64_t hash = DELTA_FNV_OFFSET;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ (uint8_t)data[i]) * DELTA_FNV_PRIME;
+    }
+    return hash;
+}
+
+// Enable delta suppression from a spec of the form `<command>:<heartbeat ms>`.
+Error delta_utils_enable(const char* spec)
+{
+    const char* colon_p = strchr(spec, ':');
+    char* end_p         = NULL;
+    if (colon_p == NULL)
+    {
+        return ERR_INVALID;
+    }
+    const Command* command_p = command_utils_find(spec, colon_p - spec);
+    uint64_t heartbeat_ms    = strtoull(colon_p + 1, &end_p, 10);
+    if (command_p == NULL || heartbeat_ms == 0 || *end_p != 0)
+    {
+        return ERR_INVALID;
+    }
+    DeltaFilter* filter_p  = &delta_filters[command_p - g_commands];
+    filter_p->enabled      = true;
+    filter_p->heartbeat_ns = heartbeat_ms * NS_PER_MS;
+    LOG_INFO(
+        "Suppressing unchanged `%s` responses, heartbeat every %" PRIu64 " ms",
+        command_p->name,
+        heartbeat_ms);
+    return ERR_ALL_GOOD;
+}
+
+// Decide whether `response_p` is forwarded. `*unchanged_p` is set to the number of identical
+// responses the heartbeat stands for.
+DeltaVerdict delta_utils_check(
+    const Command* command_p, MessageBuffer* response_p, uint64_t now_ns, uint32_t* unchanged_p)
+{
+    DeltaFilter* filter_p = &delta_filters[command_p - g_commands];
+    if (!filter_p->enabled)
+    {
+        return DELTA_FORWARD;
+    }
+    uint64_t hash = _delta_utils_hash(response_p->data, response_p->size);
+    if (filter_p->previous_p == NULL || hash != filter_p->hash
+        || filter_p->previous_p->size != response_p->size
+        || memcmp(filter_p->previous_p->data, response_p->data, response_p->size) != 0)
+    {
+        buffer_utils_release(filter_p->previous_p);
+        filter_p->previous_p   = buffer_utils_ref(response_p);
+        filter_p->hash         = hash;
+        filter_p->forwarded_ns = now_ns;
+        filter_p->unchanged    = 0;
+        filter_p->forwarded++;
+        return DELTA_FORWARD;
+    }
+    filter_p->unchanged++;
+    if (now_ns - filter_p->forwarded_ns < filter_p->heartbeat_ns)
+    {
+        filter_p->suppressed++;
+        return DELTA_SUPPRESS;
+    }
+    *unchanged_p           = filter_p->unchanged;
+    filter_p->forwarded_ns = now_ns;
+    filter_p->unchanged    = 0;
+    filter_p->heartbeats++;
+    return DELTA_HEARTBEAT;
+}
+
+// Forget the previous response of `command_p`, after a request for it failed.
+void delta_utils_reset(const Command* command_p)
+{
+    DeltaFilter* filter_p = &delta_filters[command_p - g_commands];
+    buffer_utils_release(filter_p->previous_p);
+    filter_p->previous_p = NULL;
+}
+
+void delta_utils_print_stats(void)
+{
+    for (size_t i = 0; i < NUM_COMMANDS; i++)
+    {
+        const DeltaFilter* filter_p = &delta_filters[i];
+        if (filter_p->enabled)
+        {
+            LOG_INFO(
+                "Delta %-8s | forwarded %8" PRIu64 " suppressed %8" PRIu64 " heartbeats %6" PRIu64,
+                g_commands[i].name,
+                filter_p->forwarded,
+                filter_p->suppressed,
+                filter_p->heartbeats);
+        }
+    }
+}
+
+void delta_utils_close(void)
+{
+    for (size_t i = 0; i < NUM_COMMANDS; i++)
+    {
+        buffer_utils_release(delta_filters[i].previous_p);
+        delta_filters[i].previous_p = NULL;
+    }
+}
@@ -0,0 +1,386 @@
+// Finds the Serial Device by its ID instead of its path, since the enumeration order of the ports
+// changes across reboots. Every candidate port is opened at once and asked `who are you?`; the
+// firmware answers `ID <id> CAPS <capabilities>`. The probes share a single poll() loop, so the
+// discovery takes as long as the slowest device to boot, whatever the number of ports.
+//
+// The profiles found are cached in DISCOVERY_CACHE_PATH, one `<id> <path> <baud> <caps>` line per
+// device. The next startup only asks the cached port, and probes every candidate again when the
+// device is no longer there. The ports already in use (claimed) are never probed.
+#include <glob.h>
+
+#define DISCOVERY_CACHE_PATH "artifacts/devices"
+#define DISCOVERY_DEFAULT_PATTERN "/dev/tty{USB,ACM}*"
+#define DISCOVERY_MAX_CANDIDATES (16)
+#define DISCOVERY_TIMEOUT_MS (3000) /* Boards reset when their port is opened */
+#define DISCOVERY_RETRY_MS (1000)
+#define DISCOVERY_HANDSHAKE "who are you?\n"
+#define DISCOVERY_ID_SIZE (32)    /* Keep the widths of the scanf() formats in sync */
+#define DISCOVERY_PATH_SIZE (128)
+#define DISCOVERY_CAPS_SIZE (64)
+
+typedef struct
+{
+    char id[DISCOVERY_ID_SIZE];
+    char path[DISCOVERY_PATH_SIZE];
+    uint32_t baud;
+    char caps[DISCOVERY_CAPS_SIZE];
+} DeviceProfile;
+
+typedef struct
+{
+    int fd;
+    struct termios initial_options;
+    SizedBuffer pending;
+    uint64_t asked_ns;
+    bool identified;
+    bool hung_up; /* Given up on: the port reported end of file or an error */
+    DeviceProfile profile;
+} DeviceProbe;
+
+static DeviceProbe discovery_probes[DISCOVERY_MAX_CANDIDATES];
+static DeviceProfile discovery_cache[DISCOVERY_MAX_CANDIDATES];
+static size_t discovery_cache_size = 0;
+static char discovery_claimed[DISCOVERY_MAX_CANDIDATES][DISCOVERY_PATH_SIZE];
+static size_t discovery_num_claimed = 0;
+
+// Exclude the port `path`, open by the application, from the next discoveries.
+void discovery_utils_claim(const char* path)
+{
+    if (discovery_num_claimed < DISCOVERY_MAX_CANDIDATES)
+    {
+        snprintf(discovery_claimed[discovery_num_claimed++], DISCOVERY_PATH_SIZE, "%s", path);
+    }
+}
+
+static bool _discovery_utils_is_claimed(const char* path)
+{
+    for (size_t i = 0; i < discovery_num_claimed; i++)
+    {
+        if (strcmp(discovery_claimed[i], path) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parse `ID <id> CAPS <capabilities>`, the capabilities being optional.
+Error discovery_utils_parse_identity(const char* line, DeviceProfile* profile_p)
+{
+    profile_p->caps[0] = 0;
+    if (strncmp(line, "ID ", 3) != 0
+        || sscanf(line, "ID %31s CAPS %63s", profile_p->id, profile_p->caps) < 1)
+    {
+        return ERR_INVALID;
+    }
+    return ERR_ALL_GOOD;
+}
+
+static void _discovery_utils_load_cache(const char* cache_path)
+{
+    discovery_cache_size = 0;
+    FILE* file_p         = fopen(cache_path, "r");
+    if (file_p == NULL)
+    {
+        return;
+    }
+    char line[256];
+    while (discovery_cache_size < DISCOVERY_MAX_CANDIDATES && fgets(line, sizeof(line), file_p))
+    {
+        DeviceProfile* profile_p = &discovery_cache[discovery_cache_size];
+        profile_p->caps[0]       = 0;
+        if (line[0] != '#'
+            && sscanf(
+                   line,
+                   "%31s %127s %" SCNu32 " %63s",
+                   profile_p->id,
+                   profile_p->path,
+                   &profile_p->baud,
+                   profile_p->caps)
+                   >= 3)
+        {
+            discovery_cache_size++;
+        }
+    }
+    fclose(file_p);
+}
+
+// Replace the cached profile with the same ID or the same path by `profile_p`.
+static void _discovery_utils_cache_profile(const DeviceProfile* profile_p)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < discovery_cache_size; i++)
+    {
+        if (strcmp(discovery_cache[i].id, profile_p->id) != 0
+            && strcmp(discovery_cache[i].path, profile_p->path) != 0)
+        {
+            discovery_cache[kept++] = discovery_cache[i];
+        }
+    }
+    discovery_cache_size = kept;
+    if (discovery_cache_size < DISCOVERY_MAX_CANDIDATES)
+    {
+        discovery_cache[discovery_cache_size++] = *profile_p;
+    }
+}
+
+// Written to a temporary file first so that a crash never leaves a truncated cache.
+static void _discovery_utils_save_cache(const char* cache_path)
+{
+    char tmp_path[DISCOVERY_PATH_SIZE + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    FILE* file_p = fopen(tmp_path, "w");
+    if (file_p == NULL)
+    {
+        LOG_PERROR("Failed to write the device cache `%s`", tmp_path);
+        return;
+    }
+    fprintf(file_p, "# <device id> <path> <baud> <capabilities>\n");
+    for (size_t i = 0; i < discovery_cache_size; i++)
+    {
+        const DeviceProfile* profile_p = &discovery_cache[i];
+        fprintf(
+            file_p,
+            "%s %s %" PRIu32 " %s\n",
+            profile_p->id,
+            profile_p->path,
+            profile_p->baud,
+            profile_p->caps[0] ? profile_p->caps : "-");
+    }
+    if (fclose(file_p) != 0 || rename(tmp_path, cache_path) != 0)
+    {
+        LOG_PERROR("Failed to write the device cache `%s`", cache_path);
+    }
+}
+
+static void _discovery_utils_ask(DeviceProbe* probe_p, uint64_t now_ns)
+{
+    probe_p->asked_ns = now_ns;
+    if (write(probe_p->fd, DISCOVERY_HANDSHAKE, strlen(DISCOVERY_HANDSHAKE)) < 0)
+    {
+        LOG_DEBUG("Handshake with `%s` deferred: %s", probe_p->profile.path, strerror(errno));
+    }
+}
+
+// Read the frames of a probe. The handshake is repeated when the board announces it (re)booted,
+// since a board resetting when its port is opened drops what was sent before.
+static void _discovery_utils_read_probe(DeviceProbe* probe_p, uint64_t now_ns)
+{
+    MessageBuffer* frame_p;
+    ssize_t chunk_size;
+    Error res = ERR_ALL_GOOD;
+    while (!probe_p->identified
+           && (res = usb_utils_read_available(probe_p->fd, &probe_p->pending, &chunk_size))
+                  == ERR_ALL_GOOD)
+    {
+        while (!probe_p->identified
+               && usb_utils_next_frame(&probe_p->pending, &frame_p) != ERR_NOT_FOUND)
+        {
+            if (frame_p == NULL)
+            {
+                continue;
+            }
+            if (is_ok(discovery_utils_parse_identity(frame_p->data, &probe_p->profile)))
+            {
+                probe_p->identified = true;
+            }
+            else if (strncmp(frame_p->data, "!ready", 6) == 0)
+            {
+                _discovery_utils_ask(probe_p, now_ns);
+            }
+            buffer_utils_release(frame_p);
+        }
+    }
+    if (res == ERR_UNEXPECTED)
+    {
+        LOG_WARNING("`%s` hung up during the handshake", probe_p->profile.path);
+        probe_p->hung_up = true;
+    }
+}
+
+// Probe the `num_paths` ports of `paths` in parallel, until every port answered, `wanted_id`
+// answered or `timeout_ms` elapsed. Returns the number of probes in `discovery_probes`: the ports
+// that could be opened, identified or not.
+static size_t _discovery_utils_probe(
+    char* const* paths, size_t num_paths, const char* wanted_id, uint64_t timeout_ms)
+{
+    struct pollfd polled_fds[DISCOVERY_MAX_CANDIDATES];
+    size_t num_probes = 0;
+    uint64_t now_ns   = get_monotonic_ns();
+    for (size_t i = 0; i < num_paths && num_probes < DISCOVERY_MAX_CANDIDATES; i++)
+    {
+        DeviceProbe* probe_p = &discovery_probes[num_probes];
+        memset(probe_p, 0, sizeof(DeviceProbe));
+        if (_discovery_utils_is_claimed(paths[i])
+            || is_err(usb_utils_open_serial_port(paths[i], B115200, &probe_p->fd)))
+        {
+            continue;
+        }
+        probe_p->initial_options = initial_options;
+        probe_p->profile.baud    = usb_utils_bits_per_second(B115200);
+        snprintf(probe_p->profile.path, DISCOVERY_PATH_SIZE, "%s", paths[i]);
+        _discovery_utils_ask(probe_p, now_ns);
+        num_probes++;
+    }
+
+    uint64_t deadline_ns = now_ns + timeout_ms * NS_PER_MS;
+    size_t pending       = num_probes;
+    while (pending && now_ns < deadline_ns)
+    {
+        for (size_t i = 0; i < num_probes; i++)
+        {
+            const DeviceProbe* probe_p = &discovery_probes[i];
+            polled_fds[i].fd           = probe_p->identified || probe_p->hung_up ? -1 : probe_p->fd;
+            polled_fds[i].events       = POLLIN;
+        }
+        uint64_t wait_ns = deadline_ns - now_ns;
+        if (wait_ns > DISCOVERY_RETRY_MS * NS_PER_MS)
+        {
+            wait_ns = DISCOVERY_RETRY_MS * NS_PER_MS;
+        }
+        poll(polled_fds, num_probes, (int)((wait_ns + NS_PER_MS - 1) / NS_PER_MS));
+        now_ns = get_monotonic_ns();
+        for (size_t i = 0; i < num_probes; i++)
+        {
+            DeviceProbe* probe_p = &discovery_probes[i];
+            if (probe_p->identified || probe_p->hung_up)
+            {
+                continue;
+            }
+            if (polled_fds[i].revents)
+            {
+                _discovery_utils_read_probe(probe_p, now_ns);
+            }
+            if (probe_p->hung_up)
+            {
+                pending--;
+            }
+            else if (probe_p->identified)
+            {
+                pending--;
+                LOG_INFO(
+                    "`%s` is `%s` (%s)",
+                    probe_p->profile.path,
+                    probe_p->profile.id,
+                    probe_p->profile.caps);
+                if (wanted_id != NULL && strcmp(probe_p->profile.id, wanted_id) == 0)
+                {
+                    pending = 0;
+                    break;
+                }
+            }
+            else if (now_ns - probe_p->asked_ns >= DISCOVERY_RETRY_MS * NS_PER_MS)
+            {
+                _discovery_utils_ask(probe_p, now_ns);
+            }
+        }
+    }
+    return num_probes;
+}
+
+// Keep the port of the probe `chosen` open (-1 for none) and close the others.
+static void _discovery_utils_close_probes(size_t num_probes, size_t chosen)
+{
+    for (size_t i = 0; i < num_probes; i++)
+    {
+        if (i == chosen)
+        {
+            // Restored when the application closes the port.
+            initial_options = discovery_probes[i].initial_options;
+            continue;
+        }
+        tcsetattr(discovery_probes[i].fd, TCSAFLUSH, &discovery_probes[i].initial_options);
+        close(discovery_probes[i].fd);
+    }
+}
+
+// Find the device `wanted_id` among the ports matching the glob `pattern`, or the only device
+// there if `wanted_id` is NULL. On success, its port is open on `*fd_p`. Returns ERR_NOT_FOUND if
+// no such device answered and ERR_INVALID if several devices answered and none was asked for.
+Error discovery_utils_find(
+    const char* pattern,
+    const char* wanted_id,
+    const char* cache_path,
+    DeviceProfile* profile_p,
+    int* fd_p)
+{
+    _discovery_utils_load_cache(cache_path);
+    for (size_t i = 0; wanted_id != NULL && i < discovery_cache_size; i++)
+    {
+        if (strcmp(discovery_cache[i].id, wanted_id) != 0)
+        {
+            continue;
+        }
+        char* path        = discovery_cache[i].path;
+        size_t num_probes = _discovery_utils_probe(&path, 1, wanted_id, DISCOVERY_TIMEOUT_MS);
+        if (num_probes && discovery_probes[0].identified
+            && strcmp(discovery_probes[0].profile.id, wanted_id) == 0)
+        {
+            LOG_INFO("Reconnected to `%s` through the cached path `%s`", wanted_id, path);
+            _discovery_utils_close_probes(num_probes, 0);
+            *profile_p = discovery_probes[0].profile;
+            *fd_p      = discovery_probes[0].fd;
+            discovery_utils_claim(path);
+            return ERR_ALL_GOOD;
+        }
+        LOG_WARNING("`%s` is no longer at `%s`, probing every port", wanted_id, path);
+        _discovery_utils_close_probes(num_probes, SIZE_MAX);
+        break;
+    }
+
+    glob_t candidates;
+    if (glob(pattern, GLOB_BRACE, NULL, &candidates) != 0)
+    {
+        LOG_ERROR("No port matches `%s`", pattern);
+        return ERR_NOT_FOUND;
+    }
+    uint64_t started_ns = get_monotonic_ns();
+    UNUSED(started_ns); /* When LOG_LEVEL is below LEVEL_INFO */
+    size_t num_probes = _discovery_utils_probe(
+        candidates.gl_pathv, candidates.gl_pathc, wanted_id, DISCOVERY_TIMEOUT_MS);
+    globfree(&candidates);
+
+    size_t chosen    = SIZE_MAX;
+    size_t num_found = 0;
+    for (size_t i = 0; i < num_probes; i++)
+    {
+        const DeviceProbe* probe_p = &discovery_probes[i];
+        if (!probe_p->identified)
+        {
+            continue;
+        }
+        num_found++;
+        _discovery_utils_cache_profile(&probe_p->profile);
+        if (wanted_id == NULL ? num_found == 1 : strcmp(probe_p->profile.id, wanted_id) == 0)
+        {
+            chosen = i;
+        }
+    }
+    LOG_INFO(
+        "Probed %zu ports in %" PRIu64 " ms, %zu devices answered",
+        num_probes,
+        (get_monotonic_ns() - started_ns) / 1000000,
+        num_found);
+    if (num_found)
+    {
+        _discovery_utils_save_cache(cache_path);
+    }
+    if (wanted_id == NULL && num_found > 1)
+    {
+        LOG_ERROR("Several devices answered, choose one by its ID");
+        chosen = SIZE_MAX;
+    }
+    else if (chosen == SIZE_MAX)
+    {
+        LOG_ERROR("`%s` did not answer", wanted_id ? wanted_id : "Any device");
+    }
+    _discovery_utils_close_probes(num_probes, chosen);
+    if (chosen == SIZE_MAX)
+    {
+        return num_found > 1 && wanted_id == NULL ? ERR_INVALID : ERR_NOT_FOUND;
+    }
+    *profile_p = discovery_probes[chosen].profile;
+    *fd_p      = discovery_probes[chosen].fd;
+    discovery_utils_claim(profile_p->path);
+    return ERR_ALL_GOOD;
+}
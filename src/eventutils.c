@@ -0,0 +1,135 @@
+// Unsolicited messages sent by the Serial Device (alarms, streamed samples, boot banners...) are
+// published to every subscriber. A subscriber registers with the FIFO instruction
+// `SUBSCRIBE <name>` and reads the events, one per line, from `artifacts/events_<name>`.
+#define EVENTS_FIFO_PREFIX "artifacts/events_"
+#define EVENT_PREFIX '!' /* Frames starting with it are events even while a request is pending */
+#define MAX_SUBSCRIBERS (8)
+#define SUBSCRIBER_NAME_MAX_LEN (32)
+
+typedef struct
+{
+    char name[SUBSCRIBER_NAME_MAX_LEN + 1];
+    int fd;
+    uint64_t published;
+    uint64_t dropped;
+} Subscriber;
+
+static Subscriber subscribers[MAX_SUBSCRIBERS];
+static size_t num_subscribers = 0;
+
+static bool _event_utils_is_valid_name(const char* name, size_t name_len)
+{
+    if (name_len == 0 || name_len > SUBSCRIBER_NAME_MAX_LEN)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < name_len; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Subscriber* _event_utils_find(const char* name, size_t name_len)
+{
+    for (size_t i = 0; i < num_subscribers; i++)
+    {
+        if (strlen(subscribers[i].name) == name_len
+            && strncmp(subscribers[i].name, name, name_len) == 0)
+        {
+            return &subscribers[i];
+        }
+    }
+    return NULL;
+}
+
+// Subscriber names are restricted to `[A-Za-z0-9_]` as they end up in a path.
+Error event_utils_subscribe(const char* name, size_t name_len)
+{
+    char path[sizeof(EVENTS_FIFO_PREFIX) + SUBSCRIBER_NAME_MAX_LEN];
+    if (!_event_utils_is_valid_name(name, name_len))
+    {
+        LOG_WARNING("Invalid subscriber name `%.*s`", (int)name_len, name);
+        return ERR_INVALID;
+    }
+    if (_event_utils_find(name, name_len) != NULL)
+    {
+        return ERR_ALL_GOOD;
+    }
+    if (num_subscribers == MAX_SUBSCRIBERS)
+    {
+        LOG_WARNING("Too many subscribers, rejecting `%.*s`", (int)name_len, name);
+        return ERR_OUT_OF_RANGE;
+    }
+    snprintf(path, sizeof(path), "%s%.*s", EVENTS_FIFO_PREFIX, (int)name_len, name);
+    fifo_utils_make_fifo(path);
+    // Opened read-write so that a subscriber that is not reading (yet) never blocks the device.
+    int fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        LOG_PERROR("Failed to open FIFO `%s`", path);
+        return ERR_FS_INTERNAL;
+    }
+    Subscriber* subscriber_p = &subscribers[num_subscribers++];
+    memset(subscriber_p, 0, sizeof(Subscriber));
+    memcpy(subscriber_p->name, name, name_len);
+    subscriber_p->fd = fd;
+    LOG_INFO("`%s` subscribed to device events through `%s`", subscriber_p->name, path);
+    return ERR_ALL_GOOD;
+}
+
+Error event_utils_unsubscribe(const char* name, size_t name_len)
+{
+    Subscriber* subscriber_p = _event_utils_find(name, name_len);
+    if (subscriber_p == NULL)
+    {
+        return ERR_NOT_FOUND;
+    }
+    close(subscriber_p->fd);
+    *subscriber_p = subscribers[--num_subscribers];
+    return ERR_ALL_GOOD;
+}
+
+bool event_utils_is_event(const char* frame, size_t size)
+{
+    return size && frame[0] == EVENT_PREFIX;
+}
+
+void event_utils_publish(const char* frame, size_t size)
+{
+    LOG_INFO("Event: %.*s", (int)strcspn(frame, "\n"), frame);
+    for (size_t i = 0; i < num_subscribers; i++)
+    {
+        if (write(subscribers[i].fd, frame, size) == (ssize_t)size)
+        {
+            subscribers[i].published++;
+        }
+        else
+        {
+            subscribers[i].dropped++;
+        }
+    }
+}
+
+void event_utils_print_stats(void)
+{
+    for (size_t i = 0; i < num_subscribers; i++)
+    {
+        LOG_INFO(
+            "Subscriber %-12s | published %6" PRIu64 " dropped %4" PRIu64,
+            subscribers[i].name,
+            subscribers[i].published,
+            subscribers[i].dropped);
+    }
+}
+
+void event_utils_close(void)
+{
+    while (num_subscribers)
+    {
+        close(subscribers[--num_subscribers].fd);
+    }
+}
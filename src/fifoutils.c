@@ -54,10 +54,16 @@ Error fifo_utils_read_line(SizedBuffer* fifo_buffer_p, int fifo_fd)
     ssize_t bytes_read = 0;
     char c;
     ssize_t tmp;
-    while (bytes_read < COMMUNICATION_BUFF_IN_SIZE)
+    // Keep room for the terminating null character.
+    while (bytes_read < COMMUNICATION_BUFF_IN_SIZE - 1)
     {
         tmp = read(fifo_fd, &c, 1);
-        if (tmp < 0)
+        if (tmp < 0 && errno == EAGAIN)
+        {
+            // Nothing left to read from a non-blocking FIFO.
+            break;
+        }
+        else if (tmp < 0)
         {
             printf("Failed to read from FIFO `%s`.\n", FIFO_IN);
             return ERR_FATAL;
@@ -76,10 +82,16 @@ Error fifo_utils_read_line(SizedBuffer* fifo_buffer_p, int fifo_fd)
             }
         }
     }
-    fifo_buffer_p->size = bytes_read;
+    fifo_buffer_p->buffer[bytes_read] = 0;
+    fifo_buffer_p->size               = bytes_read;
     if (bytes_read)
     {
-        printf("Received: `%s`, bytes: %lu.\n", fifo_buffer_p->buffer, bytes_read);
+        LOG_DEBUG_EVERY(
+            100,
+            "Received: `%.*s`, bytes: %zd",
+            (int)strcspn(fifo_buffer_p->buffer, "\n"),
+            fifo_buffer_p->buffer,
+            bytes_read);
     }
     return ERR_ALL_GOOD;
 }
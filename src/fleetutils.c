@@ -0,0 +1,435 @@
+// Fleet: the peer devices attached next to the primary one (`-D`). A broadcast request
+// (`BROADCAST <command>`) writes its command to the primary device and to every peer at once, then
+// gathers the replies concurrently until every device answered or a single deadline passed. One
+// combined result lists the status, latency and response of each device, the latencies being
+// measured from the start of the broadcast.
+//
+// The primary device keeps its own request path in `main.c`, which hands its part of a broadcast
+// over with fleet_utils_on_primary(). The peers are only used by broadcasts and by the hedged
+// requests (see `src/hedgeutils.c`), sent to the first peer: an event frame from a peer is
+// published as usual, and a reply arriving after it was given up on is discarded like the late
+// replies of the primary device (see `src/rttutils.c`).
+#define FLEET_MAX_PEERS (7)
+#define FLEET_MAX_DEVICES (FLEET_MAX_PEERS + 1)
+#define FLEET_DEFAULT_DEADLINE_MS (1000)
+
+typedef struct
+{
+    DeviceProfile profile;
+    int fd;
+    SizedBuffer pending;
+    SerialWriteQueue writes;
+    bool hedging; /* A hedged request awaits its reply */
+    const Command* hedge_command_p;
+    uint64_t hedged_ns;
+    RttLedger ledger; /* Replies given up on, discarded when they arrive */
+    uint64_t replies;
+    uint64_t timeouts;
+    uint64_t late;
+} FleetPeer;
+
+typedef struct
+{
+    const char* device; /* ID, or path when the device has none */
+    bool done;
+    Error status;       /* ERR_TIMEOUT if the device did not answer in time */
+    uint64_t latency_ns;
+    MessageBuffer* response_p;
+} BroadcastReply;
+
+// Called with the replies of the primary device (first) and of the peers.
+typedef void (*BroadcastCallback)(
+    const Request* request_p, const BroadcastReply* replies, size_t num_replies);
+// Called with the reply of a peer to a hedged request.
+typedef void (*HedgeCallback)(MessageBuffer* response_p);
+
+typedef struct
+{
+    FleetPeer peers[FLEET_MAX_PEERS];
+    size_t num_peers;
+    uint64_t deadline_ns;
+    BroadcastCallback publish;
+    HedgeCallback answer_hedge;
+    bool gathering;
+    Request request;
+    uint64_t until_ns;
+    BroadcastReply replies[FLEET_MAX_DEVICES];
+    size_t num_pending;
+    uint64_t broadcasts;
+    uint64_t complete; /* Every device answered */
+    uint64_t max_gather_ns;
+} Fleet;
+
+void fleet_utils_init(
+    Fleet* fleet_p, uint64_t deadline_ms, BroadcastCallback publish, HedgeCallback answer_hedge)
+{
+    memset(fleet_p, 0, sizeof(Fleet));
+    fleet_p->deadline_ns  = deadline_ms * NS_PER_MS;
+    fleet_p->publish      = publish;
+    fleet_p->answer_hedge = answer_hedge;
+}
+
+// Attach a peer given by its path, or by its ID among the ports matching `pattern`.
+Error fleet_utils_add(Fleet* fleet_p, const char* spec, const char* pattern)
+{
+    if (fleet_p->num_peers == FLEET_MAX_PEERS)
+    {
+        LOG_ERROR("At most %d peer devices are supported", FLEET_MAX_PEERS);
+        return ERR_OUT_OF_RANGE;
+    }
+    FleetPeer* peer_p = &fleet_p->peers[fleet_p->num_peers];
+    Error res;
+    memset(peer_p, 0, sizeof(FleetPeer));
+    if (strchr(spec, '/') == NULL)
+    {
+        res = discovery_utils_find(
+            pattern, spec, DISCOVERY_CACHE_PATH, &peer_p->profile, &peer_p->fd);
+        if (is_err(res))
+        {
+            return res;
+        }
+    }
+    else
+    {
+        res = usb_utils_open_serial_port(spec, B115200, &peer_p->fd);
+        if (is_err(res))
+        {
+            return res;
+        }
+        snprintf(peer_p->profile.path, DISCOVERY_PATH_SIZE, "%s", spec);
+        peer_p->profile.baud = usb_utils_bits_per_second(B115200);
+        discovery_utils_claim(spec);
+    }
+    usb_utils_write_queue_init(&peer_p->writes, peer_p->profile.baud);
+    fleet_p->num_peers++;
+    LOG_INFO(
+        "Peer device `%s` on `%s`",
+        peer_p->profile.id[0] ? peer_p->profile.id : "?",
+        peer_p->profile.path);
+    return ERR_ALL_GOOD;
+}
+
+bool fleet_utils_is_gathering(const Fleet* fleet_p)
+{
+    return fleet_p->gathering;
+}
+
+static void _fleet_utils_reply(
+    Fleet* fleet_p, size_t index, Error status, MessageBuffer* response_p, uint64_t now_ns)
+{
+    BroadcastReply* reply_p = &fleet_p->replies[index];
+    if (reply_p->done)
+    {
+        return;
+    }
+    reply_p->done       = true;
+    reply_p->status     = status;
+    reply_p->latency_ns = now_ns - fleet_p->request.dispatched_ns;
+    reply_p->response_p = response_p ? buffer_utils_ref(response_p) : NULL;
+    fleet_p->num_pending--;
+    if (index > 0 && status == ERR_ALL_GOOD)
+    {
+        fleet_p->peers[index - 1].replies++;
+    }
+    else if (index > 0 && status == ERR_TIMEOUT)
+    {
+        fleet_p->peers[index - 1].timeouts++;
+    }
+}
+
+static void _fleet_utils_finish(Fleet* fleet_p, uint64_t now_ns)
+{
+    size_t num_replies = fleet_p->num_peers + 1;
+    uint64_t gather_ns = now_ns - fleet_p->request.dispatched_ns;
+    bool complete      = true;
+    for (size_t i = 0; i < num_replies; i++)
+    {
+        complete = complete && fleet_p->replies[i].status == ERR_ALL_GOOD;
+    }
+    fleet_p->complete += complete;
+    if (gather_ns > fleet_p->max_gather_ns)
+    {
+        fleet_p->max_gather_ns = gather_ns;
+    }
+    fleet_p->gathering = false;
+    fleet_p->publish(&fleet_p->request, fleet_p->replies, num_replies);
+    for (size_t i = 0; i < num_replies; i++)
+    {
+        buffer_utils_release(fleet_p->replies[i].response_p);
+        fleet_p->replies[i].response_p = NULL;
+    }
+}
+
+// Write the command of `request_p` to every peer and start gathering. The primary device, named
+// `primary`, is expected to be written to by the caller, with fleet_p->until_ns as its deadline.
+void fleet_utils_broadcast(Fleet* fleet_p, const Request* request_p, const char* primary)
+{
+    const char* message  = request_p->command_p->serial_message;
+    size_t size          = strlen(message);
+    fleet_p->request     = *request_p;
+    fleet_p->until_ns    = request_p->dispatched_ns + fleet_p->deadline_ns;
+    fleet_p->gathering   = true;
+    fleet_p->num_pending = fleet_p->num_peers + 1;
+    fleet_p->broadcasts++;
+    memset(fleet_p->replies, 0, sizeof(fleet_p->replies));
+    fleet_p->replies[0].device = primary;
+    fleet_p->replies[0].status = ERR_TIMEOUT;
+    for (size_t i = 0; i < fleet_p->num_peers; i++)
+    {
+        FleetPeer* peer_p              = &fleet_p->peers[i];
+        fleet_p->replies[i + 1].device = peer_p->profile.id[0] ? peer_p->profile.id
+                                                               : peer_p->profile.path;
+        fleet_p->replies[i + 1].status = ERR_TIMEOUT;
+        if (peer_p->fd < 0)
+        {
+            _fleet_utils_reply(fleet_p, i + 1, ERR_UNEXPECTED, NULL, request_p->dispatched_ns);
+        }
+        else if (is_err(usb_utils_enqueue_write(&peer_p->writes, message, size)))
+        {
+            _fleet_utils_reply(fleet_p, i + 1, ERR_OUT_OF_RANGE, NULL, request_p->dispatched_ns);
+        }
+        else if (usb_utils_flush_writes(peer_p->fd, &peer_p->writes, request_p->dispatched_ns)
+                 == ERR_UNEXPECTED)
+        {
+            _fleet_utils_reply(fleet_p, i + 1, ERR_UNEXPECTED, NULL, request_p->dispatched_ns);
+        }
+    }
+}
+
+// Give up on the reply of a peer to `command_p` dispatched at `dispatched_ns`: it is discarded if
+// it arrives by `until_ns`. A message not entirely written is dropped instead, since no reply is
+// expected.
+static void _fleet_utils_give_up(
+    FleetPeer* peer_p, const Command* command_p, uint64_t dispatched_ns, uint64_t until_ns)
+{
+    if (peer_p->writes.size)
+    {
+        usb_utils_discard_writes(&peer_p->writes);
+        return;
+    }
+    rtt_utils_owe(&peer_p->ledger, command_p, dispatched_ns, until_ns);
+}
+
+// Send the command of `request_p` to the peer `index` as a hedge. Its reply goes to the hedge
+// callback, unless fleet_utils_cancel_hedge() is called first.
+Error fleet_utils_hedge(Fleet* fleet_p, size_t index, const Request* request_p, uint64_t now_ns)
+{
+    FleetPeer* peer_p   = &fleet_p->peers[index];
+    const char* message = request_p->command_p->serial_message;
+    if (index >= fleet_p->num_peers || peer_p->fd < 0)
+    {
+        return ERR_UNEXPECTED;
+    }
+    Error res = usb_utils_enqueue_write(&peer_p->writes, message, strlen(message));
+    if (is_err(res))
+    {
+        return res;
+    }
+    peer_p->hedging         = true;
+    peer_p->hedge_command_p = request_p->command_p;
+    peer_p->hedged_ns       = now_ns;
+    if (usb_utils_flush_writes(peer_p->fd, &peer_p->writes, now_ns) == ERR_UNEXPECTED)
+    {
+        peer_p->hedging = false;
+        return ERR_UNEXPECTED;
+    }
+    return ERR_ALL_GOOD;
+}
+
+// The primary device answered first, or the request was given up on: the reply of the peer, if it
+// arrives before `until_ns`, is discarded.
+void fleet_utils_cancel_hedge(Fleet* fleet_p, size_t index, uint64_t until_ns)
+{
+    FleetPeer* peer_p = &fleet_p->peers[index];
+    if (index >= fleet_p->num_peers || !peer_p->hedging)
+    {
+        return;
+    }
+    peer_p->hedging = false;
+    _fleet_utils_give_up(peer_p, peer_p->hedge_command_p, peer_p->hedged_ns, until_ns);
+}
+
+// Hand over the part of the primary device, once it answered or timed out.
+void fleet_utils_on_primary(Fleet* fleet_p, Error res, MessageBuffer* response_p, uint64_t now_ns)
+{
+    if (!fleet_p->gathering)
+    {
+        return;
+    }
+    _fleet_utils_reply(fleet_p, 0, res, response_p, now_ns);
+    if (fleet_p->num_pending == 0)
+    {
+        _fleet_utils_finish(fleet_p, now_ns);
+    }
+}
+
+// Fill the FLEET_MAX_PEERS entries of `polled_fds` and bound the poll() timeout by the deadline
+// and by the pacing of the peer writes.
+int fleet_utils_prepare_poll(
+    const Fleet* fleet_p, struct pollfd* polled_fds, uint64_t now_ns, int timeout_ms)
+{
+    for (size_t i = 0; i < FLEET_MAX_PEERS; i++)
+    {
+        const FleetPeer* peer_p = &fleet_p->peers[i];
+        polled_fds[i].fd        = i < fleet_p->num_peers ? peer_p->fd : -1;
+        polled_fds[i].events    = POLLIN;
+        polled_fds[i].revents   = 0;
+        if (i < fleet_p->num_peers && peer_p->writes.size)
+        {
+            polled_fds[i].events |= usb_utils_write_is_blocked(&peer_p->writes) ? POLLOUT : 0;
+            timeout_ms = usb_utils_write_timeout_ms(&peer_p->writes, now_ns, timeout_ms);
+        }
+    }
+    if (fleet_p->gathering)
+    {
+        int deadline_ms = fleet_p->until_ns > now_ns
+                              ? (int)((fleet_p->until_ns - now_ns + NS_PER_MS - 1) / NS_PER_MS)
+                              : 0;
+        timeout_ms      = deadline_ms < timeout_ms ? deadline_ms : timeout_ms;
+    }
+    return timeout_ms;
+}
+
+static void _fleet_utils_lose(Fleet* fleet_p, size_t index, uint64_t now_ns)
+{
+    FleetPeer* peer_p = &fleet_p->peers[index];
+    LOG_ERROR("Lost the peer device on `%s`", peer_p->profile.path);
+    close(peer_p->fd);
+    peer_p->fd      = -1;
+    peer_p->hedging = false;
+    if (fleet_p->gathering)
+    {
+        _fleet_utils_reply(fleet_p, index + 1, ERR_UNEXPECTED, NULL, now_ns);
+    }
+}
+
+static void _fleet_utils_read(Fleet* fleet_p, size_t index, uint64_t now_ns)
+{
+    FleetPeer* peer_p = &fleet_p->peers[index];
+    MessageBuffer* frame_p;
+    ssize_t chunk_size;
+    RttOwed owed;
+    Error res;
+    while ((res = usb_utils_read_available(peer_p->fd, &peer_p->pending, &chunk_size))
+           == ERR_ALL_GOOD)
+    {
+        while ((res = usb_utils_next_frame(&peer_p->pending, &frame_p)) != ERR_NOT_FOUND)
+        {
+            if (res == ERR_OUT_OF_RANGE)
+            {
+                LOG_WARNING("Message buffer pool exhausted, dropped a frame");
+                continue;
+            }
+            if (event_utils_is_event(frame_p->data, frame_p->size))
+            {
+                event_utils_publish(frame_p->data, frame_p->size);
+            }
+            else if (rtt_utils_take_late(&peer_p->ledger, now_ns, &owed))
+            {
+                peer_p->late++;
+                LOG_DEBUG("Discarded a reply given up on from `%s`", peer_p->profile.path);
+            }
+            else if (fleet_p->gathering && !fleet_p->replies[index + 1].done)
+            {
+                _fleet_utils_reply(fleet_p, index + 1, ERR_ALL_GOOD, frame_p, now_ns);
+            }
+            else if (peer_p->hedging)
+            {
+                peer_p->hedging = false;
+                peer_p->replies++;
+                fleet_p->answer_hedge(frame_p);
+            }
+            else
+            {
+                peer_p->late++;
+                LOG_DEBUG("Discarded a late reply from `%s`", peer_p->profile.path);
+            }
+            buffer_utils_release(frame_p);
+        }
+    }
+    if (res == ERR_UNEXPECTED)
+    {
+        _fleet_utils_lose(fleet_p, index, now_ns);
+    }
+}
+
+// Read and write the peers `polled_fds` reports ready, and complete the broadcast once every device
+// answered or the deadline passed.
+void fleet_utils_on_poll(Fleet* fleet_p, const struct pollfd* polled_fds, uint64_t now_ns)
+{
+    for (size_t i = 0; i < fleet_p->num_peers; i++)
+    {
+        FleetPeer* peer_p = &fleet_p->peers[i];
+        if (peer_p->fd >= 0 && (polled_fds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            _fleet_utils_read(fleet_p, i, now_ns);
+        }
+        if (peer_p->fd >= 0 && peer_p->writes.size
+            && (!usb_utils_write_is_blocked(&peer_p->writes) || (polled_fds[i].revents & POLLOUT))
+            && usb_utils_flush_writes(peer_p->fd, &peer_p->writes, now_ns) == ERR_UNEXPECTED)
+        {
+            _fleet_utils_lose(fleet_p, i, now_ns);
+        }
+    }
+    if (!fleet_p->gathering)
+    {
+        return;
+    }
+    if (now_ns >= fleet_p->until_ns)
+    {
+        for (size_t i = 0; i < fleet_p->num_peers; i++)
+        {
+            if (!fleet_p->replies[i + 1].done)
+            {
+                // A straggler may still answer within another deadline.
+                _fleet_utils_give_up(
+                    &fleet_p->peers[i],
+                    fleet_p->request.command_p,
+                    fleet_p->request.dispatched_ns,
+                    now_ns + fleet_p->deadline_ns);
+            }
+            _fleet_utils_reply(fleet_p, i + 1, ERR_TIMEOUT, NULL, now_ns);
+        }
+    }
+    // The primary device is given up on by the caller, at the same deadline.
+    if (fleet_p->num_pending == 0)
+    {
+        _fleet_utils_finish(fleet_p, now_ns);
+    }
+}
+
+void fleet_utils_print_stats(const Fleet* fleet_p)
+{
+    if (fleet_p->broadcasts == 0)
+    {
+        return;
+    }
+    LOG_INFO(
+        "Broadcast | %" PRIu64 " sent, %" PRIu64 " answered by every device | max %" PRIu64 " us",
+        fleet_p->broadcasts,
+        fleet_p->complete,
+        fleet_p->max_gather_ns / 1000);
+    for (size_t i = 0; i < fleet_p->num_peers; i++)
+    {
+        const FleetPeer* peer_p = &fleet_p->peers[i];
+        UNUSED(peer_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        LOG_INFO(
+            "Peer %-16s | replies %8" PRIu64 " timeouts %6" PRIu64 " late %6" PRIu64,
+            peer_p->profile.id[0] ? peer_p->profile.id : peer_p->profile.path,
+            peer_p->replies,
+            peer_p->timeouts,
+            peer_p->late);
+    }
+}
+
+void fleet_utils_close(Fleet* fleet_p)
+{
+    for (size_t i = 0; i < fleet_p->num_peers; i++)
+    {
+        if (fleet_p->peers[i].fd >= 0)
+        {
+            close(fleet_p->peers[i].fd);
+            fleet_p->peers[i].fd = -1;
+        }
+    }
+}
@@ -0,0 +1,191 @@
+// Hedged requests (`-H <percentile>`): a read-only command the primary device has not answered
+// within the given percentile of its recent latencies is sent again to the secondary device, the
+// first peer of `-D`. Whichever device answers first completes the request, and the reply of the
+// other one is discarded when it arrives. With `-H 95`, about 5% of the requests are hedged.
+//
+// The latencies are measured from the dispatch of the requests. The hedge delay of a command is
+// taken from the last HEDGE_WINDOW latencies of the primary device, kept sorted, and nothing is
+// hedged before HEDGE_MIN_SAMPLES of them. A request the primary device lost to the secondary one
+// or did not answer in time counts there as a censored sample, the time it lasted: a lower bound
+// of its latency, above the hedge delay, so that the percentile is not biased low. The latencies
+// without hedging, compared in `STATS` with the delivered ones, take the late replies instead.
+#define HEDGE_WINDOW (1024)
+#define HEDGE_MIN_SAMPLES (16)
+
+// The last HEDGE_WINDOW samples, in arrival order and sorted.
+typedef struct
+{
+    uint64_t ring_ns[HEDGE_WINDOW];
+    uint64_t sorted_ns[HEDGE_WINDOW];
+    size_t count;
+    size_t next;
+} HedgeWindow;
+
+typedef struct
+{
+    HedgeWindow primary;  /* With the censored samples, for the hedge delay */
+    HedgeWindow unhedged; /* Replies of the primary device, late ones included */
+    HedgeWindow delivered;
+    uint64_t requests;
+    uint64_t hedged;
+    uint64_t secondary_wins;
+} HedgeCommand;
+
+typedef struct
+{
+    double percentile; /* 0 when hedging is disabled */
+    HedgeCommand commands[NUM_COMMANDS];
+} Hedger;
+
+void hedge_utils_init(Hedger* hedger_p, double percentile)
+{
+    memset(hedger_p, 0, sizeof(Hedger));
+    hedger_p->percentile = percentile;
+}
+
+// Parse a percentile of the form `<p>`, with 0 < p < 100.
+Error hedge_utils_parse_percentile(const char* spec, double* percentile_p)
+{
+    char* end_p;
+    double percentile = strtod(spec, &end_p);
+    if (end_p == spec || *end_p != 0 || !(percentile > 0 && percentile < 100))
+    {
+        return ERR_INVALID;
+    }
+    *percentile_p = percentile / 100;
+    return ERR_ALL_GOOD;
+}
+
+// Whether requests for `command_p` are hedged, once enough latencies are known.
+bool hedge_utils_applies(const Hedger* hedger_p, const Command* command_p)
+{
+    return hedger_p->percentile > 0 && command_p->read_only;
+}
+
+static void _hedge_utils_add(HedgeWindow* window_p, uint64_t sample_ns)
+{
+    size_t count = window_p->count;
+    if (count == HEDGE_WINDOW)
+    {
+        // Forget the oldest sample: found in the sorted samples with a binary search.
+        uint64_t oldest_ns = window_p->ring_ns[window_p->next];
+        size_t low         = 0;
+        size_t high        = count;
+        while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            if (window_p->sorted_ns[middle] < oldest_ns)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        count--;
+        memmove(
+            &window_p->sorted_ns[low],
+            &window_p->sorted_ns[low + 1],
+            (count - low) * sizeof(uint64_t));
+    }
+    size_t position = count;
+    while (position > 0 && window_p->sorted_ns[position - 1] > sample_ns)
+    {
+        window_p->sorted_ns[position] = window_p->sorted_ns[position - 1];
+        position--;
+    }
+    window_p->sorted_ns[position]     = sample_ns;
+    window_p->ring_ns[window_p->next] = sample_ns;
+    window_p->next                    = (window_p->next + 1) % HEDGE_WINDOW;
+    window_p->count                   = count + 1;
+}
+
+static uint64_t _hedge_utils_quantile_ns(const HedgeWindow* window_p, double quantile)
+{
+    if (window_p->count == 0)
+    {
+        return 0;
+    }
+    return window_p->sorted_ns[(size_t)(quantile * (double)(window_p->count - 1) + 0.5)];
+}
+
+// Count a dispatched request and return its hedge delay, UINT64_MAX if it is not to be hedged.
+uint64_t hedge_utils_on_dispatched(Hedger* hedger_p, const Command* command_p)
+{
+    if (!hedge_utils_applies(hedger_p, command_p))
+    {
+        return UINT64_MAX;
+    }
+    HedgeCommand* command_stats_p = &hedger_p->commands[command_p - g_commands];
+    command_stats_p->requests++;
+    if (command_stats_p->primary.count < HEDGE_MIN_SAMPLES)
+    {
+        return UINT64_MAX;
+    }
+    return _hedge_utils_quantile_ns(&command_stats_p->primary, hedger_p->percentile);
+}
+
+void hedge_utils_on_hedged(Hedger* hedger_p, const Command* command_p)
+{
+    hedger_p->commands[command_p - g_commands].hedged++;
+}
+
+// Latency of a reply of the primary device that completed a request.
+void hedge_utils_on_primary(Hedger* hedger_p, const Command* command_p, uint64_t latency_ns)
+{
+    HedgeCommand* command_stats_p = &hedger_p->commands[command_p - g_commands];
+    _hedge_utils_add(&command_stats_p->primary, latency_ns);
+    _hedge_utils_add(&command_stats_p->unhedged, latency_ns);
+}
+
+// The primary device did not answer first, or in time, a request that lasted `lasted_ns`.
+void hedge_utils_on_censored(Hedger* hedger_p, const Command* command_p, uint64_t lasted_ns)
+{
+    _hedge_utils_add(&hedger_p->commands[command_p - g_commands].primary, lasted_ns);
+}
+
+// Latency of a reply of the primary device received after its request was completed.
+void hedge_utils_on_late(Hedger* hedger_p, const Command* command_p, uint64_t latency_ns)
+{
+    _hedge_utils_add(&hedger_p->commands[command_p - g_commands].unhedged, latency_ns);
+}
+
+// Latency of the reply that completed a request.
+void hedge_utils_on_delivered(
+    Hedger* hedger_p, const Command* command_p, uint64_t latency_ns, bool by_secondary)
+{
+    HedgeCommand* command_stats_p = &hedger_p->commands[command_p - g_commands];
+    _hedge_utils_add(&command_stats_p->delivered, latency_ns);
+    command_stats_p->secondary_wins += by_secondary;
+}
+
+void hedge_utils_print_stats(const Hedger* hedger_p)
+{
+    if (hedger_p->percentile == 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < g_num_commands; i++)
+    {
+        const HedgeCommand* command_stats_p = &hedger_p->commands[i];
+        UNUSED(command_stats_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        if (!g_commands[i].read_only)
+        {
+            continue;
+        }
+        LOG_INFO(
+            "Hedge %-8s | %6" PRIu64 " requests %5" PRIu64 " hedged (%5.2f%%) %5" PRIu64
+            " won by the secondary | delay %8" PRIu64 " us | p99 %8" PRIu64
+            " us primary only, %8" PRIu64 " us delivered",
+            g_commands[i].name,
+            command_stats_p->requests,
+            command_stats_p->hedged,
+            command_stats_p->requests ? 100.0 * command_stats_p->hedged / command_stats_p->requests
+                                      : 0.0,
+            command_stats_p->secondary_wins,
+            _hedge_utils_quantile_ns(&command_stats_p->primary, hedger_p->percentile) / 1000,
+            _hedge_utils_quantile_ns(&command_stats_p->unhedged, 0.99) / 1000,
+            _hedge_utils_quantile_ns(&command_stats_p->delivered, 0.99) / 1000);
+    }
+}
@@ -0,0 +1,201 @@
+// Streaming JSON encoder. It never allocates: everything is written straight into the buffer
+// provided by the caller. If the buffer is too small, the writer is marked as overflowed, further
+// calls are ignored and `json_utils_finish()` returns ERR_OUT_OF_RANGE.
+#include <math.h>
+
+#define JSON_MAX_DEPTH (32)
+
+typedef struct
+{
+    char* buffer;
+    size_t capacity;
+    size_t size;
+    uint32_t has_members; /* Bit `n` is set once the object at depth `n` has a member */
+    uint8_t depth;
+    bool overflow;
+} JsonWriter;
+
+void json_utils_init(JsonWriter* writer_p, char* buffer, size_t capacity)
+{
+    writer_p->buffer      = buffer;
+    writer_p->capacity    = capacity;
+    writer_p->size        = 0;
+    writer_p->has_members = 0;
+    writer_p->depth       = 0;
+    writer_p->overflow    = false;
+}
+
+static void _json_utils_put(JsonWriter* writer_p, const char* data, size_t size)
+{
+    if (writer_p->overflow || writer_p->size + size > writer_p->capacity)
+    {
+        writer_p->overflow = true;
+        return;
+    }
+    memcpy(writer_p->buffer + writer_p->size, data, size);
+    writer_p->size += size;
+}
+
+static void _json_utils_put_char(JsonWriter* writer_p, char c)
+{
+    if (writer_p->overflow || writer_p->size == writer_p->capacity)
+    {
+        writer_p->overflow = true;
+        return;
+    }
+    writer_p->buffer[writer_p->size++] = c;
+}
+
+static void _json_utils_put_escaped(JsonWriter* writer_p, const char* value, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    _json_utils_put_char(writer_p, '"');
+    size_t start = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = (unsigned char)value[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+        // Copy the run of characters that need no escaping in one go.
+        _json_utils_put(writer_p, value + start, i - start);
+        start = i + 1;
+        switch (c)
+        {
+        case '"':
+            _json_utils_put(writer_p, "\\\"", 2);
+            break;
+        case '\\':
+            _json_utils_put(writer_p, "\\\\", 2);
+            break;
+        case '\n':
+            _json_utils_put(writer_p, "\\n", 2);
+            break;
+        case '\r':
+            _json_utils_put(writer_p, "\\r", 2);
+            break;
+        case '\t':
+            _json_utils_put(writer_p, "\\t", 2);
+            break;
+        default:
+        {
+            char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            _json_utils_put(writer_p, escaped, sizeof(escaped));
+        }
+        }
+    }
+    _json_utils_put(writer_p, value + start, size - start);
+    _json_utils_put_char(writer_p, '"');
+}
+
+static void _json_utils_put_key(JsonWriter* writer_p, const char* key)
+{
+    uint32_t bit = 1u << writer_p->depth;
+    if (writer_p->has_members & bit)
+    {
+        _json_utils_put_char(writer_p, ',');
+    }
+    writer_p->has_members |= bit;
+    if (key != NULL)
+    {
+        _json_utils_put_escaped(writer_p, key, strlen(key));
+        _json_utils_put_char(writer_p, ':');
+    }
+}
+
+// `key` must be NULL for the outermost object.
+void json_utils_begin_object(JsonWriter* writer_p, const char* key)
+{
+    if (writer_p->depth == JSON_MAX_DEPTH - 1)
+    {
+        writer_p->overflow = true;
+        return;
+    }
+    _json_utils_put_key(writer_p, key);
+    _json_utils_put_char(writer_p, '{');
+    writer_p->depth++;
+    writer_p->has_members &= ~(1u << writer_p->depth);
+}
+
+void json_utils_end_object(JsonWriter* writer_p)
+{
+    if (writer_p->depth == 0)
+    {
+        writer_p->overflow = true;
+        return;
+    }
+    writer_p->depth--;
+    _json_utils_put_char(writer_p, '}');
+}
+
+void json_utils_string(JsonWriter* writer_p, const char* key, const char* value, size_t size)
+{
+    _json_utils_put_key(writer_p, key);
+    _json_utils_put_escaped(writer_p, value, size);
+}
+
+static void _json_utils_put_uint(JsonWriter* writer_p, uint64_t value)
+{
+    char digits[20];
+    size_t num_digits = 0;
+    do
+    {
+        digits[sizeof(digits) - 1 - num_digits++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    _json_utils_put(writer_p, digits + sizeof(digits) - num_digits, num_digits);
+}
+
+void json_utils_uint(JsonWriter* writer_p, const char* key, uint64_t value)
+{
+    _json_utils_put_key(writer_p, key);
+    _json_utils_put_uint(writer_p, value);
+}
+
+void json_utils_int(JsonWriter* writer_p, const char* key, int64_t value)
+{
+    _json_utils_put_key(writer_p, key);
+    if (value < 0)
+    {
+        _json_utils_put_char(writer_p, '-');
+        _json_utils_put_uint(writer_p, (uint64_t)(-(value + 1)) + 1);
+    }
+    else
+    {
+        _json_utils_put_uint(writer_p, (uint64_t)value);
+    }
+}
+
+void json_utils_double(JsonWriter* writer_p, const char* key, double value)
+{
+    char number[32];
+    _json_utils_put_key(writer_p, key);
+    // JSON has no representation for NaN and infinity.
+    if (isfinite(value))
+    {
+        int size = snprintf(number, sizeof(number), "%.6g", value);
+        _json_utils_put(writer_p, number, (size_t)size);
+    }
+    else
+    {
+        _json_utils_put(writer_p, "null", 4);
+    }
+}
+
+void json_utils_bool(JsonWriter* writer_p, const char* key, bool value)
+{
+    _json_utils_put_key(writer_p, key);
+    _json_utils_put(writer_p, value ? "true" : "false", value ? 4 : 5);
+}
+
+// Terminate the document with a new line, so that one object is written per line.
+Error json_utils_finish(JsonWriter* writer_p)
+{
+    if (writer_p->depth != 0)
+    {
+        return ERR_JSON_INVALID;
+    }
+    _json_utils_put_char(writer_p, '\n');
+    return writer_p->overflow ? ERR_OUT_OF_RANGE : ERR_ALL_GOOD;
+}
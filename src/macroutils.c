@@ -0,0 +1,201 @@
+// Command macros (`-M <name>=<command>,<command>,...`): sequences of commands uploaded to the
+// firmware at startup (see `slave/src/macros.h`) and run by the single instruction `<name>`. The
+// device executes every step and answers one line, the answers of the steps separated by tabs, so
+// that a sequence costs one round trip instead of one per step.
+//
+// A macro is then a command like any other: it can be prioritized, scheduled, broadcast, and
+// hedged if all its steps are read-only. Its response timeout is learned separately.
+#define MACRO_NAME_SIZE (16)  /* As MACROS_NAME_SIZE in `slave/src/macros.h` */
+#define MACRO_BODY_SIZE (200) /* As MACROS_BODY_SIZE */
+#define MACRO_MAX_STEPS (20)  /* As MACROS_MAX_STEPS */
+#define MACRO_UPLOAD_TIMEOUT_MS (3000) /* Boards reset when their port is opened */
+
+typedef struct
+{
+    char name[MACRO_NAME_SIZE];
+    char run_message[MACRO_NAME_SIZE + 5];                /* `run <name>\n` */
+    char definition[MACRO_NAME_SIZE + MACRO_BODY_SIZE + 7]; /* `macro <name> <body>\n` */
+} CommandMacro;
+
+static CommandMacro macros[COMMAND_MAX_MACROS];
+static size_t num_macros = 0;
+
+// Define a macro from a spec of the form `<name>=<command>,<command>,...`, the steps being
+// built-in commands.
+Error macro_utils_define(const char* spec)
+{
+    const char* equal_p = strchr(spec, '=');
+    size_t name_len     = equal_p ? (size_t)(equal_p - spec) : 0;
+    if (name_len == 0 || name_len >= MACRO_NAME_SIZE || strcspn(spec, " \t;") < name_len)
+    {
+        LOG_ERROR("Invalid macro name in `%s`", spec);
+        return ERR_INVALID;
+    }
+    if (num_macros == COMMAND_MAX_MACROS)
+    {
+        LOG_ERROR("At most %d macros are supported", COMMAND_MAX_MACROS);
+        return ERR_OUT_OF_RANGE;
+    }
+    CommandMacro* macro_p = &macros[num_macros];
+    const char* step      = equal_p + 1;
+    size_t num_steps      = 0;
+    int header_size       = snprintf(
+        macro_p->definition, sizeof(macro_p->definition), "macro %.*s ", (int)name_len, spec);
+    int size = header_size;
+
+    // The macro is read-only if all its steps are.
+    Command command = {
+        .name           = macro_p->name,
+        .serial_message = macro_p->run_message,
+        .priority       = PRIORITY_NORMAL,
+        .read_only      = true,
+    };
+    while (*step)
+    {
+        size_t step_len          = strcspn(step, ",");
+        const Command* command_p = command_utils_find(step, step_len);
+        if (command_p == NULL || command_p - g_commands >= NUM_BUILTIN_COMMANDS)
+        {
+            LOG_ERROR("Invalid step `%.*s` in macro `%s`", (int)step_len, step, spec);
+            return ERR_INVALID;
+        }
+        const char* message = command_p->serial_message;
+        size += snprintf(
+            macro_p->definition + size,
+            sizeof(macro_p->definition) - size,
+            "%s%.*s",
+            num_steps ? ";" : "",
+            (int)strcspn(message, "\n"),
+            message);
+        command.read_only = command.read_only && command_p->read_only;
+        num_steps++;
+        if (size - header_size >= MACRO_BODY_SIZE || num_steps > MACRO_MAX_STEPS)
+        {
+            LOG_ERROR("Macro `%s` too long for the device", spec);
+            return ERR_OUT_OF_RANGE;
+        }
+        step += step_len + (step[step_len] == ',');
+    }
+    if (num_steps == 0)
+    {
+        LOG_ERROR("Macro `%s` has no steps", spec);
+        return ERR_INVALID;
+    }
+    snprintf(macro_p->definition + size, sizeof(macro_p->definition) - size, "\n");
+    snprintf(macro_p->name, MACRO_NAME_SIZE, "%.*s", (int)name_len, spec);
+    snprintf(
+        macro_p->run_message, sizeof(macro_p->run_message), "run %.*s\n", (int)name_len, spec);
+    Error res = command_utils_add(&command);
+    if (is_err(res))
+    {
+        LOG_ERROR("Macro `%s` conflicts with another command", macro_p->name);
+        return res;
+    }
+    num_macros++;
+    LOG_INFO(
+        "Macro %s | %zu steps: %.*s",
+        macro_p->name,
+        num_steps,
+        size - header_size,
+        macro_p->definition + header_size);
+    return ERR_ALL_GOOD;
+}
+
+#define MACRO_CLEAR "macro clear\n"
+
+// Send the message of the upload step `step`: `macro clear` first, which frees the slots of the
+// macros defined before, then the definition of every macro.
+static Error _macro_utils_send(int fd, size_t step)
+{
+    const char* message = step == 0 ? MACRO_CLEAR : macros[step - 1].definition;
+    ssize_t size        = (ssize_t)strlen(message);
+    if (write(fd, message, size) != size)
+    {
+        LOG_PERROR("Failed to upload macros");
+        return ERR_UNEXPECTED;
+    }
+    return ERR_ALL_GOOD;
+}
+
+// Upload every macro to the device open on `fd`, after clearing those it kept: the firmware holds
+// few of them, and they persist across reboots. Every message is acknowledged before the next one
+// is sent. When the board announces it (re)booted, it reloaded its macros from EEPROM, losing the
+// clearing, which was only done in RAM: the upload starts over.
+Error macro_utils_upload(int fd, const DeviceProfile* profile_p)
+{
+    static SizedBuffer pending;
+    const char* device = profile_p->id[0] ? profile_p->id : profile_p->path;
+    UNUSED(device); /* When LOG_LEVEL is below LEVEL_ERROR */
+    MessageBuffer* frame_p;
+    ssize_t chunk_size;
+    size_t step = 0;
+    if (num_macros == 0)
+    {
+        return ERR_ALL_GOOD;
+    }
+    if (profile_p->caps[0] && strstr(profile_p->caps, "macro") == NULL)
+    {
+        LOG_ERROR("`%s` does not support macros (%s)", device, profile_p->caps);
+        return ERR_INVALID;
+    }
+    pending.size         = 0;
+    uint64_t deadline_ns = get_monotonic_ns() + MACRO_UPLOAD_TIMEOUT_MS * NS_PER_MS;
+    Error res            = _macro_utils_send(fd, 0);
+    while (is_ok(res) && step <= num_macros)
+    {
+        uint64_t now_ns = get_monotonic_ns();
+        if (now_ns >= deadline_ns)
+        {
+            LOG_ERROR("`%s` did not acknowledge the macros", device);
+            return ERR_TIMEOUT;
+        }
+        struct pollfd polled_fd = {.fd = fd, .events = POLLIN};
+        poll(&polled_fd, 1, (int)((deadline_ns - now_ns + NS_PER_MS - 1) / NS_PER_MS));
+        Error read_res;
+        while (is_ok(res)
+               && (read_res = usb_utils_read_available(fd, &pending, &chunk_size)) == ERR_ALL_GOOD)
+        {
+            while (is_ok(res) && usb_utils_next_frame(&pending, &frame_p) != ERR_NOT_FOUND)
+            {
+                if (frame_p == NULL)
+                {
+                    continue;
+                }
+                if (strncmp(frame_p->data, "!ready", 6) == 0)
+                {
+                    step = 0;
+                    res  = _macro_utils_send(fd, step);
+                }
+                else if (event_utils_is_event(frame_p->data, frame_p->size))
+                {
+                    event_utils_publish(frame_p->data, frame_p->size);
+                }
+                else if (strncmp(frame_p->data, "OK", 2) == 0)
+                {
+                    if (step > 0)
+                    {
+                        LOG_INFO("Macro %s uploaded to `%s`", macros[step - 1].name, device);
+                    }
+                    step++;
+                    res = step <= num_macros ? _macro_utils_send(fd, step) : res;
+                }
+                else
+                {
+                    LOG_ERROR(
+                        "`%s` rejected %s: %s",
+                        device,
+                        step ? macros[step - 1].name : "macro clear",
+                        frame_p->data);
+                    res = ERR_INVALID;
+                }
+                buffer_utils_release(frame_p);
+            }
+        }
+        if (is_ok(res) && read_res == ERR_UNEXPECTED)
+        {
+            LOG_PERROR("Lost `%s` while uploading the macros", device);
+            res = ERR_UNEXPECTED;
+        }
+    }
+    return res;
+}
@@ -17,11 +17,20 @@
 #include <time.h>
 #include <string.h>
 #include <poll.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <ctype.h>
 
 #define COMMUNICATION_BUFF_IN_SIZE (4096)
 
 #define FIFO_IN "artifacts/fifo_in"
 #define FIFO_OUT "artifacts/fifo_out"
+#define DEFAULT_AGING_MS (1000)
+// Enough for a response where every other character needs escaping, plus the metadata.
+#define JSON_BUFF_SIZE (3 * COMMUNICATION_BUFF_IN_SIZE)
+// The largest record written to the output FIFO: the result of a broadcast, with one response per
+// device (see `src/fleetutils.c`).
+#define OUTPUT_MAX_RECORD_SIZE (8 * JSON_BUFF_SIZE)
 
 typedef struct
 {
@@ -30,13 +39,68 @@ typedef struct
 } SizedBuffer;
 
 int g_serial_fd              = 0;
+int g_fifo_out_fd            = -1;
 SizedBuffer g_fifo_input     = {0};
 volatile bool g_should_close = false;
+// Log level steps requested with SIGUSR1 (more verbose) and SIGUSR2 (less verbose).
+volatile sig_atomic_t g_log_level_steps = 0;
 
+#ifndef LOG_LEVEL
 #define LOG_LEVEL LEVEL_TRACE
+#endif
 #include "mylib.c"
+#include "bufferutils.c"
 #include "usbutils.c"
+#include "discoveryutils.c"
 #include "fifoutils.c"
+#include "spillutils.c"
+#include "eventutils.c"
+#include "shmutils.c"
+#include "commandutils.c"
+#include "macroutils.c"
+#include "rttutils.c"
+#include "deltautils.c"
+#include "queueutils.c"
+#include "timerutils.c"
+#include "schedulerutils.c"
+#include "windowutils.c"
+#include "traceutils.c"
+#include "jsonutils.c"
+#include "recorderutils.c"
+#include "storeutils.c"
+#include "fleetutils.c"
+#include "hedgeutils.c"
+
+_Static_assert(
+    FLEET_MAX_DEVICES * JSON_BUFF_SIZE <= OUTPUT_MAX_RECORD_SIZE, "A broadcast result must fit");
+
+RequestQueue g_queue;
+OutputSpill g_output;
+TimerWheel g_timer_wheel;
+Scheduler g_scheduler;
+Aggregator g_aggregator;
+TimeSeriesStore g_store;
+Fleet g_fleet;
+Hedger g_hedger;
+// Replies the Serial Device owes for requests already completed.
+RttLedger g_ledger;
+// Field stored instead of the whole response, per command (see `-x`).
+const char* g_store_fields[NUM_COMMANDS];
+ShmSegment* g_shm_p = NULL;
+
+// The serial port is always read, whether a request is outstanding or not. At most one request
+// is outstanding: the next frame that is not an event is its response.
+SizedBuffer g_serial_pending = {0};
+Request g_outstanding;
+bool g_has_outstanding = false;
+uint64_t g_deadline_ns = 0;
+// When the outstanding request is to be sent to the secondary device too, 0 if it is not.
+uint64_t g_hedge_at_ns = 0;
+// The serial message of the outstanding request is entirely written once the write queue has
+// written g_outstanding_write_end bytes.
+SerialWriteQueue g_serial_writes;
+uint64_t g_outstanding_write_end = 0;
+DeviceProfile g_device           = {0};
 
 void signal_handler(int signum)
 {
@@ -44,19 +108,901 @@ void signal_handler(int signum)
     g_should_close = true;
 }
 
+void log_level_signal_handler(int signum) { g_log_level_steps += signum == SIGUSR1 ? 1 : -1; }
+
+void set_log_level(int level)
+{
+    UNUSED(level); /* When LOG_LEVEL is LEVEL_NO_LOGS */
+    logger_set_level(level);
+    printf("Log level set to %s\n", logger_level_name(logger_get_level()));
+}
+
+// Write one JSON object per transaction to the output FIFO. Nothing is allocated: the object is
+// encoded straight into a static buffer. A heartbeat standing for `unchanged` responses identical
+// to the previous one (see `src/deltautils.c`) carries their number instead of the response.
+void publish_json(const Request* request_p, Error res, uint32_t unchanged)
+{
+    static char json_buffer[JSON_BUFF_SIZE];
+    static uint64_t dropped = 0;
+    JsonWriter writer;
+    const char* response = request_p->response_p ? request_p->response_p->data : "";
+    size_t response_size = request_p->response_p ? request_p->response_p->size : 0;
+    const char* status   = res == ERR_TIMEOUT ? "timeout"
+                           : is_err(res)      ? "error"
+                           : unchanged        ? "unchanged"
+                                              : (response_size ? "ok" : "empty");
+    bool truncated     = false;
+
+    do
+    {
+        json_utils_init(&writer, json_buffer, sizeof(json_buffer));
+        json_utils_begin_object(&writer, NULL);
+        json_utils_uint(&writer, "id", request_p->id);
+        json_utils_string(
+            &writer, "command", request_p->command_p->name, strlen(request_p->command_p->name));
+        json_utils_string(
+            &writer,
+            "priority",
+            priority_names[request_p->priority],
+            strlen(priority_names[request_p->priority]));
+        json_utils_string(&writer, "status", status, strlen(status));
+        json_utils_uint(&writer, "bytes_sent", strlen(request_p->command_p->serial_message));
+        json_utils_uint(&writer, "bytes_received", response_size);
+        if (unchanged)
+        {
+            json_utils_uint(&writer, "unchanged", unchanged);
+        }
+        else
+        {
+            json_utils_string(&writer, "response", response, truncated ? 0 : response_size);
+        }
+        if (truncated)
+        {
+            json_utils_bool(&writer, "truncated", true);
+        }
+        json_utils_begin_object(&writer, "timings_us");
+        json_utils_uint(
+            &writer, "queued", (request_p->dispatched_ns - request_p->enqueued_ns) / 1000);
+        json_utils_uint(
+            &writer, "write", (request_p->written_ns - request_p->dispatched_ns) / 1000);
+        json_utils_uint(&writer, "read", (request_p->completed_ns - request_p->written_ns) / 1000);
+        json_utils_uint(
+            &writer, "total", (request_p->completed_ns - request_p->enqueued_ns) / 1000);
+        json_utils_end_object(&writer);
+        json_utils_end_object(&writer);
+        // Give up on the response, not on the whole transaction, if it does not fit.
+        truncated = !truncated && json_utils_finish(&writer) == ERR_OUT_OF_RANGE;
+    } while (truncated);
+
+    if (is_err(spill_utils_write(&g_output, json_buffer, writer.size)))
+    {
+        dropped++;
+        LOG_WARNING_EVERY(
+            1000,
+            "Output queue full, dropped transaction %u (%" PRIu64 " so far)",
+            request_p->id,
+            dropped);
+    }
+}
+
+// Emit the summary of a window of aggregated samples (see `src/windowutils.c`): to the output FIFO
+// if it is enabled, to the log otherwise.
+void publish_window_summary(const WindowSummary* summary_p)
+{
+    static char json_buffer[512];
+    const WindowSeries* series_p = summary_p->series_p;
+    struct timespec now;
+    JsonWriter writer;
+
+    if (g_fifo_out_fd < 0)
+    {
+        LOG_INFO(
+            "Window %s.%s | count %" PRIu64 " min %g max %g mean %g p50 %g p90 %g p99 %g",
+            series_p->command_p->name,
+            series_p->field,
+            summary_p->count,
+            summary_p->min,
+            summary_p->max,
+            summary_p->mean,
+            summary_p->p50,
+            summary_p->p90,
+            summary_p->p99);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    json_utils_init(&writer, json_buffer, sizeof(json_buffer));
+    json_utils_begin_object(&writer, NULL);
+    json_utils_string(
+        &writer, "command", series_p->command_p->name, strlen(series_p->command_p->name));
+    json_utils_string(&writer, "field", series_p->field, strlen(series_p->field));
+    json_utils_uint(
+        &writer, "time_ms", (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000);
+    json_utils_uint(&writer, "window_ms", series_p->window_ms);
+    json_utils_uint(&writer, "slide_ms", series_p->slide_ms);
+    json_utils_uint(&writer, "count", summary_p->count);
+    json_utils_double(&writer, "min", summary_p->min);
+    json_utils_double(&writer, "max", summary_p->max);
+    json_utils_double(&writer, "mean", summary_p->mean);
+    json_utils_double(&writer, "p50", summary_p->p50);
+    json_utils_double(&writer, "p90", summary_p->p90);
+    json_utils_double(&writer, "p99", summary_p->p99);
+    json_utils_end_object(&writer);
+    if (is_ok(json_utils_finish(&writer))
+        && is_err(spill_utils_write(&g_output, json_buffer, writer.size)))
+    {
+        LOG_WARNING("Output queue full, dropped a `%s` window", series_p->command_p->name);
+    }
+}
+
+// Store only `<field>` of the responses of `<command>`, from a spec of the form
+// `<command>:<field>`.
+Error store_field_enable(const char* spec)
+{
+    const char* colon_p      = strchr(spec, ':');
+    const Command* command_p = colon_p ? command_utils_find(spec, colon_p - spec) : NULL;
+    if (command_p == NULL || colon_p[1] == 0)
+    {
+        return ERR_INVALID;
+    }
+    g_store_fields[command_p - g_commands] = colon_p + 1;
+    return ERR_ALL_GOOD;
+}
+
+// Append a response of `device`, received at `received_ns`, to the time-series store: the numeric
+// field configured for its command if it has one and it parses, the whole response otherwise.
+void store_response(
+    const Request* request_p,
+    const char* device,
+    uint64_t received_ns,
+    const MessageBuffer* response_p)
+{
+    const char* field = g_store_fields[request_p->command_p - g_commands];
+    double value      = NAN;
+    if (field != NULL && is_ok(window_utils_extract(response_p->data, field, &value))
+        && isfinite(value))
+    {
+        store_utils_append(
+            &g_store, device, request_p->command_p->name, received_ns, value, NULL, 0);
+        return;
+    }
+    store_utils_append(
+        &g_store,
+        device,
+        request_p->command_p->name,
+        received_ns,
+        NAN,
+        response_p->data,
+        response_p->size);
+}
+
+// Store the replies to a broadcast at the time each was received. The store expects the rows of a
+// segment in time order: the replies are appended by latency rather than in device order.
+void store_broadcast(const Request* request_p, const BroadcastReply* replies, size_t num_replies)
+{
+    size_t order[FLEET_MAX_DEVICES];
+    for (size_t i = 0; i < num_replies; i++)
+    {
+        size_t j = i;
+        for (; j > 0 && replies[order[j - 1]].latency_ns > replies[i].latency_ns; j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    for (size_t i = 0; i < num_replies; i++)
+    {
+        const BroadcastReply* reply_p = &replies[order[i]];
+        if (reply_p->status == ERR_ALL_GOOD)
+        {
+            // Latencies are measured from the dispatch of the broadcast.
+            store_response(
+                request_p,
+                reply_p->device,
+                request_p->dispatched_ns + reply_p->latency_ns,
+                reply_p->response_p);
+        }
+    }
+}
+
+// Emit the combined result of a broadcast (see `src/fleetutils.c`): one JSON object to the output
+// FIFO if it is enabled, one log line per device otherwise. Every reply is stored under the name
+// of its device, and a shared memory client gets the JSON object.
+void publish_broadcast(const Request* request_p, const BroadcastReply* replies, size_t num_replies)
+{
+    static char json_buffer[OUTPUT_MAX_RECORD_SIZE];
+    JsonWriter writer;
+    uint64_t total_ns = 0;
+    uint32_t answered = 0;
+    uint32_t timeouts = 0;
+
+    if (store_utils_is_open(&g_store))
+    {
+        store_broadcast(request_p, replies, num_replies);
+    }
+    json_utils_init(&writer, json_buffer, sizeof(json_buffer));
+    json_utils_begin_object(&writer, NULL);
+    json_utils_uint(&writer, "id", request_p->id);
+    json_utils_string(
+        &writer, "command", request_p->command_p->name, strlen(request_p->command_p->name));
+    json_utils_begin_object(&writer, "devices");
+    for (size_t i = 0; i < num_replies; i++)
+    {
+        const BroadcastReply* reply_p = &replies[i];
+        const char* status            = reply_p->status == ERR_TIMEOUT ? "timeout"
+                                        : is_err(reply_p->status)      ? "error"
+                                                                       : "ok";
+        const char* response          = reply_p->response_p ? reply_p->response_p->data : "";
+        size_t response_size          = reply_p->response_p ? reply_p->response_p->size : 0;
+        answered += reply_p->status == ERR_ALL_GOOD;
+        timeouts += reply_p->status == ERR_TIMEOUT;
+        total_ns = reply_p->latency_ns > total_ns ? reply_p->latency_ns : total_ns;
+        if (g_fifo_out_fd < 0)
+        {
+            LOG_INFO(
+                "Broadcast %u `%s` | %-16s %-7s %8" PRIu64 " us %s",
+                request_p->id,
+                request_p->command_p->name,
+                reply_p->device,
+                status,
+                reply_p->latency_ns / 1000,
+                response);
+        }
+        json_utils_begin_object(&writer, reply_p->device);
+        json_utils_string(&writer, "status", status, strlen(status));
+        json_utils_uint(&writer, "latency_us", reply_p->latency_ns / 1000);
+        json_utils_string(&writer, "response", response, response_size);
+        json_utils_end_object(&writer);
+    }
+    json_utils_end_object(&writer);
+    json_utils_uint(&writer, "answered", answered);
+    json_utils_uint(&writer, "timeouts", timeouts);
+    json_utils_uint(&writer, "total_us", total_ns / 1000);
+    json_utils_end_object(&writer);
+    if (is_err(json_utils_finish(&writer)))
+    {
+        LOG_WARNING("Broadcast %u result too large to publish", request_p->id);
+        return;
+    }
+    if (g_fifo_out_fd >= 0 && is_err(spill_utils_write(&g_output, json_buffer, writer.size)))
+    {
+        LOG_WARNING("Output queue full, dropped broadcast %u", request_p->id);
+    }
+    if (request_p->source == SOURCE_SHM)
+    {
+        shm_utils_server_respond(
+            g_shm_p, request_p->tag, ERR_ALL_GOOD, json_buffer, (uint32_t)writer.size);
+    }
+}
+
+// Account for a completed request that could be hedged (see `src/hedgeutils.c`), and give up on
+// the reply of the secondary device if it did not answer first. `until_ns` bounds the replies.
+void settle_hedge(Error res, uint64_t until_ns)
+{
+    const Command* command_p = g_outstanding.command_p;
+    uint64_t latency_ns      = g_outstanding.completed_ns - g_outstanding.dispatched_ns;
+    g_hedge_at_ns            = 0;
+    if (g_outstanding.hedged && !g_outstanding.hedge_won)
+    {
+        fleet_utils_cancel_hedge(&g_fleet, 0, until_ns);
+    }
+    if (res == ERR_ALL_GOOD && !g_outstanding.hedge_won)
+    {
+        hedge_utils_on_primary(&g_hedger, command_p, latency_ns);
+    }
+    else if (res == ERR_ALL_GOOD || res == ERR_TIMEOUT)
+    {
+        // Left out, the slow tail would bias the hedge delay low.
+        hedge_utils_on_censored(&g_hedger, command_p, latency_ns);
+    }
+    if (res == ERR_ALL_GOOD)
+    {
+        hedge_utils_on_delivered(&g_hedger, command_p, latency_ns, g_outstanding.hedge_won);
+    }
+}
+
+// Complete the outstanding request with `response_p`, or with ERR_TIMEOUT and no response if the
+// device did not answer in time. The request holds its own reference to the response while the
+// logger, the output FIFO and the shared memory client are served. A response identical to the
+// previous one is only recorded and returned to a shared memory client, unless a heartbeat is due.
+void complete_request(Error res, MessageBuffer* response_p)
+{
+    DeltaVerdict verdict       = DELTA_FORWARD;
+    uint32_t unchanged         = 0;
+    bool aggregated            = false;
+    bool written               = g_outstanding.written_ns != 0;
+    g_outstanding.completed_ns = get_monotonic_ns();
+    g_outstanding.response_p   = response_p ? buffer_utils_ref(response_p) : NULL;
+    g_has_outstanding          = false;
+    if (g_outstanding.written_ns == 0)
+    {
+        // Never entirely written: do not send the rest after the request was given up on.
+        g_outstanding.written_ns = g_outstanding.completed_ns;
+        usb_utils_discard_writes(&g_serial_writes);
+    }
+    // A slow device may answer much later than the learned timeout, but not after the longest one.
+    uint64_t until_ns = g_outstanding.completed_ns + rtt_utils_max_timeout_ns();
+    if (written && (res == ERR_TIMEOUT || g_outstanding.hedge_won))
+    {
+        // The reply still to come must not answer the next request.
+        rtt_utils_owe(&g_ledger, g_outstanding.command_p, g_outstanding.dispatched_ns, until_ns);
+    }
+    if (g_outstanding.broadcast)
+    {
+        // The broadcast deadline is not a response timeout: only answers teach the timeouts.
+        if (res == ERR_ALL_GOOD)
+        {
+            rtt_utils_on_response(
+                g_outstanding.command_p, g_outstanding.completed_ns - g_outstanding.written_ns);
+        }
+        recorder_utils_record(&g_outstanding, res);
+        fleet_utils_on_primary(&g_fleet, res, response_p, g_outstanding.completed_ns);
+        buffer_utils_release(g_outstanding.response_p);
+        g_outstanding.response_p = NULL;
+        return;
+    }
+    if (hedge_utils_applies(&g_hedger, g_outstanding.command_p))
+    {
+        settle_hedge(res, until_ns);
+    }
+    if (res == ERR_ALL_GOOD)
+    {
+        if (!g_outstanding.hedge_won)
+        {
+            rtt_utils_on_response(
+                g_outstanding.command_p, g_outstanding.completed_ns - g_outstanding.written_ns);
+        }
+        aggregated = window_utils_observe(&g_aggregator, g_outstanding.command_p, response_p->data);
+        verdict    = delta_utils_check(
+            g_outstanding.command_p, response_p, g_outstanding.completed_ns, &unchanged);
+        if (verdict == DELTA_HEARTBEAT)
+        {
+            LOG_INFO("Read: same as previous (%" PRIu32 " times)", unchanged);
+        }
+        else if (verdict == DELTA_SUPPRESS)
+        {
+            LOG_TRACE("Read: same as previous");
+        }
+        else if (response_p->size)
+        {
+            LOG_INFO("Read: %s", response_p->data);
+        }
+        else
+        {
+            LOG_WARNING("Got an empty answer");
+        }
+    }
+    else if (res == ERR_TIMEOUT)
+    {
+        rtt_utils_on_timeout(g_outstanding.command_p);
+        printf("Timeout\n");
+    }
+    if (is_err(res))
+    {
+        // Consumers last saw the error: the next response goes out even if it did not change.
+        delta_utils_reset(g_outstanding.command_p);
+    }
+    recorder_utils_record(&g_outstanding, res);
+    if (res == ERR_ALL_GOOD && store_utils_is_open(&g_store))
+    {
+        store_response(
+            &g_outstanding,
+            g_device.id[0] ? g_device.id : g_device.path,
+            g_outstanding.completed_ns,
+            response_p);
+    }
+    // The responses of an aggregated command only go out as window summaries.
+    if (g_fifo_out_fd >= 0 && verdict != DELTA_SUPPRESS && !aggregated)
+    {
+        publish_json(&g_outstanding, res, unchanged);
+    }
+    if (g_outstanding.source == SOURCE_SHM)
+    {
+        shm_utils_server_respond(
+            g_shm_p,
+            g_outstanding.tag,
+            res,
+            response_p ? response_p->data : NULL,
+            response_p ? (uint32_t)response_p->size : 0);
+    }
+    buffer_utils_release(g_outstanding.response_p);
+    g_outstanding.response_p = NULL;
+}
+
+// The secondary device answered the outstanding request first.
+void answer_hedge(MessageBuffer* response_p)
+{
+    LOG_DEBUG("Request %u answered by the secondary device", g_outstanding.id);
+    g_outstanding.hedge_won = true;
+    complete_request(ERR_ALL_GOOD, response_p);
+}
+
+// Send the outstanding request to the secondary device too, the primary one being slow to answer.
+void send_hedge(void)
+{
+    g_hedge_at_ns = 0;
+    if (is_ok(fleet_utils_hedge(&g_fleet, 0, &g_outstanding, get_monotonic_ns())))
+    {
+        LOG_DEBUG("Hedging request %u", g_outstanding.id);
+        g_outstanding.hedged = true;
+        hedge_utils_on_hedged(&g_hedger, g_outstanding.command_p);
+    }
+}
+
+// Write what the pacing and the driver allow of the serial write queue. The response timeout of the
+// outstanding request starts once its whole message is written.
+void flush_serial_writes(void)
+{
+    uint64_t now_ns = get_monotonic_ns();
+    if (usb_utils_flush_writes(g_serial_fd, &g_serial_writes, now_ns) == ERR_UNEXPECTED)
+    {
+        LOG_PERROR("Lost the Serial Device");
+        g_should_close = true;
+        return;
+    }
+    if (g_has_outstanding && g_outstanding.written_ns == 0
+        && g_serial_writes.written_bytes >= g_outstanding_write_end)
+    {
+        const char* message      = g_outstanding.command_p->serial_message;
+        g_outstanding.written_ns = now_ns;
+        g_deadline_ns            = g_outstanding.broadcast
+                                       ? g_fleet.until_ns
+                                       : now_ns + rtt_utils_timeout_ns(g_outstanding.command_p);
+        trace_utils_record(TRACE_SERIAL_WRITE, message, strlen(message));
+    }
+}
+
+// Queue the serial message of a dispatched request. The response is matched by the serial reader.
+void dispatch_request(const Request* request_p)
+{
+    const char* message = request_p->command_p->serial_message;
+    size_t size         = strlen(message);
+
+    LOG_DEBUG(
+        "Dispatching request %u `%s` (%s)",
+        request_p->id,
+        request_p->command_p->name,
+        priority_names[request_p->priority]);
+    LOG_TRACE("size to send %zu", size);
+    g_outstanding            = *request_p;
+    g_outstanding.written_ns = 0;
+    g_has_outstanding        = true;
+    if (request_p->broadcast)
+    {
+        fleet_utils_broadcast(&g_fleet, request_p, g_device.id[0] ? g_device.id : g_device.path);
+    }
+    if (is_err(usb_utils_enqueue_write(&g_serial_writes, message, size)))
+    {
+        LOG_ERROR("Serial write queue full, dropped request %u", request_p->id);
+        g_outstanding.written_ns = g_outstanding.dispatched_ns;
+        complete_request(ERR_OUT_OF_RANGE, NULL);
+        return;
+    }
+    // Until the message is written, the deadline also covers the time it takes at the baud rate.
+    g_outstanding_write_end = g_serial_writes.enqueued_bytes;
+    uint64_t timeout_ns     = rtt_utils_timeout_ns(request_p->command_p);
+    g_deadline_ns           = g_outstanding.dispatched_ns + timeout_ns
+                    + g_serial_writes.size * g_serial_writes.ns_per_byte;
+    if (request_p->broadcast)
+    {
+        // Every device shares the deadline of the broadcast.
+        g_deadline_ns = g_fleet.until_ns;
+    }
+    else
+    {
+        uint64_t delay_ns = hedge_utils_on_dispatched(&g_hedger, request_p->command_p);
+        g_hedge_at_ns     = delay_ns == UINT64_MAX ? 0 : request_p->dispatched_ns + delay_ns;
+    }
+    flush_serial_writes();
+}
+
+// Read whatever the device sent and route every complete frame: events go to the subscribers,
+// anything else answers the outstanding request. Frames nobody asked for are events too.
+void read_serial(void)
+{
+    MessageBuffer* frame_p;
+    ssize_t chunk_size;
+    Error res;
+    while ((res = usb_utils_read_available(g_serial_fd, &g_serial_pending, &chunk_size))
+           == ERR_ALL_GOOD)
+    {
+        trace_utils_record(
+            TRACE_SERIAL_READ,
+            g_serial_pending.buffer + g_serial_pending.size - chunk_size,
+            chunk_size);
+        while ((res = usb_utils_next_frame(&g_serial_pending, &frame_p)) != ERR_NOT_FOUND)
+        {
+            if (res == ERR_OUT_OF_RANGE)
+            {
+                LOG_WARNING("Message buffer pool exhausted, dropped a frame");
+                continue;
+            }
+            bool is_event   = event_utils_is_event(frame_p->data, frame_p->size);
+            uint64_t now_ns = get_monotonic_ns();
+            RttOwed owed;
+            if (!is_event && rtt_utils_take_late(&g_ledger, now_ns, &owed))
+            {
+                if (hedge_utils_applies(&g_hedger, owed.command_p))
+                {
+                    hedge_utils_on_late(&g_hedger, owed.command_p, now_ns - owed.dispatched_ns);
+                }
+                LOG_DEBUG("Discarded a late reply to `%s`", owed.command_p->name);
+            }
+            else if (g_has_outstanding && !is_event)
+            {
+                complete_request(ERR_ALL_GOOD, frame_p);
+            }
+            else
+            {
+                event_utils_publish(frame_p->data, frame_p->size);
+            }
+            buffer_utils_release(frame_p);
+        }
+    }
+    if (res == ERR_UNEXPECTED)
+    {
+        LOG_PERROR("Lost the Serial Device");
+        g_should_close = true;
+    }
+}
+
+// Control instructions are executed as soon as they are read instead of being queued.
+bool handle_control_instruction(const SizedBuffer* instruction_p)
+{
+    const char* line = instruction_p->buffer;
+    size_t line_len  = strcspn(line, "\r\n");
+    if (line_len == 5 && strncmp(line, "STATS", 5) == 0)
+    {
+        queue_utils_print_stats(&g_queue);
+        scheduler_utils_print_stats(&g_scheduler);
+        rtt_utils_print_stats(&g_ledger);
+        delta_utils_print_stats();
+        window_utils_print_stats(&g_aggregator);
+        store_utils_print_stats(&g_store);
+        spill_utils_print_stats(&g_output);
+        fleet_utils_print_stats(&g_fleet);
+        hedge_utils_print_stats(&g_hedger);
+        usb_utils_print_write_stats(&g_serial_writes);
+        event_utils_print_stats();
+        buffer_utils_print_stats();
+        return true;
+    }
+    if (line_len > 10 && strncmp(line, "SUBSCRIBE ", 10) == 0)
+    {
+        event_utils_subscribe(line + 10, line_len - 10);
+        return true;
+    }
+    if (line_len > 12 && strncmp(line, "UNSUBSCRIBE ", 12) == 0)
+    {
+        event_utils_unsubscribe(line + 12, line_len - 12);
+        return true;
+    }
+    if (line_len > 9 && strncmp(line, "LOGLEVEL ", 9) == 0)
+    {
+        int level;
+        if (is_ok(logger_parse_level(line + 9, line_len - 9, &level)))
+        {
+            set_log_level(level);
+        }
+        else
+        {
+            LOG_WARNING("Invalid log level `%.*s`", (int)line_len - 9, line + 9);
+        }
+        return true;
+    }
+    return false;
+}
+
+// Parse an instruction and queue the corresponding request. Returns ERR_NOT_FOUND for unknown
+// instructions. `BROADCAST <instruction>` sends it to every device (see `src/fleetutils.c`).
+Error enqueue_instruction(
+    RequestQueue* queue_p,
+    const SizedBuffer* instruction_p,
+    RequestSource source,
+    uint32_t tag)
+{
+    Request request  = {.source = source, .tag = tag};
+    const char* line = instruction_p->buffer;
+    size_t line_len  = instruction_p->size;
+    if (line_len > 10 && strncmp(line, "BROADCAST ", 10) == 0)
+    {
+        request.broadcast = true;
+        line += 10;
+        line_len -= 10;
+    }
+    Error res = command_utils_parse_line(line, line_len, &request.command_p, &request.priority);
+    if (is_err(res))
+    {
+        LOG_WARNING(
+            "Ignoring instruction `%.*s`",
+            (int)strcspn(instruction_p->buffer, "\n"),
+            instruction_p->buffer);
+        return res;
+    }
+    return queue_utils_push(queue_p, &request);
+}
+
+void usage(const char* program_name)
+{
+    printf(
+        "Usage: %s [-m] [-j] [-O <memory KiB>:<spill MiB>[:<drop policy>]] [-g <aging ms>] "
+        "[-r <trace file>] [-F <flight recorder>] "
+        "[-T <min ms>:<max ms>] [-p <command>:<period ms> ...] [-s <command>:<heartbeat ms> ...] "
+        "[-a <command>:<field>:<window ms>[/<slide ms>] ...] [-o <store directory>] "
+        "[-x <command>:<field> ...] [-d <device id>] [-D <peer id or path> ...] "
+        "[-W <broadcast deadline ms>] [-H <percentile>] [-M <name>=<command>,... ...] "
+        "[<serial device or pattern>]\n",
+        program_name);
+    printf("  -m  also accept instructions through the shared memory transport `%s`\n", SHM_NAME);
+    printf("  -j  write one JSON object per transaction to `%s`\n", FIFO_OUT);
+    printf(
+        "  -O  output queued while the `%s` reader lags: in memory, then in `%s` (default "
+        "%d:%d:drop-newest, or drop-oldest)\n",
+        FIFO_OUT,
+        SPILL_DEFAULT_PATH,
+        SPILL_DEFAULT_MEMORY_KB,
+        SPILL_DEFAULT_FILE_MB);
+    printf(
+        "  -g  waiting time after which a request is promoted by one priority class (default %d "
+        "ms)\n",
+        DEFAULT_AGING_MS);
+    printf(
+        "  -T  bounds of the response timeouts learned per command (default %d:%d)\n",
+        RTT_DEFAULT_MIN_MS,
+        RTT_DEFAULT_MAX_MS);
+    printf("  -p  send <command> every <period ms>, can be repeated (e.g. -p POLL:1000)\n");
+    printf(
+        "  -s  forward a <command> response only when it changes, or as a heartbeat every "
+        "<heartbeat ms>\n");
+    printf(
+        "  -a  emit count/min/max/mean/quantiles of a numeric <field> of the <command> responses "
+        "(`<name>=<value>` or n-th number) over windows, instead of the responses\n");
+    printf("  -o  append every response to a time-series store (see tools/store-query.c)\n");
+    printf("  -x  store only the numeric <field> of the <command> responses, can be repeated\n");
+    printf(
+        "  -d  use the device answering with this ID among the ports matching the pattern "
+        "(default `%s`)\n",
+        DISCOVERY_DEFAULT_PATTERN);
+    printf(
+        "  -D  attach a peer device, by path or by ID among the same ports, for `BROADCAST "
+        "<instruction>` and -H (at most %d)\n",
+        FLEET_MAX_PEERS);
+    printf(
+        "  -W  time a broadcast waits for the replies of every device (default %d ms)\n",
+        FLEET_DEFAULT_DEADLINE_MS);
+    printf(
+        "  -H  also send a read-only command to the first peer when the device has not answered "
+        "within this percentile of its latencies (e.g. 95)\n");
+    printf(
+        "  -M  upload a macro to the devices, run by the instruction <name> in a single round trip "
+        "(at most %d)\n",
+        COMMAND_MAX_MACROS);
+    printf("  -r  record instructions and serial traffic to a binary trace (see tools/replay.c)\n");
+    printf(
+        "  -F  file keeping the last %d transactions (default `%s`, empty to disable)\n",
+        RECORDER_CAPACITY,
+        RECORDER_DEFAULT_PATH);
+    printf(
+        "Control instructions: STATS, SUBSCRIBE <name>, UNSUBSCRIBE <name>, LOGLEVEL <level>\n");
+    printf("Instructions: [!<priority> ]<command>, BROADCAST [!<priority> ]<command>\n");
+    printf("Signals: SIGUSR1 raises the log level, SIGUSR2 lowers it\n");
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc < 2)
+    bool use_shm              = false;
+    bool use_json             = false;
+    uint64_t aging_ms         = DEFAULT_AGING_MS;
+    uint64_t min_timeout_ms   = RTT_DEFAULT_MIN_MS;
+    uint64_t max_timeout_ms   = RTT_DEFAULT_MAX_MS;
+    const char* trace_path    = NULL;
+    const char* recorder_path = RECORDER_DEFAULT_PATH;
+    const char* device_id     = NULL;
+    const char* store_path    = NULL;
+    size_t output_memory      = SPILL_DEFAULT_MEMORY_KB * 1024;
+    size_t output_file        = (size_t)SPILL_DEFAULT_FILE_MB * 1024 * 1024;
+    SpillPolicy output_policy = SPILL_DROP_NEWEST;
+    uint64_t broadcast_ms     = FLEET_DEFAULT_DEADLINE_MS;
+    double hedge_percentile   = 0;
+    const char* schedule_specs[MAX_SCHEDULES];
+    size_t num_schedule_specs = 0;
+    const char* delta_specs[NUM_COMMANDS];
+    size_t num_delta_specs = 0;
+    const char* window_specs[WINDOW_MAX_SERIES];
+    size_t num_window_specs = 0;
+    const char* field_specs[NUM_COMMANDS];
+    size_t num_field_specs = 0;
+    const char* peer_specs[FLEET_MAX_PEERS];
+    size_t num_peer_specs = 0;
+    const char* macro_specs[COMMAND_MAX_MACROS];
+    size_t num_macro_specs = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "mjO:g:r:F:T:p:s:a:o:x:d:D:W:H:M:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            use_shm = true;
+            break;
+        case 'j':
+            use_json = true;
+            break;
+        case 'O':
+            if (is_err(spill_utils_parse_limits(
+                    optarg, &output_memory, &output_file, &output_policy)))
+            {
+                printf(
+                    "Invalid output queue `%s` (at least %d KiB in memory)\n",
+                    optarg,
+                    SPILL_MIN_MEMORY_BYTES / 1024);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'g':
+            aging_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            trace_path = optarg;
+            break;
+        case 'F':
+            recorder_path = optarg;
+            break;
+        case 'T':
+            if (is_err(rtt_utils_parse_bounds(optarg, &min_timeout_ms, &max_timeout_ms)))
+            {
+                printf("Invalid timeout bounds `%s`\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'p':
+            if (num_schedule_specs == MAX_SCHEDULES)
+            {
+                printf("At most %d schedules are supported\n", MAX_SCHEDULES);
+                exit(1);
+            }
+            schedule_specs[num_schedule_specs++] = optarg;
+            break;
+        case 's':
+            if (num_delta_specs == NUM_COMMANDS)
+            {
+                printf("At most %zu delta suppressions are supported\n", NUM_COMMANDS);
+                exit(1);
+            }
+            delta_specs[num_delta_specs++] = optarg;
+            break;
+        case 'a':
+            if (num_window_specs == WINDOW_MAX_SERIES)
+            {
+                printf("At most %d aggregated fields are supported\n", WINDOW_MAX_SERIES);
+                exit(1);
+            }
+            window_specs[num_window_specs++] = optarg;
+            break;
+        case 'o':
+            store_path = optarg;
+            break;
+        case 'x':
+            if (num_field_specs == NUM_COMMANDS)
+            {
+                printf("At most %zu stored fields are supported\n", NUM_COMMANDS);
+                exit(1);
+            }
+            field_specs[num_field_specs++] = optarg;
+            break;
+        case 'd':
+            device_id = optarg;
+            break;
+        case 'D':
+            if (num_peer_specs == FLEET_MAX_PEERS)
+            {
+                printf("At most %d peer devices are supported\n", FLEET_MAX_PEERS);
+                exit(1);
+            }
+            peer_specs[num_peer_specs++] = optarg;
+            break;
+        case 'W':
+            broadcast_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'M':
+            if (num_macro_specs == COMMAND_MAX_MACROS)
+            {
+                printf("At most %d macros are supported\n", COMMAND_MAX_MACROS);
+                exit(1);
+            }
+            macro_specs[num_macro_specs++] = optarg;
+            break;
+        case 'H':
+            if (is_err(hedge_utils_parse_percentile(optarg, &hedge_percentile)))
+            {
+                printf("Invalid hedge percentile `%s`\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    const char* device_arg = optind < argc ? argv[optind] : NULL;
+    if (hedge_percentile > 0 && num_peer_specs == 0)
     {
-        printf("Missing serial device\n");
+        printf("Hedging needs a secondary device (-D)\n");
+        usage(argv[0]);
         exit(1);
     }
     logger_init(NULL, NULL);
     LOG_INFO("Logger initialized");
-    const char* message             = NULL;
-    SizedBuffer serial_input        = {0};
-    SizedBuffer serial_output       = {0};
-    bool should_send_serial_message = false;
+    ShmRecordHeader shm_header;
+    Request request;
+    buffer_utils_init();
+    rtt_utils_init(min_timeout_ms, max_timeout_ms);
+    rtt_utils_ledger_init(&g_ledger);
+    queue_utils_init(&g_queue, aging_ms);
+    timer_utils_init(&g_timer_wheel);
+    scheduler_utils_init(&g_scheduler, &g_timer_wheel, &g_queue);
+    window_utils_init(&g_aggregator, &g_timer_wheel, publish_window_summary);
+    // Macros first: they can be scheduled, aggregated or stored like the built-in commands.
+    for (size_t i = 0; i < num_macro_specs; i++)
+    {
+        if (is_err(macro_utils_define(macro_specs[i])))
+        {
+            printf("Invalid macro `%s`\n", macro_specs[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    fleet_utils_init(&g_fleet, broadcast_ms, publish_broadcast, answer_hedge);
+    hedge_utils_init(&g_hedger, hedge_percentile);
+    for (size_t i = 0; i < num_schedule_specs; i++)
+    {
+        if (is_err(scheduler_utils_add(&g_scheduler, schedule_specs[i])))
+        {
+            printf("Invalid schedule `%s`\n", schedule_specs[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < num_window_specs; i++)
+    {
+        if (is_err(window_utils_add(&g_aggregator, window_specs[i])))
+        {
+            printf("Invalid aggregation `%s`\n", window_specs[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < num_delta_specs; i++)
+    {
+        if (is_err(delta_utils_enable(delta_specs[i])))
+        {
+            printf("Invalid delta suppression `%s`\n", delta_specs[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < num_field_specs; i++)
+    {
+        if (is_err(store_field_enable(field_specs[i])))
+        {
+            printf("Invalid stored field `%s`\n", field_specs[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (trace_path != NULL && is_err(trace_utils_open(trace_path)))
+    {
+        exit(ERR_FATAL);
+    }
+    if (recorder_path[0] && is_err(recorder_utils_open(recorder_path)))
+    {
+        exit(ERR_FATAL);
+    }
+    if (store_path != NULL && is_err(store_utils_open(&g_store, store_path)))
+    {
+        exit(ERR_FATAL);
+    }
 
     fifo_utils_make_fifo(FIFO_IN);
     fifo_utils_make_fifo(FIFO_OUT);
@@ -66,67 +1012,271 @@ int main(int argc, char* argv[])
         printf("Failed to open FIFO `%s`.\n", FIFO_IN);
         exit(ERR_FATAL);
     }
-    struct pollfd polled_fd = {
-        .fd      = fifo_in_fd,
-        .events  = POLLIN,
-        .revents = POLLERR,
+    if (use_json)
+    {
+        // Opened read-write so that neither a missing nor a slow reader blocks the application.
+        g_fifo_out_fd = open(FIFO_OUT, O_RDWR | O_NONBLOCK);
+        if (g_fifo_out_fd < 0)
+        {
+            printf("Failed to open FIFO `%s`.\n", FIFO_OUT);
+            exit(ERR_FATAL);
+        }
+        if (is_err(spill_utils_open(
+                &g_output,
+                g_fifo_out_fd,
+                SPILL_DEFAULT_PATH,
+                output_memory,
+                output_file,
+                output_policy)))
+        {
+            exit(ERR_FATAL);
+        }
+    }
+    // A device given by its ID, or by a pattern, is discovered.
+    if (device_id != NULL || device_arg == NULL || strpbrk(device_arg, "*?[{") != NULL)
+    {
+        if (is_err(discovery_utils_find(
+                device_arg ? device_arg : DISCOVERY_DEFAULT_PATTERN,
+                device_id,
+                DISCOVERY_CACHE_PATH,
+                &g_device,
+                &g_serial_fd)))
+        {
+            exit(ERR_FATAL);
+        }
+        LOG_INFO("Connected to `%s` on `%s` (%s)", g_device.id, g_device.path, g_device.caps);
+    }
+    else
+    {
+        if (is_err(usb_utils_open_serial_port(device_arg, B115200, &g_serial_fd)))
+        {
+            exit(ERR_FATAL);
+        }
+        snprintf(g_device.path, DISCOVERY_PATH_SIZE, "%s", device_arg);
+        g_device.baud = usb_utils_bits_per_second(B115200);
+        discovery_utils_claim(device_arg);
+    }
+    // Peers given by their ID are looked for among the ports of the primary device.
+    for (size_t i = 0; i < num_peer_specs; i++)
+    {
+        const char* pattern = device_arg != NULL && strpbrk(device_arg, "*?[{") != NULL
+                                  ? device_arg
+                                  : DISCOVERY_DEFAULT_PATTERN;
+        if (is_err(fleet_utils_add(&g_fleet, peer_specs[i], pattern)))
+        {
+            printf("Failed to attach the peer device `%s`\n", peer_specs[i]);
+            exit(ERR_FATAL);
+        }
+    }
+    if (is_err(macro_utils_upload(g_serial_fd, &g_device)))
+    {
+        exit(ERR_FATAL);
+    }
+    for (size_t i = 0; i < g_fleet.num_peers; i++)
+    {
+        if (is_err(macro_utils_upload(g_fleet.peers[i].fd, &g_fleet.peers[i].profile)))
+        {
+            exit(ERR_FATAL);
+        }
+    }
+    usb_utils_write_queue_init(&g_serial_writes, g_device.baud);
+    // The last FLEET_MAX_PEERS entries are filled by fleet_utils_prepare_poll().
+    struct pollfd polled_fds[4 + FLEET_MAX_PEERS] = {
+        {
+            .fd      = fifo_in_fd,
+            .events  = POLLIN,
+            .revents = POLLERR,
+        },
+        {
+            .fd      = g_serial_fd,
+            .events  = POLLIN,
+            .revents = POLLERR,
+        },
+        {
+            .fd      = -1,
+            .events  = POLLIN,
+            .revents = POLLERR,
+        },
+        {
+            .fd      = -1,
+            .events  = POLLOUT,
+            .revents = POLLERR,
+        },
     };
+    // Unused entries have a negative fd, which poll() skips.
+    nfds_t num_polled_fds = sizeof(polled_fds) / sizeof(polled_fds[0]);
 
-    usb_utils_open_serial_port(argv[1], B115200, &g_serial_fd);
+    if (use_shm)
+    {
+        fifo_utils_make_fifo(SHM_DOORBELL);
+        polled_fds[2].fd = open(SHM_DOORBELL, O_RDWR | O_NONBLOCK);
+        if (polled_fds[2].fd < 0)
+        {
+            printf("Failed to open FIFO `%s`.\n", SHM_DOORBELL);
+            exit(ERR_FATAL);
+        }
+        if (shm_utils_create(SHM_NAME, &g_shm_p) != ERR_ALL_GOOD)
+        {
+            exit(ERR_FATAL);
+        }
+    }
 
     struct sigaction sa = {.sa_handler = signal_handler};
     sigaction(SIGINT, &sa, 0);
     sigaction(SIGTERM, &sa, 0);
+    struct sigaction log_level_sa = {.sa_handler = log_level_signal_handler};
+    sigaction(SIGUSR1, &log_level_sa, 0);
+    sigaction(SIGUSR2, &log_level_sa, 0);
     while (!g_should_close)
     {
-        // Wait for a POLLIN event or keep processing the buffer (.size  != 0)
-        if (poll(&polled_fd, 1, 500) > 0 && (polled_fd.revents & POLLIN))
+        // Only block if there is nothing left to dispatch and the shared memory ring is empty.
+        // While a request is outstanding, nothing can be dispatched anyway.
+        bool idle = g_has_outstanding || fleet_utils_is_gathering(&g_fleet)
+                    || queue_utils_is_empty(&g_queue);
+        bool shm_sleeping = idle && g_shm_p != NULL && shm_utils_server_prepare_sleep(g_shm_p);
+        if (idle)
         {
-            if (fifo_utils_read_line(&g_fifo_input, fifo_in_fd) == ERR_FATAL)
-            {
-                exit(ERR_FATAL);
-            }
-            if (strncmp(g_fifo_input.buffer, "POLL\n", 5) == 0)
-            {
-                message            = "give me a long string!\n";
-                serial_output.size = strlen(message);
-                LOG_TRACE("size to send %lu", serial_output.size);
-                memcpy(serial_output.buffer, message, serial_output.size);
-                should_send_serial_message = true;
-            }
-            bzero((void*)g_fifo_input.buffer, g_fifo_input.size);
-
-            if (should_send_serial_message)
+            trace_utils_flush();
+        }
+        int timeout_ms  = idle && (g_shm_p == NULL || shm_sleeping) ? 500 : 0;
+        uint64_t now_ns = get_monotonic_ns();
+        if (g_has_outstanding)
+        {
+            // Wake up in time to give up on the outstanding request, or to hedge it.
+            uint64_t wake_ns = g_hedge_at_ns && g_hedge_at_ns < g_deadline_ns ? g_hedge_at_ns
+                                                                              : g_deadline_ns;
+            int deadline_ms  = wake_ns > now_ns
+                                   ? (int)((wake_ns - now_ns + NS_PER_MS - 1) / NS_PER_MS)
+                                   : 0;
+            timeout_ms      = deadline_ms < timeout_ms ? deadline_ms : timeout_ms;
+        }
+        // Wake up in time for the next scheduled command, and for the next serial bytes the pacing
+        // lets through. Bytes the driver refused are written on POLLOUT.
+        timeout_ms = timer_utils_next_timeout_ms(&g_timer_wheel, now_ns, timeout_ms);
+        timeout_ms = usb_utils_write_timeout_ms(&g_serial_writes, now_ns, timeout_ms);
+        bool write_blocked    = usb_utils_write_is_blocked(&g_serial_writes);
+        polled_fds[1].events = POLLIN | (write_blocked ? POLLOUT : 0);
+        // The output FIFO is only polled while the reader lags behind.
+        polled_fds[3].fd = spill_utils_is_pending(&g_output) ? g_fifo_out_fd : -1;
+        timeout_ms       = fleet_utils_prepare_poll(&g_fleet, &polled_fds[4], now_ns, timeout_ms);
+        int num_events   = poll(polled_fds, num_polled_fds, timeout_ms);
+        if (g_log_level_steps)
+        {
+            int steps         = g_log_level_steps;
+            g_log_level_steps = 0;
+            set_log_level(logger_get_level() + steps);
+        }
+        timer_utils_advance(&g_timer_wheel, get_monotonic_ns());
+        if (shm_sleeping)
+        {
+            shm_utils_server_woken(g_shm_p, polled_fds[2].fd, polled_fds[2].revents & POLLIN);
+        }
+        if (num_events > 0 && (polled_fds[1].revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            read_serial();
+        }
+        if (g_serial_writes.size && (!write_blocked || (polled_fds[1].revents & POLLOUT)))
+        {
+            flush_serial_writes();
+        }
+        if (num_events > 0 && (polled_fds[3].revents & POLLOUT))
+        {
+            spill_utils_drain(&g_output);
+        }
+        if (g_has_outstanding && get_monotonic_ns() >= g_deadline_ns)
+        {
+            complete_request(ERR_TIMEOUT, NULL);
+        }
+        if (g_has_outstanding && g_hedge_at_ns && get_monotonic_ns() >= g_hedge_at_ns)
+        {
+            send_hedge();
+        }
+        fleet_utils_on_poll(&g_fleet, &polled_fds[4], get_monotonic_ns());
+        // Read every pending instruction before dispatching, so that an urgent one can overtake
+        // the bulk ones queued before it.
+        if (num_events > 0 && (polled_fds[0].revents & POLLIN))
+        {
+            do
             {
-                should_send_serial_message = false;
-                if (usb_utils_write_port(g_serial_fd, &serial_output) != ERR_ALL_GOOD)
+                if (fifo_utils_read_line(&g_fifo_input, fifo_in_fd) == ERR_FATAL)
                 {
-                    LOG_ERROR("This should not happen");
                     exit(ERR_FATAL);
                 }
-                if (usb_utils_read_port(g_serial_fd, &serial_input) == ERR_ALL_GOOD)
+                if (g_fifo_input.size)
                 {
-                    if (serial_input.size)
-                    {
-                        LOG_INFO("Read: %s", serial_input.buffer);
-                    }
-                    else
-                    {
-                        LOG_WARNING("Got an empty answer");
-                    }
+                    trace_utils_record(TRACE_INSTRUCTION, g_fifo_input.buffer, g_fifo_input.size);
                 }
-                else
+                if (g_fifo_input.size && !handle_control_instruction(&g_fifo_input))
                 {
-                    printf("Timeout\n");
+                    enqueue_instruction(&g_queue, &g_fifo_input, SOURCE_FIFO, 0);
+                }
+            } while (g_fifo_input.size);
+        }
+        else if (num_events == 0 && !g_has_outstanding && !fleet_utils_is_gathering(&g_fleet)
+                 && queue_utils_is_empty(&g_queue)
+                 && (g_shm_p == NULL || shm_utils_ring_is_empty(&g_shm_p->requests)))
+        {
+            LOG_INFO_EVERY(10000, "Waiting for FIFO message");
+        }
+
+        while (g_shm_p != NULL
+               && shm_utils_ring_pop(
+                   &g_shm_p->requests,
+                   &shm_header,
+                   g_fifo_input.buffer,
+                   COMMUNICATION_BUFF_IN_SIZE - 1))
+        {
+            g_fifo_input.size                    = shm_header.size;
+            g_fifo_input.buffer[shm_header.size] = 0;
+            trace_utils_record(TRACE_INSTRUCTION, g_fifo_input.buffer, g_fifo_input.size);
+            if (handle_control_instruction(&g_fifo_input))
+            {
+                shm_utils_server_respond(g_shm_p, shm_header.tag, ERR_ALL_GOOD, NULL, 0);
+            }
+            else
+            {
+                Error res
+                    = enqueue_instruction(&g_queue, &g_fifo_input, SOURCE_SHM, shm_header.tag);
+                if (is_err(res))
+                {
+                    shm_utils_server_respond(g_shm_p, shm_header.tag, res, NULL, 0);
                 }
             }
         }
-        else
+
+        // Dispatch one request per iteration so that new instructions are read in between.
+        if (!g_has_outstanding && !fleet_utils_is_gathering(&g_fleet)
+            && queue_utils_pop(&g_queue, &request))
         {
-            printf("Waiting for FIFO message\n");
+            scheduler_utils_on_dispatched(&g_scheduler, &request);
+            dispatch_request(&request);
         }
     }
 
+    queue_utils_print_stats(&g_queue);
+    scheduler_utils_print_stats(&g_scheduler);
+    rtt_utils_print_stats(&g_ledger);
+    delta_utils_print_stats();
+    window_utils_print_stats(&g_aggregator);
+    store_utils_print_stats(&g_store);
+    spill_utils_print_stats(&g_output);
+    fleet_utils_print_stats(&g_fleet);
+    hedge_utils_print_stats(&g_hedger);
+    usb_utils_print_write_stats(&g_serial_writes);
+    event_utils_print_stats();
+    buffer_utils_print_stats();
+    event_utils_close();
+    delta_utils_close();
+    trace_utils_close();
+    recorder_utils_close();
+    store_utils_close(&g_store);
+    spill_utils_close(&g_output);
+    fleet_utils_close(&g_fleet);
+    if (g_shm_p != NULL)
+    {
+        shm_utils_destroy(SHM_NAME, g_shm_p);
+    }
+
     printf("should close =        %d\n", g_should_close);
     return ERR_ALL_GOOD;
 }
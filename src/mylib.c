@@ -75,6 +75,8 @@ void test_logger(void);
     }
 
 #if LOG_LEVEL > LEVEL_NO_LOGS
+#include <stdatomic.h>
+
 #define DATE_TIME_STR_LEN 26
 void logger_init(const char*, const char*);
 pthread_mutex_t* logger_get_out_mut_p(void);
@@ -85,6 +87,49 @@ FILE* get_log_err_file(void);
 
 void get_date_time(char* date_time_str);
 
+// Every logging call site owns a static LogSite, whose `state` is checked before anything else: a
+// call site disabled at runtime costs a single branch. Sites register themselves the first time
+// they are reached, so that `logger_set_level()` can update all of them at once. A site with an
+// `interval_ms` logs at most one message per interval and counts the ones it suppressed. The
+// mutable fields are atomic since other threads log too (e.g. the store flusher): relaxed
+// accesses, a site only needs to see the latest level eventually.
+#define LOG_SITE_DISABLED 0
+#define LOG_SITE_ENABLED 1
+#define LOG_SITE_UNREGISTERED 2
+
+typedef struct LogSite
+{
+    _Atomic uint8_t state;
+    uint8_t level;
+    uint32_t interval_ms;
+    _Atomic uint64_t last_ns;
+    _Atomic uint64_t suppressed;
+    struct LogSite* next; /* Under the sites mutex */
+} LogSite;
+
+bool logger_site_allows(LogSite* site_p);
+void logger_set_level(int level);
+int logger_get_level(void);
+const char* logger_level_name(int level);
+Error logger_parse_level(const char* name, size_t name_len, int* level_p);
+
+#define log_site_(LEVEL, INTERVAL_MS)                                                              \
+    static LogSite _log_site = {                                                                   \
+        .state       = LOG_SITE_UNREGISTERED,                                                      \
+        .level       = LEVEL,                                                                      \
+        .interval_ms = INTERVAL_MS,                                                                \
+    };                                                                                             \
+    if (atomic_load_explicit(&_log_site.state, memory_order_relaxed) != LOG_SITE_DISABLED          \
+        && logger_site_allows(&_log_site))
+
+#define log_suppressed_(FILE_P)                                                                    \
+    uint64_t _suppressed                                                                           \
+        = atomic_exchange_explicit(&_log_site.suppressed, 0, memory_order_relaxed);                \
+    if (_suppressed)                                                                               \
+    {                                                                                              \
+        fprintf(FILE_P, " (%llu similar suppressed)", (unsigned long long)_suppressed);            \
+    }
+
 #define log_header_o(TYPE)                                                                         \
     char date_time_str[DATE_TIME_STR_LEN];                                                         \
     get_date_time(date_time_str);                                                                  \
@@ -113,12 +158,14 @@ void get_date_time(char* date_time_str);
 
 #define log_footer_o(...)                                                                          \
     fprintf(log_out, __VA_ARGS__);                                                                 \
+    log_suppressed_(log_out);                                                                      \
     fprintf(log_out, "\n");                                                                        \
     fflush(log_out);                                                                               \
     pthread_mutex_unlock(logger_get_out_mut_p());
 
 #define log_footer_e(...)                                                                          \
     fprintf(log_err, __VA_ARGS__);                                                                 \
+    log_suppressed_(log_err);                                                                      \
     fprintf(log_err, "\n");                                                                        \
     fflush(log_err);                                                                               \
     pthread_mutex_unlock(logger_get_err_mut_p());
@@ -133,66 +180,108 @@ void get_date_time(char* date_time_str);
     }
 
 #else /* LOG_LEVEL > LEVEL_NO_LOGS */
+#define logger_init(log_out_file_path_str, log_err_file_path_str)
 #define get_date_time(something)
 #define PRINT_SEPARATOR()
+#define logger_set_level(level)
+#define logger_get_level() LEVEL_NO_LOGS
+#define logger_level_name(level) "none"
+// No level can be enabled.
+static inline Error logger_parse_level(const char* name, size_t name_len, int* level_p)
+{
+    UNUSED(name);
+    UNUSED(name_len);
+    UNUSED(level_p);
+    return ERR_INVALID;
+}
 #endif /* LOG_LEVEL > LEVEL_NO_LOGS */
 
+// `LOG_<LEVEL>_EVERY(interval_ms, ...)` logs at most once every `interval_ms` (noisy call sites).
 #if LOG_LEVEL >= LEVEL_ERROR
 #define LOG_ERROR(...)                                                                             \
     {                                                                                              \
-        log_header_e(ERROR);                                                                       \
-        log_footer_e(__VA_ARGS__);                                                                 \
+        log_site_(LEVEL_ERROR, 0)                                                                  \
+        {                                                                                          \
+            log_header_e(ERROR);                                                                   \
+            log_footer_e(__VA_ARGS__);                                                             \
+        }                                                                                          \
     }
 
 #define LOG_PERROR(...)                                                                            \
     {                                                                                              \
-        log_header_e(ERROR);                                                                       \
-        fprintf(log_err, "`%s` | ", strerror(errno));                                              \
-        log_footer_e(__VA_ARGS__);                                                                 \
+        log_site_(LEVEL_ERROR, 0)                                                                  \
+        {                                                                                          \
+            log_header_e(ERROR);                                                                   \
+            fprintf(log_err, "`%s` | ", strerror(errno));                                          \
+            log_footer_e(__VA_ARGS__);                                                             \
+        }                                                                                          \
     }
 #else
 #define LOG_ERROR(...)
+#define LOG_PERROR(...)
 #endif
 
 #if LOG_LEVEL >= LEVEL_WARNING
-#define LOG_WARNING(...)                                                                           \
+#define LOG_WARNING_EVERY(INTERVAL_MS, ...)                                                        \
     {                                                                                              \
-        log_header_e(WARN);                                                                        \
-        log_footer_e(__VA_ARGS__);                                                                 \
+        log_site_(LEVEL_WARNING, INTERVAL_MS)                                                      \
+        {                                                                                          \
+            log_header_e(WARN);                                                                    \
+            log_footer_e(__VA_ARGS__);                                                             \
+        }                                                                                          \
     }
 #else
-#define LOG_WARNING(...)
+#define LOG_WARNING_EVERY(...)
 #endif
+#define LOG_WARNING(...) LOG_WARNING_EVERY(0, __VA_ARGS__)
 
 #if LOG_LEVEL >= LEVEL_INFO
-#define LOG_INFO(...)                                                                              \
+#define LOG_INFO_EVERY(INTERVAL_MS, ...)                                                           \
     {                                                                                              \
-        log_header_o(INFO);                                                                        \
-        log_footer_o(__VA_ARGS__);                                                                 \
+        log_site_(LEVEL_INFO, INTERVAL_MS)                                                         \
+        {                                                                                          \
+            log_header_o(INFO);                                                                    \
+            log_footer_o(__VA_ARGS__);                                                             \
+        }                                                                                          \
     }
 #else
-#define LOG_INFO(...)
+#define LOG_INFO_EVERY(...)
 #endif
+#define LOG_INFO(...) LOG_INFO_EVERY(0, __VA_ARGS__)
 
 #if LOG_LEVEL >= LEVEL_DEBUG
-#define LOG_DEBUG(...)                                                                             \
+#define LOG_DEBUG_EVERY(INTERVAL_MS, ...)                                                          \
     {                                                                                              \
-        log_header_o(DEBUG);                                                                       \
-        log_footer_o(__VA_ARGS__);                                                                 \
+        log_site_(LEVEL_DEBUG, INTERVAL_MS)                                                        \
+        {                                                                                          \
+            log_header_o(DEBUG);                                                                   \
+            log_footer_o(__VA_ARGS__);                                                             \
+        }                                                                                          \
     }
 #else
-#define LOG_DEBUG(...)
+#define LOG_DEBUG_EVERY(...)
 #endif
+#define LOG_DEBUG(...) LOG_DEBUG_EVERY(0, __VA_ARGS__)
 
 #if LOG_LEVEL >= LEVEL_TRACE
-#define LOG_TRACE(...)                                                                             \
+#define LOG_TRACE_EVERY(INTERVAL_MS, ...)                                                          \
     {                                                                                              \
-        log_header_o(TRACE);                                                                       \
-        log_footer_o(__VA_ARGS__);                                                                 \
+        log_site_(LEVEL_TRACE, INTERVAL_MS)                                                        \
+        {                                                                                          \
+            log_header_o(TRACE);                                                                   \
+            log_footer_o(__VA_ARGS__);                                                             \
+        }                                                                                          \
     }
 #else
-#define LOG_TRACE(...)
+#define LOG_TRACE_EVERY(...)
 #endif
+#define LOG_TRACE(...) LOG_TRACE_EVERY(0, __VA_ARGS__)
+
+// ---------- TIME ----------
+#define NS_PER_MS (1000000ULL)
+#define NS_PER_SEC (1000000000ULL)
+
+uint64_t get_monotonic_ns(void);
 
 // ---------- ASSERT ----------
 #if TEST == 1
@@ -353,6 +442,91 @@ void logger_init(const char* log_out_file_path_str, const char* log_err_file_pat
     }
 }
 
+static LogSite* log_sites_p = NULL;
+static _Atomic int log_level = LOG_LEVEL;
+static pthread_mutex_t log_sites_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char* log_level_names[] = {"none", "error", "warning", "info", "debug", "trace"};
+
+// Slow path of the logging macros, only taken by the sites that are enabled or not registered yet.
+bool logger_site_allows(LogSite* site_p)
+{
+    if (atomic_load_explicit(&site_p->state, memory_order_relaxed) == LOG_SITE_UNREGISTERED)
+    {
+        pthread_mutex_lock(&log_sites_mutex);
+        if (atomic_load_explicit(&site_p->state, memory_order_relaxed) == LOG_SITE_UNREGISTERED)
+        {
+            site_p->next = log_sites_p;
+            log_sites_p  = site_p;
+            atomic_store_explicit(
+                &site_p->state,
+                site_p->level <= log_level ? LOG_SITE_ENABLED : LOG_SITE_DISABLED,
+                memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&log_sites_mutex);
+        if (atomic_load_explicit(&site_p->state, memory_order_relaxed) == LOG_SITE_DISABLED)
+        {
+            return false;
+        }
+    }
+    if (site_p->interval_ms)
+    {
+        // Only the thread that moves `last_ns` forward logs.
+        uint64_t now_ns  = get_monotonic_ns();
+        uint64_t last_ns = atomic_load_explicit(&site_p->last_ns, memory_order_relaxed);
+        if ((last_ns && now_ns - last_ns < site_p->interval_ms * NS_PER_MS)
+            || !atomic_compare_exchange_strong_explicit(
+                &site_p->last_ns, &last_ns, now_ns, memory_order_relaxed, memory_order_relaxed))
+        {
+            atomic_fetch_add_explicit(&site_p->suppressed, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Levels above the compile-time LOG_LEVEL cannot be enabled: their call sites are compiled out.
+void logger_set_level(int level)
+{
+    level = level < LEVEL_NO_LOGS ? LEVEL_NO_LOGS : (level > LOG_LEVEL ? LOG_LEVEL : level);
+    pthread_mutex_lock(&log_sites_mutex);
+    log_level = level;
+    for (LogSite* site_p = log_sites_p; site_p != NULL; site_p = site_p->next)
+    {
+        atomic_store_explicit(
+            &site_p->state,
+            site_p->level <= level ? LOG_SITE_ENABLED : LOG_SITE_DISABLED,
+            memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&log_sites_mutex);
+}
+
+int logger_get_level(void) { return log_level; }
+
+const char* logger_level_name(int level)
+{
+    return level >= LEVEL_NO_LOGS && level <= LEVEL_TRACE ? log_level_names[level] : "unknown";
+}
+
+// Accepts a level name (`info`...) or number (`3`...).
+Error logger_parse_level(const char* name, size_t name_len, int* level_p)
+{
+    if (name_len == 1 && name[0] >= '0' + LEVEL_NO_LOGS && name[0] <= '0' + LEVEL_TRACE)
+    {
+        *level_p = name[0] - '0';
+        return ERR_ALL_GOOD;
+    }
+    for (int level = LEVEL_NO_LOGS; level <= LEVEL_TRACE; level++)
+    {
+        if (strlen(log_level_names[level]) == name_len
+            && strncasecmp(log_level_names[level], name, name_len) == 0)
+        {
+            *level_p = level;
+            return ERR_ALL_GOOD;
+        }
+    }
+    return ERR_INVALID;
+}
+
 void get_date_time(char* date_time_str)
 {
     time_t ltime;
@@ -367,6 +541,15 @@ void get_date_time(char* date_time_str)
 }
 
 #endif /* LOG_LEVEL > LEVEL_NO_LOGS */
+
+// ---------- TIME ----------
+uint64_t get_monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
 #if TEST == 1
 void test_logger(void)
 {
@@ -0,0 +1,184 @@
+#define REQUEST_QUEUE_CAPACITY (64)
+#define QUEUE_LATENCY_BUCKETS (32)
+
+typedef enum
+{
+    SOURCE_FIFO,
+    SOURCE_SHM,
+    SOURCE_SCHEDULER,
+} RequestSource;
+
+typedef struct
+{
+    uint32_t id;
+    const Command* command_p;
+    Priority priority;
+    RequestSource source;
+    uint32_t tag;          /* Shared memory tag, echoed back in the response */
+    int schedule_id;       /* Index of the schedule that issued the request */
+    uint64_t scheduled_ns; /* When a scheduled sample was due */
+    bool broadcast;        /* Sent to every device, see `src/fleetutils.c` */
+    bool hedged;           /* Also sent to the secondary device, see `src/hedgeutils.c` */
+    bool hedge_won;        /* Answered by the secondary device first */
+    uint64_t enqueued_ns;
+    uint64_t dispatched_ns;
+    uint64_t written_ns;
+    uint64_t completed_ns;
+    MessageBuffer* response_p; /* Reference held until the request is completed, NULL if none */
+} Request;
+
+typedef struct
+{
+    Request requests[REQUEST_QUEUE_CAPACITY];
+    size_t head;
+    size_t size;
+} RequestRing;
+
+// Queueing latency of the requests served from one priority class. `histogram[i]` counts the
+// requests that waited less than 2^i microseconds.
+typedef struct
+{
+    uint64_t served;
+    uint64_t rejected;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t histogram[QUEUE_LATENCY_BUCKETS];
+} QueueStats;
+
+// One FIFO queue per priority class. The dispatcher always serves the head of the class with the
+// highest effective priority, where every `aging_ns` spent waiting is worth one priority level.
+// This way bulk requests can be overtaken but never starved.
+typedef struct
+{
+    RequestRing classes[NUM_PRIORITIES];
+    QueueStats stats[NUM_PRIORITIES];
+    uint64_t aging_ns;
+    uint32_t next_id;
+} RequestQueue;
+
+void queue_utils_init(RequestQueue* queue_p, uint64_t aging_ms)
+{
+    memset(queue_p, 0, sizeof(RequestQueue));
+    queue_p->aging_ns = aging_ms * NS_PER_MS;
+    queue_p->next_id  = 1;
+}
+
+bool queue_utils_is_empty(const RequestQueue* queue_p)
+{
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+    {
+        if (queue_p->classes[i].size)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Assigns the request ID and the enqueue time. Returns ERR_OUT_OF_RANGE if the class is full.
+Error queue_utils_push(RequestQueue* queue_p, Request* request_p)
+{
+    RequestRing* ring_p = &queue_p->classes[request_p->priority];
+    if (ring_p->size == REQUEST_QUEUE_CAPACITY)
+    {
+        queue_p->stats[request_p->priority].rejected++;
+        LOG_WARNING(
+            "Queue `%s` full, rejecting `%s`",
+            priority_names[request_p->priority],
+            request_p->command_p->name);
+        return ERR_OUT_OF_RANGE;
+    }
+    request_p->id          = queue_p->next_id++;
+    request_p->enqueued_ns = get_monotonic_ns();
+    ring_p->requests[(ring_p->head + ring_p->size) % REQUEST_QUEUE_CAPACITY] = *request_p;
+    ring_p->size++;
+    return ERR_ALL_GOOD;
+}
+
+static void _queue_utils_record_wait(QueueStats* stats_p, uint64_t wait_ns)
+{
+    size_t bucket = 0;
+    for (uint64_t wait_us = wait_ns / 1000; wait_us && bucket < QUEUE_LATENCY_BUCKETS - 1;
+         wait_us >>= 1)
+    {
+        bucket++;
+    }
+    stats_p->served++;
+    stats_p->total_wait_ns += wait_ns;
+    stats_p->max_wait_ns = wait_ns > stats_p->max_wait_ns ? wait_ns : stats_p->max_wait_ns;
+    stats_p->histogram[bucket]++;
+}
+
+// Returns `false` if there is nothing to dispatch.
+bool queue_utils_pop(RequestQueue* queue_p, Request* request_p)
+{
+    uint64_t now_ns     = get_monotonic_ns();
+    int best_class      = -1;
+    uint64_t best_score = 0;
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+    {
+        RequestRing* ring_p = &queue_p->classes[i];
+        if (ring_p->size == 0)
+        {
+            continue;
+        }
+        uint64_t waited_ns = now_ns - ring_p->requests[ring_p->head].enqueued_ns;
+        uint64_t score     = (uint64_t)i * queue_p->aging_ns + waited_ns;
+        if (best_class < 0 || score > best_score)
+        {
+            best_class = i;
+            best_score = score;
+        }
+    }
+    if (best_class < 0)
+    {
+        return false;
+    }
+    RequestRing* ring_p = &queue_p->classes[best_class];
+    *request_p          = ring_p->requests[ring_p->head];
+    ring_p->head        = (ring_p->head + 1) % REQUEST_QUEUE_CAPACITY;
+    ring_p->size--;
+    request_p->dispatched_ns = now_ns;
+    _queue_utils_record_wait(&queue_p->stats[best_class], now_ns - request_p->enqueued_ns);
+    return true;
+}
+
+uint64_t _queue_utils_percentile_us(const QueueStats* stats_p, double percentile)
+{
+    uint64_t target = (uint64_t)(stats_p->served * percentile);
+    uint64_t count  = 0;
+    if (stats_p->served == 0)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < QUEUE_LATENCY_BUCKETS; i++)
+    {
+        count += stats_p->histogram[i];
+        if (count > target)
+        {
+            return i == 0 ? 1 : (1ULL << i);
+        }
+    }
+    return 1ULL << (QUEUE_LATENCY_BUCKETS - 1);
+}
+
+void queue_utils_print_stats(const RequestQueue* queue_p)
+{
+    for (int i = NUM_PRIORITIES - 1; i >= 0; i--)
+    {
+        const QueueStats* stats_p = &queue_p->stats[i];
+        UNUSED(stats_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        LOG_INFO(
+            "Queue %-6s | waiting %2zu served %6" PRIu64 " rejected %4" PRIu64
+            " | wait mean %8" PRIu64 " us, p50 < %" PRIu64 " us, p99 < %" PRIu64
+            " us, max %" PRIu64 " us",
+            priority_names[i],
+            queue_p->classes[i].size,
+            stats_p->served,
+            stats_p->rejected,
+            stats_p->served ? stats_p->total_wait_ns / stats_p->served / 1000 : 0,
+            _queue_utils_percentile_us(stats_p, 0.5),
+            _queue_utils_percentile_us(stats_p, 0.99),
+            stats_p->max_wait_ns / 1000);
+    }
+}
@@ -0,0 +1,164 @@
+// Flight recorder: the last RECORDER_CAPACITY transactions, kept in a memory-mapped file.
+// Recording a transaction only stores into the mapping (no system call), and the kernel keeps the
+// pages of a shared file mapping when the process crashes or is killed, so the file always holds
+// the most recent transactions. It does not survive a power loss. Decode it with
+// `tools/flight-decode.c`.
+//
+// File layout: a RecorderHeader followed by RECORDER_CAPACITY fixed-size RecorderRecords. Record
+// number `n` (starting at 1) lives in slot `(n - 1) % RECORDER_CAPACITY` and its `sequence` is set
+// to `n` last, so a slot holding a half-written record has a `sequence` of 0. The file is reused
+// across restarts: numbering continues where the previous process stopped.
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define RECORDER_DEFAULT_PATH "artifacts/flight_recorder"
+#define RECORDER_MAGIC "MFFR"
+#define RECORDER_VERSION (1)
+#define RECORDER_CAPACITY (4096)
+#define RECORDER_RECORD_SIZE (256)
+#define RECORDER_COMMAND_SIZE (16)
+#define RECORDER_RESPONSE_SIZE (200)
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t capacity;
+    uint32_t reserved;
+    _Atomic uint64_t next_sequence;
+} RecorderHeader;
+
+typedef struct
+{
+    _Atomic uint64_t sequence;
+    uint64_t completed_realtime_ns;
+    uint32_t id;
+    uint32_t queued_us;
+    uint32_t write_us;
+    uint32_t read_us;
+    uint16_t response_size; /* Full size, even if only a prefix is kept */
+    int8_t status;          /* Error */
+    uint8_t priority;
+    uint8_t source;
+    uint8_t reserved[3];
+    char command[RECORDER_COMMAND_SIZE];
+    char response[RECORDER_RESPONSE_SIZE];
+} RecorderRecord;
+
+_Static_assert(sizeof(RecorderRecord) == RECORDER_RECORD_SIZE, "Unexpected record size");
+
+typedef struct
+{
+    RecorderHeader header;
+    RecorderRecord records[RECORDER_CAPACITY];
+} RecorderFile;
+
+static RecorderFile* recorder_p = NULL;
+// Offset between the monotonic clock used by the requests and the wall clock.
+static uint64_t recorder_realtime_offset_ns = 0;
+
+static bool _recorder_utils_is_valid(const RecorderFile* file_p)
+{
+    return memcmp(file_p->header.magic, RECORDER_MAGIC, 4) == 0
+           && file_p->header.version == RECORDER_VERSION
+           && file_p->header.record_size == RECORDER_RECORD_SIZE
+           && file_p->header.capacity == RECORDER_CAPACITY;
+}
+
+Error recorder_utils_open(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        LOG_PERROR("Failed to open the flight recorder `%s`", path);
+        return ERR_FS_INTERNAL;
+    }
+    struct stat st;
+    bool reuse = fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(RecorderFile);
+    if (!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(RecorderFile)) < 0))
+    {
+        LOG_PERROR("Failed to size the flight recorder `%s`", path);
+        close(fd);
+        return ERR_FS_INTERNAL;
+    }
+    void* mapping_p = mmap(NULL, sizeof(RecorderFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping_p == MAP_FAILED)
+    {
+        LOG_PERROR("Failed to map the flight recorder `%s`", path);
+        return ERR_FS_INTERNAL;
+    }
+    recorder_p = mapping_p;
+    if (!reuse || !_recorder_utils_is_valid(recorder_p))
+    {
+        memset(recorder_p, 0, sizeof(RecorderFile));
+        memcpy(recorder_p->header.magic, RECORDER_MAGIC, 4);
+        recorder_p->header.version     = RECORDER_VERSION;
+        recorder_p->header.record_size = RECORDER_RECORD_SIZE;
+        recorder_p->header.capacity    = RECORDER_CAPACITY;
+        atomic_store(&recorder_p->header.next_sequence, 1);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    recorder_realtime_offset_ns
+        = (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec - get_monotonic_ns();
+    LOG_INFO(
+        "Flight recorder `%s`: %d transactions, %" PRIu64 " recorded so far",
+        path,
+        RECORDER_CAPACITY,
+        atomic_load(&recorder_p->header.next_sequence) - 1);
+    return ERR_ALL_GOOD;
+}
+
+static uint32_t _recorder_utils_us(uint64_t from_ns, uint64_t to_ns)
+{
+    uint64_t us = to_ns > from_ns ? (to_ns - from_ns) / 1000 : 0;
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+void recorder_utils_record(const Request* request_p, Error res)
+{
+    if (recorder_p == NULL)
+    {
+        return;
+    }
+    uint64_t sequence
+        = atomic_load_explicit(&recorder_p->header.next_sequence, memory_order_relaxed);
+    RecorderRecord* record_p = &recorder_p->records[(sequence - 1) % RECORDER_CAPACITY];
+    atomic_store_explicit(&record_p->sequence, 0, memory_order_relaxed);
+    atomic_signal_fence(memory_order_seq_cst);
+
+    const MessageBuffer* response_p = request_p->response_p;
+    size_t response_size            = response_p ? response_p->size : 0;
+    size_t kept_size
+        = response_size < RECORDER_RESPONSE_SIZE ? response_size : RECORDER_RESPONSE_SIZE;
+    record_p->completed_realtime_ns = request_p->completed_ns + recorder_realtime_offset_ns;
+    record_p->id                    = request_p->id;
+    record_p->queued_us     = _recorder_utils_us(request_p->enqueued_ns, request_p->dispatched_ns);
+    record_p->write_us      = _recorder_utils_us(request_p->dispatched_ns, request_p->written_ns);
+    record_p->read_us       = _recorder_utils_us(request_p->written_ns, request_p->completed_ns);
+    record_p->response_size = response_size > UINT16_MAX ? UINT16_MAX : (uint16_t)response_size;
+    record_p->status        = (int8_t)res;
+    record_p->priority      = (uint8_t)request_p->priority;
+    record_p->source        = (uint8_t)request_p->source;
+    strncpy(record_p->command, request_p->command_p->name, RECORDER_COMMAND_SIZE);
+    if (kept_size)
+    {
+        memcpy(record_p->response, response_p->data, kept_size);
+    }
+    memset(record_p->response + kept_size, 0, RECORDER_RESPONSE_SIZE - kept_size);
+
+    // Publish the record last: a crash before this point leaves the slot marked as invalid.
+    atomic_store_explicit(&record_p->sequence, sequence, memory_order_release);
+    atomic_store_explicit(&recorder_p->header.next_sequence, sequence + 1, memory_order_release);
+}
+
+void recorder_utils_close(void)
+{
+    if (recorder_p != NULL)
+    {
+        munmap(recorder_p, sizeof(RecorderFile));
+        recorder_p = NULL;
+    }
+}
@@ -0,0 +1,211 @@
+// Response timeouts learned per command from the observed round-trip times (RTT), with the
+// estimator TCP uses for its retransmission timeout (RFC 6298):
+//   first sample R:   SRTT = R, RTTVAR = R / 2
+//   next samples R:   RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+//   timeout:          SRTT + max(granularity, 4 RTTVAR), clamped to the configured bounds
+// A timeout doubles the command's timeout until the next response (exponential back-off), and
+// the time at which a timed out request is given up on is never used as a sample.
+//
+// With timeouts that short, a device answering late is a normal case: the reply of a request
+// given up on is owed, and discarded when it arrives instead of answering the next request. A
+// device may also drop a reply: the reply of the next request is then discarded in its place, and
+// that request is given up on in turn. Since the reply discarded after it was sent was likely its
+// own, such a request owes nothing, which puts the replies back in step.
+#define RTT_DEFAULT_MIN_MS (5)
+#define RTT_DEFAULT_MAX_MS (2000)
+#define RTT_INITIAL_TIMEOUT_MS (100)
+#define RTT_GRANULARITY_NS (NS_PER_MS) /* Resolution of the poll() timeout */
+#define RTT_MAX_OWED (8)
+
+typedef struct
+{
+    uint64_t srtt_ns;
+    uint64_t rttvar_ns;
+    uint64_t timeout_ns;
+    uint64_t samples;
+    uint64_t timeouts;
+    uint64_t min_rtt_ns;
+    uint64_t max_rtt_ns;
+} RttEstimator;
+
+// A reply a device still owes for a request already completed.
+typedef struct
+{
+    const Command* command_p;
+    uint64_t dispatched_ns;
+    uint64_t until_ns;
+} RttOwed;
+
+// The replies one device owes.
+typedef struct
+{
+    RttOwed owed[RTT_MAX_OWED];
+    size_t head;
+    size_t num_owed;
+    uint64_t last_late_ns; /* When the last late reply was discarded */
+    uint64_t late_replies;
+    uint64_t never_answered;
+} RttLedger;
+
+static RttEstimator rtt_estimators[NUM_COMMANDS];
+static uint64_t rtt_min_ns = RTT_DEFAULT_MIN_MS * NS_PER_MS;
+static uint64_t rtt_max_ns = RTT_DEFAULT_MAX_MS * NS_PER_MS;
+
+static uint64_t _rtt_utils_clamp(uint64_t timeout_ns)
+{
+    if (timeout_ns < rtt_min_ns)
+    {
+        return rtt_min_ns;
+    }
+    return timeout_ns > rtt_max_ns ? rtt_max_ns : timeout_ns;
+}
+
+void rtt_utils_init(uint64_t min_ms, uint64_t max_ms)
+{
+    rtt_min_ns = min_ms * NS_PER_MS;
+    rtt_max_ns = max_ms * NS_PER_MS;
+    for (size_t i = 0; i < NUM_COMMANDS; i++)
+    {
+        memset(&rtt_estimators[i], 0, sizeof(RttEstimator));
+        rtt_estimators[i].timeout_ns = _rtt_utils_clamp(RTT_INITIAL_TIMEOUT_MS * NS_PER_MS);
+    }
+}
+
+// Parse bounds of the form `<min ms>:<max ms>`.
+Error rtt_utils_parse_bounds(const char* spec, uint64_t* min_ms_p, uint64_t* max_ms_p)
+{
+    char* end_p;
+    *min_ms_p = strtoull(spec, &end_p, 10);
+    if (end_p == spec || *end_p != ':')
+    {
+        return ERR_INVALID;
+    }
+    spec      = end_p + 1;
+    *max_ms_p = strtoull(spec, &end_p, 10);
+    if (end_p == spec || *end_p != 0 || *min_ms_p == 0 || *min_ms_p > *max_ms_p)
+    {
+        return ERR_INVALID;
+    }
+    return ERR_ALL_GOOD;
+}
+
+static RttEstimator* _rtt_utils_estimator(const Command* command_p)
+{
+    return &rtt_estimators[command_p - g_commands];
+}
+
+uint64_t rtt_utils_timeout_ns(const Command* command_p)
+{
+    return _rtt_utils_estimator(command_p)->timeout_ns;
+}
+
+// Upper bound of every timeout: after it, a reply is not expected anymore.
+uint64_t rtt_utils_max_timeout_ns(void) { return rtt_max_ns; }
+
+void rtt_utils_on_response(const Command* command_p, uint64_t rtt_ns)
+{
+    RttEstimator* estimator_p = _rtt_utils_estimator(command_p);
+    if (estimator_p->samples == 0)
+    {
+        estimator_p->srtt_ns    = rtt_ns;
+        estimator_p->rttvar_ns  = rtt_ns / 2;
+        estimator_p->min_rtt_ns = rtt_ns;
+    }
+    else
+    {
+        uint64_t error_ns      = rtt_ns > estimator_p->srtt_ns ? rtt_ns - estimator_p->srtt_ns
+                                                               : estimator_p->srtt_ns - rtt_ns;
+        estimator_p->rttvar_ns = (3 * estimator_p->rttvar_ns + error_ns) / 4;
+        estimator_p->srtt_ns   = (7 * estimator_p->srtt_ns + rtt_ns) / 8;
+    }
+    estimator_p->samples++;
+    estimator_p->min_rtt_ns = rtt_ns < estimator_p->min_rtt_ns ? rtt_ns : estimator_p->min_rtt_ns;
+    estimator_p->max_rtt_ns = rtt_ns > estimator_p->max_rtt_ns ? rtt_ns : estimator_p->max_rtt_ns;
+    uint64_t margin_ns      = 4 * estimator_p->rttvar_ns;
+    estimator_p->timeout_ns = _rtt_utils_clamp(
+        estimator_p->srtt_ns + (margin_ns > RTT_GRANULARITY_NS ? margin_ns : RTT_GRANULARITY_NS));
+}
+
+void rtt_utils_on_timeout(const Command* command_p)
+{
+    RttEstimator* estimator_p = _rtt_utils_estimator(command_p);
+    estimator_p->timeouts++;
+    estimator_p->timeout_ns = _rtt_utils_clamp(2 * estimator_p->timeout_ns);
+}
+
+void rtt_utils_ledger_init(RttLedger* ledger_p)
+{
+    memset(ledger_p, 0, sizeof(RttLedger));
+}
+
+// The request for `command_p` dispatched at `dispatched_ns` was completed without the reply of the
+// device, which is expected until `until_ns`.
+void rtt_utils_owe(
+    RttLedger* ledger_p, const Command* command_p, uint64_t dispatched_ns, uint64_t until_ns)
+{
+    if (ledger_p->last_late_ns >= dispatched_ns)
+    {
+        // Its reply was likely taken for the late one of an earlier request the device dropped.
+        return;
+    }
+    if (ledger_p->num_owed == RTT_MAX_OWED)
+    {
+        // The device stopped answering: keep only the latest requests.
+        ledger_p->head = (ledger_p->head + 1) % RTT_MAX_OWED;
+        ledger_p->num_owed--;
+        ledger_p->never_answered++;
+    }
+    RttOwed* owed_p       = &ledger_p->owed[(ledger_p->head + ledger_p->num_owed) % RTT_MAX_OWED];
+    owed_p->command_p     = command_p;
+    owed_p->dispatched_ns = dispatched_ns;
+    owed_p->until_ns      = until_ns;
+    ledger_p->num_owed++;
+}
+
+// Whether a reply received at `now_ns` is a late one, owed for a request already completed and
+// then described by `*owed_p`. Replies are received in the order of the requests.
+bool rtt_utils_take_late(RttLedger* ledger_p, uint64_t now_ns, RttOwed* owed_p)
+{
+    while (ledger_p->num_owed && ledger_p->owed[ledger_p->head].until_ns <= now_ns)
+    {
+        ledger_p->head = (ledger_p->head + 1) % RTT_MAX_OWED;
+        ledger_p->num_owed--;
+        ledger_p->never_answered++;
+    }
+    if (ledger_p->num_owed == 0)
+    {
+        return false;
+    }
+    *owed_p        = ledger_p->owed[ledger_p->head];
+    ledger_p->head = (ledger_p->head + 1) % RTT_MAX_OWED;
+    ledger_p->num_owed--;
+    ledger_p->last_late_ns = now_ns;
+    ledger_p->late_replies++;
+    return true;
+}
+
+void rtt_utils_print_stats(const RttLedger* ledger_p)
+{
+    UNUSED(ledger_p); /* When LOG_LEVEL is below LEVEL_INFO */
+    for (size_t i = 0; i < g_num_commands; i++)
+    {
+        const RttEstimator* estimator_p = &rtt_estimators[i];
+        UNUSED(estimator_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        LOG_INFO(
+            "Timeout %-8s | %6" PRIu64 " samples %4" PRIu64 " timeouts | srtt %8" PRIu64
+            " us rttvar %8" PRIu64 " us min %8" PRIu64 " us max %8" PRIu64 " us | timeout %8" PRIu64
+            " us",
+            g_commands[i].name,
+            estimator_p->samples,
+            estimator_p->timeouts,
+            estimator_p->srtt_ns / 1000,
+            estimator_p->rttvar_ns / 1000,
+            estimator_p->min_rtt_ns / 1000,
+            estimator_p->max_rtt_ns / 1000,
+            estimator_p->timeout_ns / 1000);
+    }
+    LOG_INFO(
+        "Timeout | %" PRIu64 " late replies discarded, %" PRIu64 " never received",
+        ledger_p->late_replies,
+        ledger_p->never_answered);
+}
@@ -0,0 +1,131 @@
+// Periodic commands, configured with `-p <command>:<period ms>`. Every schedule owns a timer in the
+// timer wheel; when it fires, a request is queued like any FIFO instruction (same priority queues,
+// same arrival order), so scheduled and ad-hoc traffic interleave fairly.
+#define MAX_SCHEDULES (16)
+
+typedef struct
+{
+    const Command* command_p;
+    uint64_t period_ms;
+    uint64_t due_tick; /* Tick at which the current sample should be taken */
+    bool pending;      /* The request of the current sample has not been dispatched yet */
+    Timer timer;
+    uint64_t samples;
+    uint64_t missed;
+    uint64_t total_jitter_ns;
+    uint64_t max_jitter_ns;
+} Schedule;
+
+typedef struct
+{
+    Schedule schedules[MAX_SCHEDULES];
+    size_t num_schedules;
+    TimerWheel* wheel_p;
+    RequestQueue* queue_p;
+} Scheduler;
+
+void scheduler_utils_init(Scheduler* scheduler_p, TimerWheel* wheel_p, RequestQueue* queue_p)
+{
+    memset(scheduler_p, 0, sizeof(Scheduler));
+    scheduler_p->wheel_p = wheel_p;
+    scheduler_p->queue_p = queue_p;
+}
+
+static void _scheduler_utils_fire(Timer* timer_p, void* context)
+{
+    Scheduler* scheduler_p = (Scheduler*)context;
+    Schedule* schedule_p   = (Schedule*)((char*)timer_p - offsetof(Schedule, timer));
+    TimerWheel* wheel_p    = scheduler_p->wheel_p;
+
+    if (schedule_p->pending)
+    {
+        // The previous sample is still waiting in the queue: don't pile up another one.
+        schedule_p->missed++;
+        LOG_WARNING("Schedule `%s` missed a deadline", schedule_p->command_p->name);
+    }
+    else
+    {
+        Request request = {
+            .command_p    = schedule_p->command_p,
+            .priority     = schedule_p->command_p->priority,
+            .source       = SOURCE_SCHEDULER,
+            .schedule_id  = (int)(schedule_p - scheduler_p->schedules),
+            .scheduled_ns = timer_utils_tick_to_ns(wheel_p, schedule_p->due_tick),
+        };
+        schedule_p->pending = is_ok(queue_utils_push(scheduler_p->queue_p, &request));
+    }
+    // Re-arm from the ideal due time so that the period does not drift. If the process fell more
+    // than one period behind, skip the samples that can no longer be taken.
+    schedule_p->due_tick += schedule_p->period_ms;
+    while (schedule_p->due_tick <= wheel_p->current_tick)
+    {
+        schedule_p->due_tick += schedule_p->period_ms;
+        schedule_p->missed++;
+    }
+    timer_utils_add(wheel_p, timer_p, schedule_p->due_tick, _scheduler_utils_fire, scheduler_p);
+}
+
+// Parse `<command>:<period ms>` and start the schedule.
+Error scheduler_utils_add(Scheduler* scheduler_p, const char* spec)
+{
+    const char* colon_p = strchr(spec, ':');
+    char* end_p         = NULL;
+    if (colon_p == NULL || scheduler_p->num_schedules == MAX_SCHEDULES)
+    {
+        return ERR_INVALID;
+    }
+    const Command* command_p = command_utils_find(spec, colon_p - spec);
+    uint64_t period_ms       = strtoull(colon_p + 1, &end_p, 10);
+    if (command_p == NULL || period_ms == 0 || *end_p != 0)
+    {
+        return ERR_INVALID;
+    }
+    Schedule* schedule_p  = &scheduler_p->schedules[scheduler_p->num_schedules++];
+    schedule_p->command_p = command_p;
+    schedule_p->period_ms = period_ms;
+    schedule_p->due_tick  = scheduler_p->wheel_p->current_tick + period_ms;
+    timer_utils_add(
+        scheduler_p->wheel_p,
+        &schedule_p->timer,
+        schedule_p->due_tick,
+        _scheduler_utils_fire,
+        scheduler_p);
+    LOG_INFO("Scheduled `%s` every %" PRIu64 " ms", command_p->name, period_ms);
+    return ERR_ALL_GOOD;
+}
+
+// Record how late the sample was dispatched with respect to its due time.
+void scheduler_utils_on_dispatched(Scheduler* scheduler_p, const Request* request_p)
+{
+    if (request_p->source != SOURCE_SCHEDULER)
+    {
+        return;
+    }
+    Schedule* schedule_p = &scheduler_p->schedules[request_p->schedule_id];
+    uint64_t jitter_ns   = request_p->dispatched_ns > request_p->scheduled_ns
+                               ? request_p->dispatched_ns - request_p->scheduled_ns
+                               : 0;
+    schedule_p->pending = false;
+    schedule_p->samples++;
+    schedule_p->total_jitter_ns += jitter_ns;
+    schedule_p->max_jitter_ns = jitter_ns > schedule_p->max_jitter_ns ? jitter_ns
+                                                                      : schedule_p->max_jitter_ns;
+}
+
+void scheduler_utils_print_stats(const Scheduler* scheduler_p)
+{
+    for (size_t i = 0; i < scheduler_p->num_schedules; i++)
+    {
+        const Schedule* schedule_p = &scheduler_p->schedules[i];
+        UNUSED(schedule_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        LOG_INFO(
+            "Schedule %-6s every %6" PRIu64 " ms | samples %6" PRIu64 " missed %4" PRIu64
+            " | jitter mean %6" PRIu64 " us, max %6" PRIu64 " us",
+            schedule_p->command_p->name,
+            schedule_p->period_ms,
+            schedule_p->samples,
+            schedule_p->missed,
+            schedule_p->samples ? schedule_p->total_jitter_ns / schedule_p->samples / 1000 : 0,
+            schedule_p->max_jitter_ns / 1000);
+    }
+}
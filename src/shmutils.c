@@ -0,0 +1,365 @@
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+#define SHM_NAME "/multiface"
+#define SHM_DOORBELL "artifacts/shm_doorbell"
+#define SHM_MAGIC (0x4d465348) /* "MFSH" */
+#define SHM_VERSION (2)
+// Must be a power of 2 so that the free-running head/tail counters can be masked.
+#define SHM_RING_SIZE (1 << 16)
+#define SHM_SPIN_COUNT (2000)
+#define CACHE_LINE_SIZE (64)
+
+// Single-producer, single-consumer byte ring. `head` is only written by the producer and `tail`
+// only by the consumer; they live on separate cache lines to avoid false sharing.
+// `waiting` is set by the consumer right before it goes to sleep, so that the producer only pays
+// for a wakeup (doorbell write or futex) when the other side is idle.
+typedef struct
+{
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t head;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t tail;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t waiting;
+    _Alignas(CACHE_LINE_SIZE) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// The rings have one producer and one consumer each: a segment serves a single server and a single
+// client, which claim it with their pid.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    _Atomic int32_t server_pid;
+    _Atomic int32_t client_pid;
+    ShmRing requests;
+    ShmRing responses;
+} ShmSegment;
+
+// Every message in a ring is preceded by this header. `tag` is chosen by the client and echoed
+// back in the response so that responses can be matched to requests.
+typedef struct
+{
+    uint32_t size;
+    uint32_t tag;
+    int32_t status;
+} ShmRecordHeader;
+
+static void _shm_utils_ring_copy_in(ShmRing* ring_p, uint32_t pos, const void* src, uint32_t size)
+{
+    uint32_t offset = pos & (SHM_RING_SIZE - 1);
+    uint32_t first  = SHM_RING_SIZE - offset < size ? SHM_RING_SIZE - offset : size;
+    memcpy(ring_p->data + offset, src, first);
+    memcpy(ring_p->data, (const char*)src + first, size - first);
+}
+
+static void _shm_utils_ring_copy_out(const ShmRing* ring_p, uint32_t pos, void* dst, uint32_t size)
+{
+    uint32_t offset = pos & (SHM_RING_SIZE - 1);
+    uint32_t first  = SHM_RING_SIZE - offset < size ? SHM_RING_SIZE - offset : size;
+    memcpy(dst, ring_p->data + offset, first);
+    memcpy((char*)dst + first, ring_p->data, size - first);
+}
+
+// Returns `false` if there is not enough room for the message.
+bool shm_utils_ring_push(ShmRing* ring_p, const ShmRecordHeader* header_p, const void* data)
+{
+    uint32_t head  = atomic_load_explicit(&ring_p->head, memory_order_relaxed);
+    uint32_t tail  = atomic_load_explicit(&ring_p->tail, memory_order_acquire);
+    uint32_t total = sizeof(ShmRecordHeader) + header_p->size;
+    if (SHM_RING_SIZE - (head - tail) < total)
+    {
+        return false;
+    }
+    _shm_utils_ring_copy_in(ring_p, head, header_p, sizeof(ShmRecordHeader));
+    _shm_utils_ring_copy_in(ring_p, head + sizeof(ShmRecordHeader), data, header_p->size);
+    atomic_store_explicit(&ring_p->head, head + total, memory_order_release);
+    return true;
+}
+
+// Returns `false` if the ring is empty. Messages longer than `capacity` are truncated.
+bool shm_utils_ring_pop(ShmRing* ring_p, ShmRecordHeader* header_p, void* out, size_t capacity)
+{
+    uint32_t tail = atomic_load_explicit(&ring_p->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring_p->head, memory_order_acquire);
+    if (head == tail)
+    {
+        return false;
+    }
+    _shm_utils_ring_copy_out(ring_p, tail, header_p, sizeof(ShmRecordHeader));
+    uint32_t size = header_p->size;
+    header_p->size = size < capacity ? size : capacity;
+    _shm_utils_ring_copy_out(ring_p, tail + sizeof(ShmRecordHeader), out, header_p->size);
+    atomic_store_explicit(
+        &ring_p->tail, tail + sizeof(ShmRecordHeader) + size, memory_order_release);
+    return true;
+}
+
+bool shm_utils_ring_is_empty(ShmRing* ring_p)
+{
+    return atomic_load_explicit(&ring_p->head, memory_order_acquire)
+           == atomic_load_explicit(&ring_p->tail, memory_order_relaxed);
+}
+
+// ---------- SERVER SIDE ----------
+
+static bool _shm_utils_is_alive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// Whether the existing segment `name` was left behind by a server that did not exit cleanly.
+static bool _shm_utils_is_stale(const char* name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return errno == ENOENT;
+    }
+    struct stat st;
+    void* addr = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmSegment)
+                     ? mmap(NULL, sizeof(ShmSegment), PROT_READ, MAP_SHARED, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        // Not one of ours, or from another version: it is not in use by a server.
+        return true;
+    }
+    bool stale = !_shm_utils_is_alive(atomic_load(&((ShmSegment*)addr)->server_pid));
+    munmap(addr, sizeof(ShmSegment));
+    return stale;
+}
+
+// Create the segment `name`. It must not be in use by another server: the rings would be reset
+// under it. A segment left behind by a server that crashed is replaced.
+Error shm_utils_create(const char* name, ShmSegment** segment_pp)
+{
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd < 0 && errno == EEXIST && _shm_utils_is_stale(name))
+    {
+        LOG_WARNING("Replacing the stale shared memory segment `%s`", name);
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    }
+    if (fd < 0 && errno == EEXIST)
+    {
+        LOG_ERROR("Shared memory segment `%s` is in use by another server", name);
+        return ERR_FORBIDDEN;
+    }
+    if (fd < 0)
+    {
+        LOG_PERROR("Failed to create shared memory segment `%s`", name);
+        return ERR_FATAL;
+    }
+    if (ftruncate(fd, sizeof(ShmSegment)) < 0)
+    {
+        LOG_PERROR("Failed to size shared memory segment `%s`", name);
+        close(fd);
+        return ERR_FATAL;
+    }
+    void* addr = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        LOG_PERROR("Failed to map shared memory segment `%s`", name);
+        return ERR_FATAL;
+    }
+    *segment_pp = (ShmSegment*)addr;
+    memset(*segment_pp, 0, sizeof(ShmSegment));
+    (*segment_pp)->magic   = SHM_MAGIC;
+    (*segment_pp)->version = SHM_VERSION;
+    atomic_store(&(*segment_pp)->server_pid, getpid());
+    LOG_INFO("Shared memory segment `%s` created (%zu bytes)", name, sizeof(ShmSegment));
+    return ERR_ALL_GOOD;
+}
+
+void shm_utils_destroy(const char* name, ShmSegment* segment_p)
+{
+    atomic_store(&segment_p->server_pid, 0);
+    munmap(segment_p, sizeof(ShmSegment));
+    shm_unlink(name);
+}
+
+// Announce that the server is about to block in `poll()`. Returns `false` if requests arrived in
+// the meantime, in which case the server should not sleep.
+bool shm_utils_server_prepare_sleep(ShmSegment* segment_p)
+{
+    atomic_store(&segment_p->requests.waiting, 1);
+    if (!shm_utils_ring_is_empty(&segment_p->requests))
+    {
+        atomic_store(&segment_p->requests.waiting, 0);
+        return false;
+    }
+    return true;
+}
+
+// Stop accepting wakeups and drain the doorbell if it was rung.
+void shm_utils_server_woken(ShmSegment* segment_p, int doorbell_fd, bool was_rung)
+{
+    char c[64];
+    atomic_store(&segment_p->requests.waiting, 0);
+    while (was_rung && read(doorbell_fd, c, sizeof(c)) > 0)
+    {
+    }
+}
+
+static void _shm_utils_futex_wake(_Atomic uint32_t* word_p)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t*)word_p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    UNUSED(word_p);
+#endif /* __linux__ */
+}
+
+bool shm_utils_server_respond(
+    ShmSegment* segment_p,
+    uint32_t tag,
+    Error status,
+    const char* data,
+    uint32_t size)
+{
+    ShmRecordHeader header = {.size = size, .tag = tag, .status = status};
+    if (!shm_utils_ring_push(&segment_p->responses, &header, data))
+    {
+        LOG_WARNING("Shared memory response ring full, dropping response %u", tag);
+        return false;
+    }
+    if (atomic_exchange(&segment_p->responses.waiting, 0))
+    {
+        _shm_utils_futex_wake(&segment_p->responses.head);
+    }
+    return true;
+}
+
+// ---------- CLIENT SIDE ----------
+
+// Attach to the segment `name` as its client. Only one client at a time is supported: the rings
+// have a single producer and a single consumer.
+Error shm_utils_attach(const char* name, ShmSegment** segment_pp)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        LOG_PERROR("Failed to open shared memory segment `%s`", name);
+        return ERR_NOT_FOUND;
+    }
+    void* addr = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        LOG_PERROR("Failed to map shared memory segment `%s`", name);
+        return ERR_FATAL;
+    }
+    *segment_pp = (ShmSegment*)addr;
+    if ((*segment_pp)->magic != SHM_MAGIC || (*segment_pp)->version != SHM_VERSION)
+    {
+        LOG_ERROR("Shared memory segment `%s` has an unexpected layout", name);
+        munmap(addr, sizeof(ShmSegment));
+        return ERR_INVALID;
+    }
+    int32_t client_pid = atomic_load(&(*segment_pp)->client_pid);
+    if ((_shm_utils_is_alive(client_pid) && client_pid != getpid())
+        || !atomic_compare_exchange_strong(&(*segment_pp)->client_pid, &client_pid, getpid()))
+    {
+        LOG_ERROR("Shared memory segment `%s` already has a client (pid %d)", name, client_pid);
+        munmap(addr, sizeof(ShmSegment));
+        return ERR_FORBIDDEN;
+    }
+    return ERR_ALL_GOOD;
+}
+
+void shm_utils_detach(ShmSegment* segment_p)
+{
+    atomic_store(&segment_p->client_pid, 0);
+    munmap(segment_p, sizeof(ShmSegment));
+}
+
+// Returns `false` if the request ring is full. The doorbell is only rung when the server is idle.
+bool shm_utils_client_request(
+    ShmSegment* segment_p,
+    int doorbell_fd,
+    uint32_t tag,
+    const char* data,
+    uint32_t size)
+{
+    ShmRecordHeader header = {.size = size, .tag = tag, .status = ERR_ALL_GOOD};
+    if (!shm_utils_ring_push(&segment_p->requests, &header, data))
+    {
+        return false;
+    }
+    if (atomic_exchange(&segment_p->requests.waiting, 0))
+    {
+        if (write(doorbell_fd, "!", 1) < 0 && errno != EAGAIN)
+        {
+            LOG_PERROR("Failed to ring the shared memory doorbell");
+        }
+    }
+    return true;
+}
+
+// Spin for a while, then sleep on the response ring head until a response arrives or
+// `timeout_ms` expires. Returns ERR_TIMEOUT if nothing arrived in time.
+Error shm_utils_client_response(
+    ShmSegment* segment_p,
+    ShmRecordHeader* header_p,
+    char* out,
+    size_t capacity,
+    int timeout_ms)
+{
+    ShmRing* ring_p = &segment_p->responses;
+    for (int i = 0; i < SHM_SPIN_COUNT; i++)
+    {
+        if (shm_utils_ring_pop(ring_p, header_p, out, capacity))
+        {
+            return ERR_ALL_GOOD;
+        }
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (true)
+    {
+        uint32_t head = atomic_load(&ring_p->head);
+        atomic_store(&ring_p->waiting, 1);
+        if (shm_utils_ring_pop(ring_p, header_p, out, capacity))
+        {
+            atomic_store(&ring_p->waiting, 0);
+            return ERR_ALL_GOOD;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec
+            || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        {
+            atomic_store(&ring_p->waiting, 0);
+            return ERR_TIMEOUT;
+        }
+#ifdef __linux__
+        struct timespec remaining = {
+            .tv_sec  = deadline.tv_sec - now.tv_sec,
+            .tv_nsec = deadline.tv_nsec - now.tv_nsec,
+        };
+        if (remaining.tv_nsec < 0)
+        {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000L;
+        }
+        syscall(SYS_futex, (uint32_t*)&ring_p->head, FUTEX_WAIT, head, &remaining, NULL, 0);
+#else
+        // No portable cross-process futex: fall back to a short sleep.
+        UNUSED(head);
+        usleep(50);
+#endif /* __linux__ */
+    }
+}
@@ -0,0 +1,368 @@
+// Output spill: what the output FIFO does not take right away (EAGAIN, or a partial write) is
+// queued instead of being lost, first in a memory ring, then in a spill file on disk, and written
+// out in order once the consumer catches up (the caller polls the FIFO for POLLOUT while
+// spill_utils_is_pending()). Nothing ever waits for the consumer.
+//
+// The queue is the ring followed by the file, itself a circular buffer of at most `file_limit`
+// bytes: once something went to the file, everything does until the file is drained back into the
+// ring, which keeps the order. When both are full, the drop policy either rejects the new record
+// or drops the oldest records (JSON lines) entirely in the ring. A record partially written to the
+// FIFO is always finished, so the stream stays parseable.
+// Writes to the spill file go to the page cache; they only wait for the disk if the kernel is
+// throttling dirty pages.
+#define SPILL_DEFAULT_PATH "artifacts/fifo_out.spill"
+#define SPILL_DEFAULT_MEMORY_KB (256)
+#define SPILL_DEFAULT_FILE_MB (64)
+// Room for the rest of the largest record partially written to the FIFO, and as much behind it.
+#define SPILL_MIN_MEMORY_BYTES (2 * OUTPUT_MAX_RECORD_SIZE)
+
+typedef enum
+{
+    SPILL_DROP_NEWEST, /* Reject the new record, keeps a gapless prefix */
+    SPILL_DROP_OLDEST, /* Drop the oldest queued records, keeps the most recent ones */
+} SpillPolicy;
+
+static const char* spill_policy_names[] = {"drop-newest", "drop-oldest"};
+
+typedef struct
+{
+    int fd;
+    SpillPolicy policy;
+    char* ring_p;
+    size_t ring_size;
+    size_t ring_head;
+    size_t ring_used;
+    bool mid_record; /* The FIFO got the start of the record at the ring head, not its end */
+    int file_fd;
+    char file_path[128];
+    size_t file_limit;
+    size_t file_head;
+    size_t file_used;
+    uint64_t direct;
+    uint64_t queued;
+    uint64_t spilled;
+    uint64_t dropped;
+    uint64_t ring_high_water;
+    uint64_t file_high_water;
+} OutputSpill;
+
+// Parse limits of the form `<memory KiB>:<spill file MiB>[:drop-newest|drop-oldest]`.
+Error spill_utils_parse_limits(
+    const char* spec, size_t* memory_bytes_p, size_t* file_bytes_p, SpillPolicy* policy_p)
+{
+    char* end_p;
+    uint64_t memory_kb = strtoull(spec, &end_p, 10);
+    if (end_p == spec || *end_p != ':')
+    {
+        return ERR_INVALID;
+    }
+    spec             = end_p + 1;
+    uint64_t file_mb = strtoull(spec, &end_p, 10);
+    if (end_p == spec || (*end_p != 0 && *end_p != ':'))
+    {
+        return ERR_INVALID;
+    }
+    *policy_p = SPILL_DROP_NEWEST;
+    if (*end_p == ':')
+    {
+        if (strcmp(end_p + 1, spill_policy_names[SPILL_DROP_OLDEST]) == 0)
+        {
+            *policy_p = SPILL_DROP_OLDEST;
+        }
+        else if (strcmp(end_p + 1, spill_policy_names[SPILL_DROP_NEWEST]) != 0)
+        {
+            return ERR_INVALID;
+        }
+    }
+    *memory_bytes_p = memory_kb * 1024;
+    *file_bytes_p   = file_mb * 1024 * 1024;
+    return *memory_bytes_p < SPILL_MIN_MEMORY_BYTES ? ERR_OUT_OF_RANGE : ERR_ALL_GOOD;
+}
+
+// Queue the output written to `fd` in a ring of `memory_bytes`, then in the file `path` up to
+// `file_bytes` (0 to only use the ring). The file is emptied at startup.
+Error spill_utils_open(
+    OutputSpill* spill_p,
+    int fd,
+    const char* path,
+    size_t memory_bytes,
+    size_t file_bytes,
+    SpillPolicy policy)
+{
+    memset(spill_p, 0, sizeof(OutputSpill));
+    spill_p->fd         = fd;
+    spill_p->policy     = policy;
+    spill_p->ring_size  = memory_bytes;
+    spill_p->file_limit = file_bytes;
+    spill_p->file_fd    = -1;
+    spill_p->ring_p     = malloc(memory_bytes);
+    if (spill_p->ring_p == NULL)
+    {
+        LOG_ERROR("Failed to allocate the %zu B output ring", memory_bytes);
+        return ERR_OUT_OF_RANGE;
+    }
+    if (file_bytes)
+    {
+        snprintf(spill_p->file_path, sizeof(spill_p->file_path), "%s", path);
+        spill_p->file_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (spill_p->file_fd < 0)
+        {
+            LOG_PERROR("Failed to open the spill file `%s`", path);
+            free(spill_p->ring_p);
+            spill_p->ring_p = NULL;
+            return ERR_FS_INTERNAL;
+        }
+    }
+    LOG_INFO(
+        "Output queue: %zu KiB in memory, %zu MiB in `%s`, %s",
+        memory_bytes / 1024,
+        file_bytes / 1024 / 1024,
+        file_bytes ? path : "no spill file",
+        spill_policy_names[policy]);
+    return ERR_ALL_GOOD;
+}
+
+bool spill_utils_is_pending(const OutputSpill* spill_p)
+{
+    return spill_p->ring_used != 0 || spill_p->file_used != 0;
+}
+
+static void _spill_utils_ring_push(OutputSpill* spill_p, const char* data, size_t size)
+{
+    size_t tail  = (spill_p->ring_head + spill_p->ring_used) % spill_p->ring_size;
+    size_t first = size < spill_p->ring_size - tail ? size : spill_p->ring_size - tail;
+    memcpy(spill_p->ring_p + tail, data, first);
+    memcpy(spill_p->ring_p, data + first, size - first);
+    spill_p->ring_used += size;
+    if (spill_p->ring_used > spill_p->ring_high_water)
+    {
+        spill_p->ring_high_water = spill_p->ring_used;
+    }
+}
+
+static Error _spill_utils_file_push(OutputSpill* spill_p, const char* data, size_t size)
+{
+    size_t tail  = (spill_p->file_head + spill_p->file_used) % spill_p->file_limit;
+    size_t first = size < spill_p->file_limit - tail ? size : spill_p->file_limit - tail;
+    if (pwrite(spill_p->file_fd, data, first, tail) != (ssize_t)first
+        || (size > first && pwrite(spill_p->file_fd, data + first, size - first, 0)
+                                != (ssize_t)(size - first)))
+    {
+        LOG_PERROR("Failed to write to the spill file `%s`", spill_p->file_path);
+        return ERR_FS_INTERNAL;
+    }
+    spill_p->file_used += size;
+    if (spill_p->file_used > spill_p->file_high_water)
+    {
+        spill_p->file_high_water = spill_p->file_used;
+    }
+    return ERR_ALL_GOOD;
+}
+
+// Move what fits of the head of the spill file into the ring.
+static void _spill_utils_refill(OutputSpill* spill_p)
+{
+    while (spill_p->file_used && spill_p->ring_used < spill_p->ring_size)
+    {
+        size_t tail = (spill_p->ring_head + spill_p->ring_used) % spill_p->ring_size;
+        size_t size = tail >= spill_p->ring_head ? spill_p->ring_size - tail
+                                                 : spill_p->ring_head - tail;
+        size        = size < spill_p->file_used ? size : spill_p->file_used;
+        size        = size < spill_p->file_limit - spill_p->file_head
+                          ? size
+                          : spill_p->file_limit - spill_p->file_head;
+        if (pread(spill_p->file_fd, spill_p->ring_p + tail, size, spill_p->file_head)
+            != (ssize_t)size)
+        {
+            LOG_PERROR("Failed to read the spill file `%s`", spill_p->file_path);
+            return;
+        }
+        spill_p->ring_used += size;
+        spill_p->file_head = (spill_p->file_head + size) % spill_p->file_limit;
+        spill_p->file_used -= size;
+        if (spill_p->ring_used > spill_p->ring_high_water)
+        {
+            spill_p->ring_high_water = spill_p->ring_used;
+        }
+    }
+    if (spill_p->file_used == 0 && spill_p->file_head != 0)
+    {
+        // Drained: start over with an empty file.
+        spill_p->file_head = 0;
+        if (ftruncate(spill_p->file_fd, 0) < 0)
+        {
+            LOG_PERROR("Failed to empty the spill file `%s`", spill_p->file_path);
+        }
+    }
+}
+
+// Drop the oldest record entirely in the ring, after the one partially written to the FIFO if any.
+static bool _spill_utils_drop_oldest(OutputSpill* spill_p)
+{
+    const char* ring_p = spill_p->ring_p;
+    size_t ring_size   = spill_p->ring_size;
+    size_t head        = spill_p->ring_head;
+    size_t kept        = 0;
+    size_t i           = 0;
+    if (spill_p->mid_record)
+    {
+        while (i < spill_p->ring_used && ring_p[(head + i) % ring_size] != '\n')
+        {
+            i++;
+        }
+        if (i == spill_p->ring_used)
+        {
+            return false;
+        }
+        kept = ++i;
+    }
+    size_t start = i;
+    while (i < spill_p->ring_used && ring_p[(head + i) % ring_size] != '\n')
+    {
+        i++;
+    }
+    if (i >= spill_p->ring_used)
+    {
+        return false;
+    }
+    // Move the end of the partially written record over the dropped one.
+    size_t size = i + 1 - start;
+    for (size_t k = kept; k-- > 0;)
+    {
+        spill_p->ring_p[(head + size + k) % ring_size] = ring_p[(head + k) % ring_size];
+    }
+    spill_p->ring_head = (head + size) % ring_size;
+    spill_p->ring_used -= size;
+    spill_p->dropped++;
+    LOG_WARNING_EVERY(10000, "Output queue full, dropped the oldest record");
+    return true;
+}
+
+// Make room for `size` bytes in the ring, if nothing is in the file, or in the file.
+static bool _spill_utils_make_room(OutputSpill* spill_p, size_t size)
+{
+    for (;;)
+    {
+        _spill_utils_refill(spill_p);
+        if ((spill_p->file_used == 0 && spill_p->ring_size - spill_p->ring_used >= size)
+            || spill_p->file_limit - spill_p->file_used >= size)
+        {
+            return true;
+        }
+        if (spill_p->policy == SPILL_DROP_NEWEST || !_spill_utils_drop_oldest(spill_p))
+        {
+            return false;
+        }
+    }
+}
+
+// Write a record to the output FIFO, or queue what it does not take. Returns ERR_OUT_OF_RANGE if
+// the record was dropped.
+Error spill_utils_write(OutputSpill* spill_p, const char* data, size_t size)
+{
+    if (spill_p->ring_used == 0 && spill_p->file_used == 0)
+    {
+        ssize_t written = write(spill_p->fd, data, size);
+        if (written == (ssize_t)size)
+        {
+            spill_p->direct++;
+            return ERR_ALL_GOOD;
+        }
+        if (written < 0 && errno != EAGAIN)
+        {
+            LOG_PERROR("Failed to write to the output FIFO");
+        }
+        written             = written < 0 ? 0 : written;
+        spill_p->mid_record = written > 0;
+        data += written;
+        size -= written;
+    }
+    // The rest of a partially written record always fits in the empty ring, since the ring holds
+    // at least two records of the largest size.
+    if (!_spill_utils_make_room(spill_p, size))
+    {
+        spill_p->dropped++;
+        return ERR_OUT_OF_RANGE;
+    }
+    if (spill_p->file_used == 0 && spill_p->ring_size - spill_p->ring_used >= size)
+    {
+        _spill_utils_ring_push(spill_p, data, size);
+        spill_p->queued++;
+        return ERR_ALL_GOOD;
+    }
+    if (is_err(_spill_utils_file_push(spill_p, data, size)))
+    {
+        spill_p->dropped++;
+        return ERR_OUT_OF_RANGE;
+    }
+    spill_p->spilled++;
+    return ERR_ALL_GOOD;
+}
+
+// Write what the output FIFO takes of the queue, oldest first. Called when it polls writable.
+void spill_utils_drain(OutputSpill* spill_p)
+{
+    _spill_utils_refill(spill_p);
+    while (spill_p->ring_used)
+    {
+        size_t size = spill_p->ring_size - spill_p->ring_head;
+        size        = size < spill_p->ring_used ? size : spill_p->ring_used;
+        ssize_t written = write(spill_p->fd, spill_p->ring_p + spill_p->ring_head, size);
+        if (written <= 0)
+        {
+            if (written < 0 && errno != EAGAIN)
+            {
+                LOG_PERROR("Failed to write to the output FIFO");
+            }
+            return;
+        }
+        spill_p->mid_record = spill_p->ring_p[spill_p->ring_head + written - 1] != '\n';
+        spill_p->ring_head  = (spill_p->ring_head + written) % spill_p->ring_size;
+        spill_p->ring_used -= written;
+        _spill_utils_refill(spill_p);
+        if ((size_t)written < size)
+        {
+            return;
+        }
+    }
+}
+
+void spill_utils_print_stats(const OutputSpill* spill_p)
+{
+    if (spill_p->ring_p == NULL)
+    {
+        return;
+    }
+    LOG_INFO(
+        "Output | direct %" PRIu64 " queued %" PRIu64 " spilled %" PRIu64 " dropped %" PRIu64
+        " | memory %zu/%zu KiB (max %" PRIu64 ") | file %zu/%zu KiB (max %" PRIu64 ")",
+        spill_p->direct,
+        spill_p->queued,
+        spill_p->spilled,
+        spill_p->dropped,
+        spill_p->ring_used / 1024,
+        spill_p->ring_size / 1024,
+        spill_p->ring_high_water / 1024,
+        spill_p->file_used / 1024,
+        spill_p->file_limit / 1024,
+        spill_p->file_high_water / 1024);
+}
+
+// What is still queued is lost: the spill file is deleted.
+void spill_utils_close(OutputSpill* spill_p)
+{
+    if (spill_p->ring_used || spill_p->file_used)
+    {
+        LOG_WARNING(
+            "Discarding %zu B of output the consumer did not read",
+            spill_p->ring_used + spill_p->file_used);
+    }
+    free(spill_p->ring_p);
+    spill_p->ring_p = NULL;
+    if (spill_p->file_fd >= 0)
+    {
+        close(spill_p->file_fd);
+        unlink(spill_p->file_path);
+        spill_p->file_fd = -1;
+    }
+}
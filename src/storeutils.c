@@ -0,0 +1,455 @@
+// Time-series store: every response appended, with its device, command and monotonic timestamp,
+// to append-only segment files mapped in memory. Query it with `tools/store-query.c`.
+//
+// Segment layout: a StoreHeader followed by one array per column (timestamp, numeric value,
+// sparse index, payload offset, payload size, command, device) and by the payload heap. Row `n` is
+// published by storing `n + 1` into `count` last, so a reader never sees a half-written row. The
+// sparse index holds the timestamp of every STORE_INDEX_STRIDE-th row: a time range is found with
+// a binary search over one page, then a scan of at most a stride of timestamps.
+//
+// Appending only stores into the mapping. A background thread syncs the mappings to disk every
+// STORE_FLUSH_MS, unmaps the full (sealed) segments and prepares the next one, so that neither a
+// flush nor a segment rollover happens on the serial path. If the next segment is not ready when
+// the current one is full, the row is dropped rather than waited for.
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define STORE_MAGIC "MFTS"
+#define STORE_VERSION (1)
+#define STORE_SEGMENT_ROWS (16384)
+#define STORE_INDEX_STRIDE (64)
+#define STORE_INDEX_ENTRIES (STORE_SEGMENT_ROWS / STORE_INDEX_STRIDE)
+#define STORE_HEAP_SIZE (1024 * 1024)
+#define STORE_MAX_DEVICES (8)
+#define STORE_MAX_COMMANDS (16)
+#define STORE_NAME_SIZE (32)
+#define STORE_MAX_SEALED (4)
+#define STORE_FLUSH_MS (1000)
+#define STORE_PATH_SIZE (256)
+#define STORE_SEGMENT_SUFFIX ".seg"
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t index_stride;
+    uint32_t capacity;
+    uint32_t heap_size;
+    uint32_t number;
+    uint32_t heap_used;
+    // Added to the monotonic timestamps of the segment to get the wall clock time.
+    uint64_t realtime_offset_ns;
+    uint8_t num_devices;
+    uint8_t num_commands;
+    uint8_t reserved[6];
+    char devices[STORE_MAX_DEVICES][STORE_NAME_SIZE];
+    char commands[STORE_MAX_COMMANDS][STORE_NAME_SIZE];
+    _Atomic uint32_t count;
+    uint32_t reserved2;
+} StoreHeader;
+
+typedef struct
+{
+    StoreHeader header;
+    uint64_t time_ns[STORE_SEGMENT_ROWS];
+    double value[STORE_SEGMENT_ROWS]; /* NAN when the payload was stored instead */
+    uint64_t index_ns[STORE_INDEX_ENTRIES];
+    uint32_t offset[STORE_SEGMENT_ROWS];
+    uint16_t size[STORE_SEGMENT_ROWS];
+    uint8_t command[STORE_SEGMENT_ROWS];
+    uint8_t device[STORE_SEGMENT_ROWS];
+    char heap[STORE_HEAP_SIZE];
+} StoreSegment;
+
+typedef struct
+{
+    char directory[STORE_PATH_SIZE];
+    // Only replaced by the appender, only unmapped by the flush thread once sealed.
+    _Atomic(StoreSegment*) active_p;
+    // Handed over to the flush thread, which returns a new spare segment.
+    _Atomic(StoreSegment*) spare_p;
+    StoreSegment* sealed[STORE_MAX_SEALED];
+    _Atomic uint32_t sealed_head; /* Written by the flush thread */
+    _Atomic uint32_t sealed_tail; /* Written by the appender */
+    uint32_t next_number;         /* Used by the flush thread once started */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    _Atomic bool stopping;
+    uint64_t appended;
+    uint64_t dropped;
+    _Atomic uint64_t segments;
+    _Atomic uint64_t flushes;
+    _Atomic uint64_t max_flush_ns;
+} TimeSeriesStore;
+
+bool store_utils_is_valid(const StoreSegment* segment_p)
+{
+    return memcmp(segment_p->header.magic, STORE_MAGIC, 4) == 0
+           && segment_p->header.version == STORE_VERSION
+           && segment_p->header.index_stride == STORE_INDEX_STRIDE
+           && segment_p->header.capacity == STORE_SEGMENT_ROWS
+           && segment_p->header.heap_size == STORE_HEAP_SIZE;
+}
+
+// Parse the number of a segment file name, `<number>.seg`.
+bool store_utils_parse_name(const char* name, uint32_t* number_p)
+{
+    char* end_p;
+    unsigned long number = strtoul(name, &end_p, 10);
+    if (end_p == name || strcmp(end_p, STORE_SEGMENT_SUFFIX) != 0 || number > UINT32_MAX)
+    {
+        return false;
+    }
+    *number_p = (uint32_t)number;
+    return true;
+}
+
+static void _store_utils_path(const char* directory, uint32_t number, char* path)
+{
+    snprintf(path, STORE_PATH_SIZE, "%s/%08" PRIu32 STORE_SEGMENT_SUFFIX, directory, number);
+}
+
+static StoreSegment* _store_utils_create_segment(const char* directory, uint32_t number)
+{
+    char path[STORE_PATH_SIZE];
+    _store_utils_path(directory, number, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(StoreSegment)) < 0)
+    {
+        LOG_PERROR("Failed to create the store segment `%s`", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    // Fault the pages in now rather than on the first appends.
+    flags |= MAP_POPULATE;
+#endif
+    void* mapping_p = mmap(NULL, sizeof(StoreSegment), PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);
+    if (mapping_p == MAP_FAILED)
+    {
+        LOG_PERROR("Failed to map the store segment `%s`", path);
+        unlink(path);
+        return NULL;
+    }
+    StoreSegment* segment_p = mapping_p;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(segment_p->header.magic, STORE_MAGIC, 4);
+    segment_p->header.version            = STORE_VERSION;
+    segment_p->header.index_stride       = STORE_INDEX_STRIDE;
+    segment_p->header.capacity           = STORE_SEGMENT_ROWS;
+    segment_p->header.heap_size          = STORE_HEAP_SIZE;
+    segment_p->header.number             = number;
+    segment_p->header.realtime_offset_ns = (uint64_t)now.tv_sec * NS_PER_SEC
+                                           + (uint64_t)now.tv_nsec - get_monotonic_ns();
+    return segment_p;
+}
+
+// Sync a segment to disk, then unmap it. An empty segment is deleted instead.
+static void _store_utils_release_segment(const char* directory, StoreSegment* segment_p)
+{
+    if (atomic_load(&segment_p->header.count) == 0)
+    {
+        char path[STORE_PATH_SIZE];
+        _store_utils_path(directory, segment_p->header.number, path);
+        unlink(path);
+    }
+    else if (msync(segment_p, sizeof(StoreSegment), MS_SYNC) < 0)
+    {
+        LOG_PERROR("Failed to sync store segment %" PRIu32, segment_p->header.number);
+    }
+    munmap(segment_p, sizeof(StoreSegment));
+}
+
+static void _store_utils_flush(TimeSeriesStore* store_p)
+{
+    uint64_t start_ns = get_monotonic_ns();
+    uint32_t head     = atomic_load_explicit(&store_p->sealed_head, memory_order_relaxed);
+    while (head != atomic_load_explicit(&store_p->sealed_tail, memory_order_acquire))
+    {
+        _store_utils_release_segment(store_p->directory, store_p->sealed[head % STORE_MAX_SEALED]);
+        atomic_store_explicit(&store_p->sealed_head, ++head, memory_order_release);
+    }
+    StoreSegment* active_p = atomic_load_explicit(&store_p->active_p, memory_order_relaxed);
+    if (msync(active_p, sizeof(StoreSegment), MS_SYNC) < 0)
+    {
+        LOG_PERROR("Failed to sync store segment %" PRIu32, active_p->header.number);
+    }
+    if (atomic_load_explicit(&store_p->spare_p, memory_order_acquire) == NULL)
+    {
+        StoreSegment* spare_p
+            = _store_utils_create_segment(store_p->directory, store_p->next_number);
+        if (spare_p != NULL)
+        {
+            store_p->next_number++;
+            atomic_store_explicit(&store_p->spare_p, spare_p, memory_order_release);
+        }
+    }
+    uint64_t flush_ns = get_monotonic_ns() - start_ns;
+    atomic_fetch_add_explicit(&store_p->flushes, 1, memory_order_relaxed);
+    if (flush_ns > atomic_load_explicit(&store_p->max_flush_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&store_p->max_flush_ns, flush_ns, memory_order_relaxed);
+    }
+}
+
+static void* _store_utils_flush_thread(void* arg)
+{
+    TimeSeriesStore* store_p = arg;
+    pthread_mutex_lock(&store_p->mutex);
+    while (!atomic_load(&store_p->stopping))
+    {
+        pthread_mutex_unlock(&store_p->mutex);
+        _store_utils_flush(store_p);
+        pthread_mutex_lock(&store_p->mutex);
+        uint64_t until_ns = get_monotonic_ns() + STORE_FLUSH_MS * NS_PER_MS;
+        struct timespec until = {
+            .tv_sec  = (time_t)(until_ns / NS_PER_SEC),
+            .tv_nsec = (long)(until_ns % NS_PER_SEC),
+        };
+        if (!atomic_load(&store_p->stopping))
+        {
+            pthread_cond_timedwait(&store_p->wake, &store_p->mutex, &until);
+        }
+    }
+    pthread_mutex_unlock(&store_p->mutex);
+    return NULL;
+}
+
+// Open the store in `directory`, created if needed. New segments are numbered after the existing
+// ones, and the empty segments left by a killed process are deleted.
+Error store_utils_open(TimeSeriesStore* store_p, const char* directory)
+{
+    memset(store_p, 0, sizeof(TimeSeriesStore));
+    snprintf(store_p->directory, STORE_PATH_SIZE, "%s", directory);
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+    {
+        LOG_PERROR("Failed to create the store `%s`", directory);
+        return ERR_FS_INTERNAL;
+    }
+    DIR* dir_p = opendir(directory);
+    if (dir_p == NULL)
+    {
+        LOG_PERROR("Failed to open the store `%s`", directory);
+        return ERR_FS_INTERNAL;
+    }
+    struct dirent* entry_p;
+    uint32_t number;
+    uint32_t num_segments = 0;
+    while ((entry_p = readdir(dir_p)) != NULL)
+    {
+        if (!store_utils_parse_name(entry_p->d_name, &number))
+        {
+            continue;
+        }
+        char path[STORE_PATH_SIZE];
+        StoreHeader header;
+        _store_utils_path(directory, number, path);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0 && read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)
+            && atomic_load(&header.count) == 0)
+        {
+            unlink(path);
+        }
+        else
+        {
+            num_segments++;
+            if (number >= store_p->next_number)
+            {
+                store_p->next_number = number + 1;
+            }
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    closedir(dir_p);
+
+    StoreSegment* active_p = _store_utils_create_segment(directory, store_p->next_number++);
+    if (active_p == NULL)
+    {
+        return ERR_FS_INTERNAL;
+    }
+    atomic_store(&store_p->active_p, active_p);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&store_p->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&store_p->mutex, NULL);
+    if (pthread_create(&store_p->thread, NULL, _store_utils_flush_thread, store_p) != 0)
+    {
+        LOG_ERROR("Failed to start the store flush thread");
+        _store_utils_release_segment(directory, active_p);
+        atomic_store(&store_p->active_p, NULL);
+        return ERR_UNEXPECTED;
+    }
+    LOG_INFO(
+        "Time-series store `%s`: %" PRIu32 " segments, appending to segment %" PRIu32,
+        directory,
+        num_segments,
+        active_p->header.number);
+    return ERR_ALL_GOOD;
+}
+
+static int _store_utils_name_index(
+    char (*names)[STORE_NAME_SIZE], uint8_t* count_p, uint8_t max, const char* name)
+{
+    for (int i = 0; i < *count_p; i++)
+    {
+        if (strncmp(names[i], name, STORE_NAME_SIZE) == 0)
+        {
+            return i;
+        }
+    }
+    if (*count_p == max)
+    {
+        return -1;
+    }
+    strncpy(names[*count_p], name, STORE_NAME_SIZE);
+    return (*count_p)++;
+}
+
+bool store_utils_is_open(TimeSeriesStore* store_p)
+{
+    return atomic_load_explicit(&store_p->active_p, memory_order_relaxed) != NULL;
+}
+
+// Seal the active segment and continue in the spare one. Fails if the flush thread did not prepare
+// the spare segment yet, or did not catch up with the sealed ones.
+static bool _store_utils_rollover(TimeSeriesStore* store_p)
+{
+    uint32_t tail = atomic_load_explicit(&store_p->sealed_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&store_p->sealed_head, memory_order_acquire);
+    if (tail - head == STORE_MAX_SEALED)
+    {
+        return false;
+    }
+    StoreSegment* spare_p = atomic_exchange_explicit(&store_p->spare_p, NULL, memory_order_acquire);
+    if (spare_p == NULL)
+    {
+        return false;
+    }
+    store_p->sealed[tail % STORE_MAX_SEALED]
+        = atomic_load_explicit(&store_p->active_p, memory_order_relaxed);
+    atomic_store_explicit(&store_p->active_p, spare_p, memory_order_relaxed);
+    atomic_store_explicit(&store_p->sealed_tail, tail + 1, memory_order_release);
+    atomic_fetch_add_explicit(&store_p->segments, 1, memory_order_relaxed);
+    // No lock: a missed wake-up only delays the next spare segment by STORE_FLUSH_MS.
+    pthread_cond_signal(&store_p->wake);
+    return true;
+}
+
+// Append a row: `value` if it is not NAN, the `size` bytes of `data` otherwise. Never blocks;
+// returns ERR_OUT_OF_RANGE if the row was dropped.
+Error store_utils_append(
+    TimeSeriesStore* store_p,
+    const char* device,
+    const char* command,
+    uint64_t time_ns,
+    double value,
+    const char* data,
+    size_t size)
+{
+    if (!store_utils_is_open(store_p))
+    {
+        return ERR_INVALID;
+    }
+    if (size > UINT16_MAX)
+    {
+        size = UINT16_MAX;
+    }
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        StoreSegment* segment_p = atomic_load_explicit(&store_p->active_p, memory_order_relaxed);
+        StoreHeader* header_p   = &segment_p->header;
+        uint32_t row      = atomic_load_explicit(&header_p->count, memory_order_relaxed);
+        int device_index  = _store_utils_name_index(
+            header_p->devices, &header_p->num_devices, STORE_MAX_DEVICES, device);
+        int command_index = _store_utils_name_index(
+            header_p->commands, &header_p->num_commands, STORE_MAX_COMMANDS, command);
+        if (row == STORE_SEGMENT_ROWS || header_p->heap_used + size > STORE_HEAP_SIZE
+            || device_index < 0 || command_index < 0)
+        {
+            if (attempt == 0 && _store_utils_rollover(store_p))
+            {
+                continue;
+            }
+            break;
+        }
+        segment_p->time_ns[row] = time_ns;
+        segment_p->value[row]   = value;
+        segment_p->offset[row]  = header_p->heap_used;
+        segment_p->size[row]    = (uint16_t)size;
+        segment_p->command[row] = (uint8_t)command_index;
+        segment_p->device[row]  = (uint8_t)device_index;
+        if (size)
+        {
+            memcpy(segment_p->heap + header_p->heap_used, data, size);
+        }
+        header_p->heap_used += (uint32_t)size;
+        if (row % STORE_INDEX_STRIDE == 0)
+        {
+            segment_p->index_ns[row / STORE_INDEX_STRIDE] = time_ns;
+        }
+        // Publish the row last: a reader or a crash before this point does not see it.
+        atomic_store_explicit(&header_p->count, row + 1, memory_order_release);
+        store_p->appended++;
+        return ERR_ALL_GOOD;
+    }
+    store_p->dropped++;
+    LOG_WARNING_EVERY(10000, "Time-series store segment not ready, dropped a row");
+    return ERR_OUT_OF_RANGE;
+}
+
+void store_utils_print_stats(TimeSeriesStore* store_p)
+{
+    if (!store_utils_is_open(store_p))
+    {
+        return;
+    }
+    LOG_INFO(
+        "Store | appended %" PRIu64 " dropped %" PRIu64 " | segments sealed %" PRIu64
+        " | flushes %" PRIu64 " max %" PRIu64 " us",
+        store_p->appended,
+        store_p->dropped,
+        atomic_load(&store_p->segments),
+        atomic_load(&store_p->flushes),
+        atomic_load(&store_p->max_flush_ns) / 1000);
+}
+
+// Stop the flush thread, then sync and unmap every segment.
+void store_utils_close(TimeSeriesStore* store_p)
+{
+    if (!store_utils_is_open(store_p))
+    {
+        return;
+    }
+    pthread_mutex_lock(&store_p->mutex);
+    atomic_store(&store_p->stopping, true);
+    pthread_cond_signal(&store_p->wake);
+    pthread_mutex_unlock(&store_p->mutex);
+    pthread_join(store_p->thread, NULL);
+    uint32_t tail = atomic_load(&store_p->sealed_tail);
+    for (uint32_t head = atomic_load(&store_p->sealed_head); head != tail; head++)
+    {
+        _store_utils_release_segment(store_p->directory, store_p->sealed[head % STORE_MAX_SEALED]);
+    }
+    _store_utils_release_segment(store_p->directory, atomic_load(&store_p->active_p));
+    StoreSegment* spare_p = atomic_exchange(&store_p->spare_p, NULL);
+    if (spare_p != NULL)
+    {
+        _store_utils_release_segment(store_p->directory, spare_p);
+    }
+    pthread_cond_destroy(&store_p->wake);
+    pthread_mutex_destroy(&store_p->mutex);
+    atomic_store(&store_p->active_p, NULL);
+}
@@ -0,0 +1,165 @@
+// Hierarchical timer wheel with a 1 ms tick.
+// Level `n` has TIMER_WHEEL_SIZE slots, each covering TIMER_WHEEL_SIZE^n ticks. A timer is stored
+// in the lowest level that can hold its expiry and is moved (cascaded) to a lower level when the
+// level below wraps around. Adding and cancelling a timer are O(1); advancing costs O(1) per tick
+// plus the cascades.
+#define TIMER_WHEEL_BITS (6)
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS (4) /* Up to 2^24 ms (~4.6 hours) */
+#define TIMER_WHEEL_MAX_TICKS ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef struct Timer
+{
+    struct Timer* next;
+    struct Timer** pprev; /* Pointer to whatever points to this timer, NULL if not armed */
+    uint64_t expires_tick;
+    void (*callback)(struct Timer*, void*);
+    void* context;
+} Timer;
+
+typedef struct
+{
+    Timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+    uint64_t current_tick;
+    uint64_t start_ns;
+} TimerWheel;
+
+void timer_utils_init(TimerWheel* wheel_p)
+{
+    memset(wheel_p, 0, sizeof(TimerWheel));
+    wheel_p->start_ns = get_monotonic_ns();
+}
+
+uint64_t timer_utils_ns_to_tick(const TimerWheel* wheel_p, uint64_t time_ns)
+{
+    return time_ns < wheel_p->start_ns ? 0 : (time_ns - wheel_p->start_ns) / NS_PER_MS;
+}
+
+uint64_t timer_utils_tick_to_ns(const TimerWheel* wheel_p, uint64_t tick)
+{
+    return wheel_p->start_ns + tick * NS_PER_MS;
+}
+
+// Link a timer in the slot of its expiry, or of `earliest_tick` if it is already due.
+static void _timer_utils_link(TimerWheel* wheel_p, Timer* timer_p, uint64_t earliest_tick)
+{
+    uint64_t expires = timer_p->expires_tick > earliest_tick ? timer_p->expires_tick
+                                                             : earliest_tick;
+    uint64_t delta   = expires - wheel_p->current_tick;
+    if (delta > TIMER_WHEEL_MAX_TICKS)
+    {
+        expires = wheel_p->current_tick + TIMER_WHEEL_MAX_TICKS;
+        delta   = TIMER_WHEEL_MAX_TICKS;
+    }
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    size_t index    = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    Timer** slot_pp = &wheel_p->slots[level][index];
+    timer_p->pprev  = slot_pp;
+    timer_p->next   = *slot_pp;
+    if (*slot_pp != NULL)
+    {
+        (*slot_pp)->pprev = &timer_p->next;
+    }
+    *slot_pp = timer_p;
+}
+
+void timer_utils_add(
+    TimerWheel* wheel_p,
+    Timer* timer_p,
+    uint64_t expires_tick,
+    void (*callback)(Timer*, void*),
+    void* context)
+{
+    timer_p->expires_tick = expires_tick;
+    timer_p->callback     = callback;
+    timer_p->context      = context;
+    // Timers that are already due fire on the next tick, never on the slot being processed.
+    _timer_utils_link(wheel_p, timer_p, wheel_p->current_tick + 1);
+}
+
+bool timer_utils_is_armed(const Timer* timer_p) { return timer_p->pprev != NULL; }
+
+void timer_utils_cancel(Timer* timer_p)
+{
+    if (timer_p->pprev == NULL)
+    {
+        return;
+    }
+    *timer_p->pprev = timer_p->next;
+    if (timer_p->next != NULL)
+    {
+        timer_p->next->pprev = timer_p->pprev;
+    }
+    timer_p->next  = NULL;
+    timer_p->pprev = NULL;
+}
+
+static void _timer_utils_cascade(TimerWheel* wheel_p, int level)
+{
+    size_t index   = (wheel_p->current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    Timer* timer_p = wheel_p->slots[level][index];
+    wheel_p->slots[level][index] = NULL;
+    while (timer_p != NULL)
+    {
+        Timer* next_p = timer_p->next;
+        // Cascades run before the first level slot of the tick: a timer due now still fires now.
+        _timer_utils_link(wheel_p, timer_p, wheel_p->current_tick);
+        timer_p = next_p;
+    }
+}
+
+// Fire every timer that expired up to `now_ns`. Callbacks may add timers.
+void timer_utils_advance(TimerWheel* wheel_p, uint64_t now_ns)
+{
+    uint64_t target_tick = timer_utils_ns_to_tick(wheel_p, now_ns);
+    while (wheel_p->current_tick < target_tick)
+    {
+        wheel_p->current_tick++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if ((wheel_p->current_tick >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK)
+            {
+                break;
+            }
+            _timer_utils_cascade(wheel_p, level);
+        }
+        size_t index   = wheel_p->current_tick & TIMER_WHEEL_MASK;
+        Timer* timer_p = wheel_p->slots[0][index];
+        wheel_p->slots[0][index] = NULL;
+        while (timer_p != NULL)
+        {
+            Timer* next_p  = timer_p->next;
+            timer_p->next  = NULL;
+            timer_p->pprev = NULL;
+            timer_p->callback(timer_p, timer_p->context);
+            timer_p = next_p;
+        }
+    }
+}
+
+// Upper bound of the time until the next timer fires, in ms, capped to `max_ms`. Only the first
+// level is scanned: if it is empty, wake up when it wraps around and cascades.
+int timer_utils_next_timeout_ms(const TimerWheel* wheel_p, uint64_t now_ns, int max_ms)
+{
+    uint64_t now_tick = timer_utils_ns_to_tick(wheel_p, now_ns);
+    if (now_tick > wheel_p->current_tick)
+    {
+        return 0;
+    }
+    for (int i = 1; i <= TIMER_WHEEL_SIZE && i <= max_ms; i++)
+    {
+        size_t index = (wheel_p->current_tick + i) & TIMER_WHEEL_MASK;
+        if (wheel_p->slots[0][index] != NULL || index == 0)
+        {
+            // Sleep until the end of the tick in which the timer fires.
+            uint64_t due_ns = timer_utils_tick_to_ns(wheel_p, wheel_p->current_tick + i);
+            return due_ns > now_ns ? (int)((due_ns - now_ns + NS_PER_MS - 1) / NS_PER_MS) : 0;
+        }
+    }
+    return max_ms;
+}
@@ -0,0 +1,163 @@
+// Compact, append-only binary trace of a session.
+//
+// File layout:
+//   header: "MFTR" | u16 version | u16 reserved | u64 wall clock time when recording started (ns)
+//   record: u8 type | varint time since the previous record (us) | varint size | payload
+// Timestamps come from the monotonic clock, so the deltas are never negative.
+#define TRACE_MAGIC "MFTR"
+#define TRACE_VERSION (1)
+#define TRACE_BUFFER_SIZE (64 * 1024)
+#define TRACE_MAX_RECORD_SIZE (COMMUNICATION_BUFF_IN_SIZE)
+
+typedef enum
+{
+    TRACE_INSTRUCTION = 1, /* Line received through the FIFO (or the shared memory ring) */
+    TRACE_SERIAL_WRITE,    /* Bytes written to the Serial Device */
+    TRACE_SERIAL_READ,     /* Chunk returned by one read() from the Serial Device */
+} TraceRecordType;
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t start_realtime_ns;
+} TraceHeader;
+
+typedef struct
+{
+    TraceRecordType type;
+    uint64_t time_us; /* Since recording started */
+    size_t size;
+    char data[TRACE_MAX_RECORD_SIZE];
+} TraceRecord;
+
+static FILE* trace_file_p     = NULL;
+static uint64_t trace_last_ns = 0;
+static char* trace_buffer_p   = NULL;
+
+Error trace_utils_open(const char* path)
+{
+    trace_file_p = fopen(path, "wb");
+    if (trace_file_p == NULL)
+    {
+        LOG_PERROR("Failed to open trace file `%s`", path);
+        return ERR_FS_INTERNAL;
+    }
+    // Records are only flushed when idle (see `trace_utils_flush()`) or when the buffer is full.
+    trace_buffer_p = malloc(TRACE_BUFFER_SIZE);
+    if (trace_buffer_p != NULL)
+    {
+        setvbuf(trace_file_p, trace_buffer_p, _IOFBF, TRACE_BUFFER_SIZE);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    TraceHeader header = {
+        .magic             = TRACE_MAGIC,
+        .version           = TRACE_VERSION,
+        .start_realtime_ns = (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec,
+    };
+    fwrite(&header, sizeof(header), 1, trace_file_p);
+    trace_last_ns = get_monotonic_ns();
+    LOG_INFO("Recording trace to `%s`", path);
+    return ERR_ALL_GOOD;
+}
+
+static void _trace_utils_put_varint(uint64_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        fputc(value ? (byte | 0x80) : byte, trace_file_p);
+    } while (value);
+}
+
+void trace_utils_record(TraceRecordType type, const char* data, size_t size)
+{
+    if (trace_file_p == NULL)
+    {
+        return;
+    }
+    uint64_t now_ns = get_monotonic_ns();
+    fputc(type, trace_file_p);
+    _trace_utils_put_varint((now_ns - trace_last_ns) / 1000);
+    _trace_utils_put_varint(size);
+    fwrite(data, 1, size, trace_file_p);
+    // Only advance by whole microseconds so that rounding errors don't accumulate.
+    trace_last_ns += (now_ns - trace_last_ns) / 1000 * 1000;
+}
+
+void trace_utils_flush(void)
+{
+    if (trace_file_p != NULL)
+    {
+        fflush(trace_file_p);
+    }
+}
+
+void trace_utils_close(void)
+{
+    if (trace_file_p != NULL)
+    {
+        fclose(trace_file_p);
+        trace_file_p = NULL;
+        free(trace_buffer_p);
+        trace_buffer_p = NULL;
+    }
+}
+
+// ---------- READER ----------
+
+static Error _trace_utils_get_varint(FILE* file_p, uint64_t* value_p)
+{
+    int c;
+    *value_p = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if ((c = fgetc(file_p)) == EOF)
+        {
+            return ERR_INVALID;
+        }
+        *value_p |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            return ERR_ALL_GOOD;
+        }
+    }
+    return ERR_INVALID;
+}
+
+Error trace_utils_read_header(FILE* file_p, TraceHeader* header_p)
+{
+    if (fread(header_p, sizeof(TraceHeader), 1, file_p) != 1
+        || memcmp(header_p->magic, TRACE_MAGIC, 4) != 0 || header_p->version != TRACE_VERSION)
+    {
+        return ERR_INVALID;
+    }
+    return ERR_ALL_GOOD;
+}
+
+// Returns ERR_NOT_FOUND at the end of the file and ERR_INVALID if the trace is truncated.
+// `record_p->time_us` must hold the time of the previous record (0 before the first one).
+Error trace_utils_read_record(FILE* file_p, TraceRecord* record_p)
+{
+    uint64_t delta_us;
+    uint64_t size;
+    int type = fgetc(file_p);
+    if (type == EOF)
+    {
+        return ERR_NOT_FOUND;
+    }
+    if (type < TRACE_INSTRUCTION || type > TRACE_SERIAL_READ
+        || is_err(_trace_utils_get_varint(file_p, &delta_us))
+        || is_err(_trace_utils_get_varint(file_p, &size)) || size > TRACE_MAX_RECORD_SIZE
+        || fread(record_p->data, 1, size, file_p) != size)
+    {
+        return ERR_INVALID;
+    }
+    record_p->type = (TraceRecordType)type;
+    record_p->time_us += delta_us;
+    record_p->size = size;
+    return ERR_ALL_GOOD;
+}
@@ -46,6 +46,7 @@ Error usb_utils_open_serial_port(const char* device, const speed_t baud_rate, in
     if (!isatty(*out_fd))
     {
         perror("Not a TTY device");
+        close(*out_fd);
         return ERR_INVALID;
     }
     printf("Device connected\n");
@@ -110,36 +111,272 @@ void usb_utils_close_serial_port(int fd)
     close(fd);
 }
 
-// Writes bytes to the serial port, returning 0 on success and -1 on failure.
-Error usb_utils_write_port(const int fd, const SizedBuffer* buffer_p)
+// Outbound queue of a serial port. The port is non-blocking: when the driver buffer is full a write
+// is partial or refused (EAGAIN), and the rest is written once poll() reports POLLOUT. Writes are
+// also paced to the baud rate, never more than SERIAL_WRITE_BURST bytes ahead of the line, so that
+// the driver buffer does not fill up with bytes the device only sees much later.
+#define SERIAL_WRITE_QUEUE_SIZE (COMMUNICATION_BUFF_IN_SIZE)
+#define SERIAL_WRITE_BURST (64) /* Size of a typical UART FIFO */
+#define SERIAL_BITS_PER_BYTE (10) /* 8N1: start bit, 8 data bits, stop bit */
+
+typedef struct
+{
+    char buffer[SERIAL_WRITE_QUEUE_SIZE];
+    size_t head; /* First byte not written yet */
+    size_t size; /* Bytes not written yet */
+    uint64_t ns_per_byte; /* 0 when writes are not paced */
+    uint64_t line_busy_until_ns; /* When the bytes written so far have left the line */
+    uint64_t blocked_since_ns; /* 0 unless the driver refused bytes */
+    bool mid_line; /* The last byte written is not a '\n' */
+    uint64_t enqueued_bytes;
+    uint64_t written_bytes;
+    size_t high_water;
+    uint64_t writes;
+    uint64_t partial_writes;
+    uint64_t would_block;
+    uint64_t blocked_ns;
+    uint64_t rejected;
+} SerialWriteQueue;
+
+// Bits per second of a termios speed, 0 if unknown.
+uint32_t usb_utils_bits_per_second(const speed_t speed)
 {
-    printf("Sending `%s`. size: %lu\n", buffer_p->buffer, buffer_p->size);
-    ssize_t result = write(fd, buffer_p->buffer, buffer_p->size);
-    if (result != (ssize_t)buffer_p->size)
+    switch (speed)
     {
-        printf("Failed to write to port.\n");
-        return ERR_UNEXPECTED;
+    case B9600:
+        return 9600;
+    case B19200:
+        return 19200;
+    case B38400:
+        return 38400;
+    case B57600:
+        return 57600;
+    case B115200:
+        return 115200;
+    case B230400:
+        return 230400;
+    default:
+        return 0;
+    }
+}
+
+// `bits_per_second` paces the writes, 0 disables pacing.
+void usb_utils_write_queue_init(SerialWriteQueue* queue_p, uint32_t bits_per_second)
+{
+    memset(queue_p, 0, sizeof(SerialWriteQueue));
+    if (bits_per_second)
+    {
+        queue_p->ns_per_byte = NS_PER_SEC * SERIAL_BITS_PER_BYTE / bits_per_second;
+    }
+}
+
+// Queue `data` to be written by usb_utils_flush_writes. Returns ERR_OUT_OF_RANGE if it does not
+// fit, in which case nothing is queued.
+Error usb_utils_enqueue_write(SerialWriteQueue* queue_p, const char* data, size_t size)
+{
+    if (size > SERIAL_WRITE_QUEUE_SIZE - queue_p->size)
+    {
+        queue_p->rejected++;
+        return ERR_OUT_OF_RANGE;
+    }
+    if (queue_p->head + queue_p->size + size > SERIAL_WRITE_QUEUE_SIZE)
+    {
+        memmove(queue_p->buffer, queue_p->buffer + queue_p->head, queue_p->size);
+        queue_p->head = 0;
+    }
+    LOG_DEBUG_EVERY(
+        100,
+        "Sending `%.*s`, size: %zu",
+        (int)(size && data[size - 1] == '\n' ? size - 1 : size),
+        data,
+        size);
+    memcpy(queue_p->buffer + queue_p->head + queue_p->size, data, size);
+    queue_p->size += size;
+    queue_p->enqueued_bytes += size;
+    if (queue_p->size > queue_p->high_water)
+    {
+        queue_p->high_water = queue_p->size;
+    }
+    return ERR_ALL_GOOD;
+}
+
+// Drop the bytes not written yet. If a line was partially written, it is terminated so that the
+// device rejects it instead of reading it as the beginning of the next one.
+void usb_utils_discard_writes(SerialWriteQueue* queue_p)
+{
+    if (queue_p->size == 0)
+    {
+        return;
+    }
+    queue_p->enqueued_bytes -= queue_p->size;
+    queue_p->head             = 0;
+    queue_p->size             = 0;
+    queue_p->blocked_since_ns = 0;
+    if (queue_p->mid_line)
+    {
+        usb_utils_enqueue_write(queue_p, "\n", 1);
+    }
+}
+
+// Bytes that can be written at `now_ns` without getting more than SERIAL_WRITE_BURST bytes ahead
+// of the line. Nothing is written until at least half a burst is free, so that the bytes are
+// written in chunks rather than a few at a time.
+static size_t _usb_utils_write_allowance(const SerialWriteQueue* queue_p, uint64_t now_ns)
+{
+    if (queue_p->ns_per_byte == 0 || queue_p->line_busy_until_ns <= now_ns)
+    {
+        return queue_p->ns_per_byte ? SERIAL_WRITE_BURST : SIZE_MAX;
+    }
+    uint64_t ahead = (queue_p->line_busy_until_ns - now_ns) / queue_p->ns_per_byte;
+    return ahead <= SERIAL_WRITE_BURST / 2 ? SERIAL_WRITE_BURST - ahead : 0;
+}
+
+// Write as much of the queue as the driver and the pacing allow, without blocking. Returns
+// ERR_ALL_GOOD once the queue is empty, ERR_NOT_FOUND if bytes are left for later and
+// ERR_UNEXPECTED if the device is gone.
+Error usb_utils_flush_writes(const int fd, SerialWriteQueue* queue_p, uint64_t now_ns)
+{
+    while (queue_p->size)
+    {
+        size_t allowance = _usb_utils_write_allowance(queue_p, now_ns);
+        size_t size      = queue_p->size < allowance ? queue_p->size : allowance;
+        if (size == 0)
+        {
+            return ERR_NOT_FOUND;
+        }
+        ssize_t written = write(fd, queue_p->buffer + queue_p->head, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0 && errno != EAGAIN)
+        {
+            return ERR_UNEXPECTED;
+        }
+        if (written <= 0)
+        {
+            queue_p->would_block++;
+            if (queue_p->blocked_since_ns == 0)
+            {
+                queue_p->blocked_since_ns = now_ns;
+            }
+            return ERR_NOT_FOUND;
+        }
+        if (queue_p->blocked_since_ns)
+        {
+            queue_p->blocked_ns += now_ns - queue_p->blocked_since_ns;
+            queue_p->blocked_since_ns = 0;
+        }
+        queue_p->writes++;
+        queue_p->head += written;
+        queue_p->size -= written;
+        queue_p->written_bytes += written;
+        queue_p->mid_line = queue_p->buffer[queue_p->head - 1] != '\n';
+        queue_p->line_busy_until_ns
+            = (queue_p->line_busy_until_ns > now_ns ? queue_p->line_busy_until_ns : now_ns)
+              + written * queue_p->ns_per_byte;
+        if ((size_t)written < size)
+        {
+            // The driver buffer is full: wait for POLLOUT.
+            queue_p->partial_writes++;
+            queue_p->blocked_since_ns = now_ns;
+            return ERR_NOT_FOUND;
+        }
     }
+    queue_p->head = 0;
     return ERR_ALL_GOOD;
 }
 
-Error usb_utils_read_port(const int fd, SizedBuffer* buffer_p)
+// Whether the driver refused bytes, so that the port must be polled for POLLOUT.
+bool usb_utils_write_is_blocked(const SerialWriteQueue* queue_p)
+{
+    return queue_p->size && queue_p->blocked_since_ns;
+}
+
+// Bound `timeout_ms` to wake up when the pacing lets the next bytes be written.
+int usb_utils_write_timeout_ms(const SerialWriteQueue* queue_p, uint64_t now_ns, int timeout_ms)
+{
+    if (queue_p->size == 0 || queue_p->blocked_since_ns)
+    {
+        return timeout_ms;
+    }
+    if (_usb_utils_write_allowance(queue_p, now_ns))
+    {
+        return 0;
+    }
+    // The next chunk can be written once the line is half a burst behind.
+    uint64_t wait_ns = queue_p->line_busy_until_ns - now_ns
+                       - (SERIAL_WRITE_BURST / 2) * queue_p->ns_per_byte;
+    int wait_ms = (int)((wait_ns + NS_PER_MS - 1) / NS_PER_MS);
+    return timeout_ms >= 0 && timeout_ms < wait_ms ? timeout_ms : wait_ms;
+}
+
+void usb_utils_print_write_stats(const SerialWriteQueue* queue_p)
+{
+    uint64_t blocked_ns = queue_p->blocked_ns;
+    if (queue_p->blocked_since_ns)
+    {
+        blocked_ns += get_monotonic_ns() - queue_p->blocked_since_ns;
+    }
+    UNUSED(blocked_ns); /* When LOG_LEVEL is below LEVEL_INFO */
+    LOG_INFO(
+        "Serial writes | queued %4zu B high water %4zu B | %8" PRIu64 " B in %6" PRIu64
+        " writes, %4" PRIu64 " partial, %4" PRIu64 " EAGAIN, blocked %6" PRIu64 " ms, %4" PRIu64
+        " rejected",
+        queue_p->size,
+        queue_p->high_water,
+        queue_p->written_bytes,
+        queue_p->writes,
+        queue_p->partial_writes,
+        queue_p->would_block,
+        blocked_ns / 1000000,
+        queue_p->rejected);
+}
+
+// Append whatever the device sent to `pending_p`, without blocking. The new bytes are the last
+// `*chunk_size_p` ones. Returns ERR_NOT_FOUND if there was nothing to read and ERR_UNEXPECTED if
+// the device is gone: a read error, or end of file once the device is unplugged (hang-up).
+Error usb_utils_read_available(const int fd, SizedBuffer* pending_p, ssize_t* chunk_size_p)
 {
     // Leave one empty spot in the array to ensure that even if the buffer is full it can be
     // null-terminated
-    buffer_p->size = -1;
-    int i          = 0;
-    while ((i < 100) && (buffer_p->size < 0))
+    size_t room   = COMMUNICATION_BUFF_IN_SIZE - 1 - pending_p->size;
+    *chunk_size_p = 0;
+    if (room == 0)
+    {
+        return ERR_NOT_FOUND; /* usb_utils_next_frame() makes room first */
+    }
+    *chunk_size_p = read(fd, pending_p->buffer + pending_p->size, room);
+    if (*chunk_size_p < 0)
     {
-        buffer_p->size = read(fd, buffer_p->buffer, COMMUNICATION_BUFF_IN_SIZE - 1);
-        usleep(1000);
-        i++;
+        *chunk_size_p = 0;
+        return errno == EAGAIN ? ERR_NOT_FOUND : ERR_UNEXPECTED;
     }
-    if (buffer_p->size < 0)
+    if (*chunk_size_p == 0)
     {
-        buffer_p->size = 0;
-        return ERR_TIMEOUT;
+        return ERR_UNEXPECTED;
     }
-    buffer_p->buffer[buffer_p->size] = 0;
+    pending_p->size += *chunk_size_p;
     return ERR_ALL_GOOD;
 }
+
+// Move the first complete line (including its '\n') of `pending_p` to a pooled buffer. A full
+// buffer without any '\n' is returned as a frame too. Returns ERR_NOT_FOUND if there is no frame
+// yet and ERR_OUT_OF_RANGE if the frame was dropped because the buffer pool is exhausted.
+Error usb_utils_next_frame(SizedBuffer* pending_p, MessageBuffer** frame_pp)
+{
+    char* newline_p = memchr(pending_p->buffer, '\n', pending_p->size);
+    if (newline_p == NULL && pending_p->size < COMMUNICATION_BUFF_IN_SIZE - 1)
+    {
+        return ERR_NOT_FOUND;
+    }
+    size_t size = pending_p->size;
+    if (newline_p != NULL)
+    {
+        size = newline_p - pending_p->buffer + 1;
+    }
+    *frame_pp = buffer_utils_from(pending_p->buffer, size);
+    pending_p->size -= size;
+    memmove(pending_p->buffer, pending_p->buffer + size, pending_p->size);
+    return *frame_pp == NULL ? ERR_OUT_OF_RANGE : ERR_ALL_GOOD;
+}
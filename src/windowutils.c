@@ -0,0 +1,376 @@
+// Windowed aggregation of a numeric field of a command's responses, configured with
+// `-a <command>:<field>:<window ms>[/<slide ms>]`. Every `<slide ms>` (by default `<window ms>`,
+// i.e. tumbling windows), the count, min, max, mean and quantiles of the samples of the last
+// `<window ms>` are emitted instead of the raw responses.
+//
+// A window is split into panes of `<slide ms>`, so that sliding it only clears its oldest pane. The
+// quantiles come from a log-linear histogram per pane: a sample goes to the bucket indexed by the
+// exponent and the top WINDOW_SUB_BUCKET_BITS mantissa bits of its magnitude, which bounds the
+// relative error to 2^-(WINDOW_SUB_BUCKET_BITS + 1) without calling into libm. The buckets of a
+// series are centered on its first sample, and the samples out of range land in the edge buckets
+// (the min and max are always exact). The memory used per series is constant.
+#include <float.h>
+#include <math.h>
+
+#define WINDOW_MAX_SERIES (8)
+#define WINDOW_MAX_PANES (16)
+#define WINDOW_FIELD_SIZE (16)
+#define WINDOW_SUB_BUCKET_BITS (4)
+#define WINDOW_BUCKETS (256) /* Per sign: 16 octaves */
+
+typedef struct
+{
+    uint32_t count;
+    double sum;
+    double min;
+    double max;
+    uint32_t zeros;
+    uint32_t negative[WINDOW_BUCKETS];
+    uint32_t positive[WINDOW_BUCKETS];
+} WindowPane;
+
+typedef struct
+{
+    const Command* command_p;
+    char field[WINDOW_FIELD_SIZE]; /* Name of a `<name>=<value>` field, or index of a number */
+    uint32_t window_ms;
+    uint32_t slide_ms;
+    uint32_t num_panes;
+    uint32_t current_pane;
+    bool anchored;
+    int64_t anchor_key; /* Bucket key of the first sample */
+    uint64_t due_tick;
+    Timer timer;
+    uint64_t samples;
+    uint64_t unparsed;
+    uint64_t emitted;
+    WindowPane panes[WINDOW_MAX_PANES];
+} WindowSeries;
+
+typedef struct
+{
+    const WindowSeries* series_p;
+    uint64_t count;
+    double min;
+    double max;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+} WindowSummary;
+
+typedef struct
+{
+    WindowSeries series[WINDOW_MAX_SERIES];
+    size_t num_series;
+    TimerWheel* wheel_p;
+    void (*emit)(const WindowSummary*);
+} Aggregator;
+
+void window_utils_init(
+    Aggregator* aggregator_p, TimerWheel* wheel_p, void (*emit)(const WindowSummary*))
+{
+    memset(aggregator_p, 0, sizeof(Aggregator));
+    aggregator_p->wheel_p = wheel_p;
+    aggregator_p->emit    = emit;
+}
+
+static void _window_utils_clear_pane(WindowPane* pane_p)
+{
+    memset(pane_p, 0, sizeof(WindowPane));
+    pane_p->min = INFINITY;
+    pane_p->max = -INFINITY;
+}
+
+// Key of the log-linear bucket of `magnitude` (> 0): increasing with the magnitude.
+static int64_t _window_utils_key(double magnitude)
+{
+    uint64_t bits;
+    memcpy(&bits, &magnitude, sizeof(bits));
+    return (int64_t)(bits >> (52 - WINDOW_SUB_BUCKET_BITS));
+}
+
+// Middle of the bucket of key `key`.
+static double _window_utils_key_value(int64_t key)
+{
+    uint64_t bits = ((uint64_t)key << (52 - WINDOW_SUB_BUCKET_BITS))
+                    | (1ULL << (52 - WINDOW_SUB_BUCKET_BITS - 1));
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static size_t _window_utils_bucket(const WindowSeries* series_p, double magnitude)
+{
+    int64_t index = _window_utils_key(magnitude) - series_p->anchor_key + WINDOW_BUCKETS / 2;
+    return index < 0 ? 0 : (index >= WINDOW_BUCKETS ? WINDOW_BUCKETS - 1 : (size_t)index);
+}
+
+static double _window_utils_bucket_value(const WindowSeries* series_p, size_t bucket)
+{
+    return _window_utils_key_value((int64_t)bucket + series_p->anchor_key - WINDOW_BUCKETS / 2);
+}
+
+// Value at `rank` (starting at 1) in the histogram summed over the panes of the window.
+static double _window_utils_rank_value(const WindowSeries* series_p, uint64_t rank)
+{
+    uint64_t seen = 0;
+    for (size_t bucket = WINDOW_BUCKETS; bucket-- > 0;)
+    {
+        for (uint32_t p = 0; p < series_p->num_panes; p++)
+        {
+            seen += series_p->panes[p].negative[bucket];
+        }
+        if (seen >= rank)
+        {
+            return -_window_utils_bucket_value(series_p, bucket);
+        }
+    }
+    for (uint32_t p = 0; p < series_p->num_panes; p++)
+    {
+        seen += series_p->panes[p].zeros;
+    }
+    if (seen >= rank)
+    {
+        return 0;
+    }
+    for (size_t bucket = 0; bucket < WINDOW_BUCKETS; bucket++)
+    {
+        for (uint32_t p = 0; p < series_p->num_panes; p++)
+        {
+            seen += series_p->panes[p].positive[bucket];
+        }
+        if (seen >= rank)
+        {
+            return _window_utils_bucket_value(series_p, bucket);
+        }
+    }
+    return NAN;
+}
+
+static double _window_utils_quantile(const WindowSummary* summary_p, double q)
+{
+    uint64_t rank = (uint64_t)(q * (double)summary_p->count + 0.5);
+    double value  = _window_utils_rank_value(summary_p->series_p, rank ? rank : 1);
+    // The edge buckets are shared by every sample out of range: the exact bounds are better.
+    return value < summary_p->min ? summary_p->min
+                                  : (value > summary_p->max ? summary_p->max : value);
+}
+
+static void _window_utils_summarize(const WindowSeries* series_p, WindowSummary* summary_p)
+{
+    double sum          = 0;
+    summary_p->series_p = series_p;
+    summary_p->count    = 0;
+    summary_p->min      = INFINITY;
+    summary_p->max      = -INFINITY;
+    for (uint32_t p = 0; p < series_p->num_panes; p++)
+    {
+        const WindowPane* pane_p = &series_p->panes[p];
+        summary_p->count += pane_p->count;
+        sum += pane_p->sum;
+        summary_p->min = pane_p->min < summary_p->min ? pane_p->min : summary_p->min;
+        summary_p->max = pane_p->max > summary_p->max ? pane_p->max : summary_p->max;
+    }
+    if (summary_p->count == 0)
+    {
+        summary_p->min = summary_p->max = summary_p->mean = NAN;
+        summary_p->p50 = summary_p->p90 = summary_p->p99 = NAN;
+        return;
+    }
+    summary_p->mean = sum / (double)summary_p->count;
+    summary_p->p50  = _window_utils_quantile(summary_p, 0.50);
+    summary_p->p90  = _window_utils_quantile(summary_p, 0.90);
+    summary_p->p99  = _window_utils_quantile(summary_p, 0.99);
+}
+
+// Emit the summary of the window, then slide it by one pane.
+static void _window_utils_fire(Timer* timer_p, void* context)
+{
+    Aggregator* aggregator_p = (Aggregator*)context;
+    WindowSeries* series_p   = (WindowSeries*)((char*)timer_p - offsetof(WindowSeries, timer));
+    TimerWheel* wheel_p      = aggregator_p->wheel_p;
+    WindowSummary summary;
+
+    _window_utils_summarize(series_p, &summary);
+    aggregator_p->emit(&summary);
+    series_p->emitted++;
+    series_p->current_pane = (series_p->current_pane + 1) % series_p->num_panes;
+    _window_utils_clear_pane(&series_p->panes[series_p->current_pane]);
+
+    // If the process fell behind, the panes of the slides missed are empty.
+    series_p->due_tick += series_p->slide_ms;
+    while (series_p->due_tick <= wheel_p->current_tick)
+    {
+        series_p->due_tick += series_p->slide_ms;
+        series_p->current_pane = (series_p->current_pane + 1) % series_p->num_panes;
+        _window_utils_clear_pane(&series_p->panes[series_p->current_pane]);
+    }
+    timer_utils_add(wheel_p, timer_p, series_p->due_tick, _window_utils_fire, aggregator_p);
+}
+
+// Parse `<command>:<field>:<window ms>[/<slide ms>]` and start the series. The window must be a
+// multiple of the slide.
+Error window_utils_add(Aggregator* aggregator_p, const char* spec)
+{
+    const char* colon_p       = strchr(spec, ':');
+    const char* field_colon_p = colon_p ? strchr(colon_p + 1, ':') : NULL;
+    char* end_p               = NULL;
+    if (field_colon_p == NULL || field_colon_p - colon_p - 1 >= WINDOW_FIELD_SIZE
+        || field_colon_p == colon_p + 1 || aggregator_p->num_series == WINDOW_MAX_SERIES)
+    {
+        return ERR_INVALID;
+    }
+    const Command* command_p = command_utils_find(spec, colon_p - spec);
+    uint64_t window_ms       = strtoull(field_colon_p + 1, &end_p, 10);
+    uint64_t slide_ms        = window_ms;
+    if (*end_p == '/')
+    {
+        slide_ms = strtoull(end_p + 1, &end_p, 10);
+    }
+    if (command_p == NULL || *end_p != 0 || slide_ms == 0 || window_ms % slide_ms != 0
+        || window_ms / slide_ms > WINDOW_MAX_PANES || window_ms > TIMER_WHEEL_MAX_TICKS)
+    {
+        return ERR_INVALID;
+    }
+    WindowSeries* series_p = &aggregator_p->series[aggregator_p->num_series++];
+    memset(series_p, 0, sizeof(WindowSeries));
+    memcpy(series_p->field, colon_p + 1, field_colon_p - colon_p - 1);
+    series_p->command_p = command_p;
+    series_p->window_ms = (uint32_t)window_ms;
+    series_p->slide_ms  = (uint32_t)slide_ms;
+    series_p->num_panes = (uint32_t)(window_ms / slide_ms);
+    for (uint32_t p = 0; p < series_p->num_panes; p++)
+    {
+        _window_utils_clear_pane(&series_p->panes[p]);
+    }
+    series_p->due_tick = aggregator_p->wheel_p->current_tick + slide_ms;
+    timer_utils_add(
+        aggregator_p->wheel_p,
+        &series_p->timer,
+        series_p->due_tick,
+        _window_utils_fire,
+        aggregator_p);
+    LOG_INFO(
+        "Aggregating `%s` field `%s` over %" PRIu64 " ms windows every %" PRIu64 " ms",
+        command_p->name,
+        series_p->field,
+        window_ms,
+        slide_ms);
+    return ERR_ALL_GOOD;
+}
+
+// Find the value of `field` in the null-terminated `response`: either the value of a
+// `<field>=<value>` (or `<field>:<value>`) pair, or the `<field>`-th number (starting at 1).
+Error window_utils_extract(const char* response, const char* field, double* value_p)
+{
+    char* end_p;
+    size_t field_len    = strlen(field);
+    bool by_index       = strspn(field, "0123456789") == field_len;
+    unsigned long index = by_index ? strtoul(field, NULL, 10) : 0;
+    for (const char* p = response; *p; p++)
+    {
+        bool boundary = p == response || !(isalnum((unsigned char)p[-1]) || p[-1] == '_');
+        if (!boundary)
+        {
+            continue;
+        }
+        if (!by_index)
+        {
+            if (strncmp(p, field, field_len) != 0 || (p[field_len] != '=' && p[field_len] != ':'))
+            {
+                continue;
+            }
+            *value_p = strtod(p + field_len + 1, &end_p);
+            return end_p == p + field_len + 1 ? ERR_PARSE_STRING_TO_FLOAT : ERR_ALL_GOOD;
+        }
+        bool sign = *p == '-' || *p == '+' || *p == '.';
+        if (!isdigit((unsigned char)*p) && !(sign && isdigit((unsigned char)p[1])))
+        {
+            continue;
+        }
+        double value = strtod(p, &end_p);
+        if (--index == 0)
+        {
+            *value_p = value;
+            return ERR_ALL_GOOD;
+        }
+        p = end_p - 1;
+    }
+    return ERR_NOT_FOUND;
+}
+
+static void _window_utils_add_sample(WindowSeries* series_p, double value)
+{
+    WindowPane* pane_p = &series_p->panes[series_p->current_pane];
+    double magnitude   = value < 0 ? -value : value;
+    pane_p->count++;
+    pane_p->sum += value;
+    pane_p->min = value < pane_p->min ? value : pane_p->min;
+    pane_p->max = value > pane_p->max ? value : pane_p->max;
+    if (magnitude < DBL_MIN) /* Zero or subnormal */
+    {
+        pane_p->zeros++;
+        return;
+    }
+    if (!series_p->anchored)
+    {
+        series_p->anchor_key = _window_utils_key(magnitude);
+        series_p->anchored   = true;
+    }
+    size_t bucket = _window_utils_bucket(series_p, magnitude);
+    if (value < 0)
+    {
+        pane_p->negative[bucket]++;
+    }
+    else
+    {
+        pane_p->positive[bucket]++;
+    }
+}
+
+// Add the fields of `response` aggregated for `command_p`. Returns whether the command is
+// aggregated, in which case its raw responses are not forwarded.
+bool window_utils_observe(Aggregator* aggregator_p, const Command* command_p, const char* response)
+{
+    bool aggregated = false;
+    for (size_t i = 0; i < aggregator_p->num_series; i++)
+    {
+        WindowSeries* series_p = &aggregator_p->series[i];
+        double value;
+        if (series_p->command_p != command_p)
+        {
+            continue;
+        }
+        aggregated = true;
+        if (is_err(window_utils_extract(response, series_p->field, &value)) || !isfinite(value))
+        {
+            series_p->unparsed++;
+            LOG_WARNING_EVERY(
+                10000, "No `%s` field in the `%s` response", series_p->field, command_p->name);
+            continue;
+        }
+        series_p->samples++;
+        _window_utils_add_sample(series_p, value);
+    }
+    return aggregated;
+}
+
+void window_utils_print_stats(const Aggregator* aggregator_p)
+{
+    for (size_t i = 0; i < aggregator_p->num_series; i++)
+    {
+        const WindowSeries* series_p = &aggregator_p->series[i];
+        UNUSED(series_p); /* When LOG_LEVEL is below LEVEL_INFO */
+        LOG_INFO(
+            "Window %s.%-8s | %6" PRIu32 " ms every %6" PRIu32 " ms | samples %8" PRIu64
+            " unparsed %6" PRIu64 " windows emitted %6" PRIu64,
+            series_p->command_p->name,
+            series_p->field,
+            series_p->window_ms,
+            series_p->slide_ms,
+            series_p->samples,
+            series_p->unparsed,
+            series_p->emitted);
+    }
+}
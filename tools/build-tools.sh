@@ -0,0 +1,17 @@
+#!/usr/bin/env zsh
+
+# Builds every standalone tool in `tools/` (benchmarks, decoders, ...) into `build/`.
+# Usage: [TOOL_FLAGS=<extra compiler flags>] ./tools/build-tools.sh [tool name ...]
+set -ue
+FLAGS="-Wall -Wextra -std=c17 -pedantic -O2 ${TOOL_FLAGS:-}"
+if [ "$(uname -s)" = "Linux" ]; then
+    FLAGS="${FLAGS} -D_BSD_SOURCE -D_DEFAULT_SOURCE -D_GNU_SOURCE -lpthread"
+fi
+mkdir -p build/
+if [ $# -eq 0 ]; then
+    set -- $(cd tools && ls *.c | sed 's/\.c$//')
+fi
+for TOOL in "$@"; do
+    echo "Building ${TOOL}"
+    clang -o "build/${TOOL}" "tools/${TOOL}.c" `echo ${FLAGS}`
+done
@@ -0,0 +1,194 @@
+// Decodes the flight recorder written by multiface (see `src/recorderutils.c`), oldest transaction
+// first. It can be run on the file of a live, crashed or killed process.
+//
+// Usage: ./build/flight-decode [-j] [-n <last transactions>] [flight recorder file]
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define COMMUNICATION_BUFF_IN_SIZE (4096)
+
+#define LOG_LEVEL LEVEL_WARNING
+#include "../src/mylib.c"
+#include "../src/bufferutils.c"
+#include "../src/commandutils.c"
+#include "../src/queueutils.c"
+#include "../src/jsonutils.c"
+#include "../src/recorderutils.c"
+
+static const char* source_names[] = {"fifo", "shm", "scheduler"};
+
+static const char* status_name(const RecorderRecord* record_p)
+{
+    switch (record_p->status)
+    {
+    case ERR_ALL_GOOD:
+        return record_p->response_size ? "ok" : "empty";
+    case ERR_TIMEOUT:
+        return "timeout";
+    default:
+        return "error";
+    }
+}
+
+static int compare_sequence(const void* a, const void* b)
+{
+    uint64_t x = atomic_load(&(*(const RecorderRecord* const*)a)->sequence);
+    uint64_t y = atomic_load(&(*(const RecorderRecord* const*)b)->sequence);
+    return (x > y) - (x < y);
+}
+
+static void print_text(const RecorderRecord* record_p)
+{
+    char date_time[32];
+    time_t seconds = (time_t)(record_p->completed_realtime_ns / NS_PER_SEC);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    strftime(date_time, sizeof(date_time), "%Y-%m-%d %H:%M:%S", &tm);
+    size_t kept = strnlen(record_p->response, RECORDER_RESPONSE_SIZE);
+    while (kept && (record_p->response[kept - 1] == '\n' || record_p->response[kept - 1] == '\r'))
+    {
+        kept--;
+    }
+    printf(
+        "%" PRIu64 " %s.%06" PRIu64 " #%u %.*s %s %s %s queued %u us write %u us read %u us | "
+        "%u B `%.*s`%s\n",
+        atomic_load(&record_p->sequence),
+        date_time,
+        (uint64_t)(record_p->completed_realtime_ns % NS_PER_SEC / 1000),
+        record_p->id,
+        RECORDER_COMMAND_SIZE,
+        record_p->command,
+        record_p->priority < NUM_PRIORITIES ? priority_names[record_p->priority] : "?",
+        record_p->source < 3 ? source_names[record_p->source] : "?",
+        status_name(record_p),
+        record_p->queued_us,
+        record_p->write_us,
+        record_p->read_us,
+        record_p->response_size,
+        (int)kept,
+        record_p->response,
+        record_p->response_size > RECORDER_RESPONSE_SIZE ? "..." : "");
+}
+
+static void print_json(const RecorderRecord* record_p)
+{
+    static char json_buffer[4 * RECORDER_RECORD_SIZE];
+    JsonWriter writer;
+    const char* status = status_name(record_p);
+    json_utils_init(&writer, json_buffer, sizeof(json_buffer));
+    json_utils_begin_object(&writer, NULL);
+    json_utils_uint(&writer, "sequence", atomic_load(&record_p->sequence));
+    json_utils_uint(&writer, "time_ns", record_p->completed_realtime_ns);
+    json_utils_uint(&writer, "id", record_p->id);
+    json_utils_string(
+        &writer, "command", record_p->command, strnlen(record_p->command, RECORDER_COMMAND_SIZE));
+    if (record_p->priority < NUM_PRIORITIES)
+    {
+        const char* priority = priority_names[record_p->priority];
+        json_utils_string(&writer, "priority", priority, strlen(priority));
+    }
+    if (record_p->source < 3)
+    {
+        const char* source = source_names[record_p->source];
+        json_utils_string(&writer, "source", source, strlen(source));
+    }
+    json_utils_string(&writer, "status", status, strlen(status));
+    json_utils_int(&writer, "error", record_p->status);
+    json_utils_uint(&writer, "bytes_received", record_p->response_size);
+    json_utils_string(
+        &writer,
+        "response",
+        record_p->response,
+        strnlen(record_p->response, RECORDER_RESPONSE_SIZE));
+    json_utils_bool(&writer, "truncated", record_p->response_size > RECORDER_RESPONSE_SIZE);
+    json_utils_begin_object(&writer, "timings_us");
+    json_utils_uint(&writer, "queued", record_p->queued_us);
+    json_utils_uint(&writer, "write", record_p->write_us);
+    json_utils_uint(&writer, "read", record_p->read_us);
+    json_utils_end_object(&writer);
+    json_utils_end_object(&writer);
+    if (is_ok(json_utils_finish(&writer)))
+    {
+        fwrite(json_buffer, 1, writer.size, stdout);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bool json   = false;
+    size_t last = RECORDER_CAPACITY;
+    int opt;
+    while ((opt = getopt(argc, argv, "jn:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        case 'n':
+            last = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            printf("Usage: %s [-j] [-n <last transactions>] [flight recorder file]\n", argv[0]);
+            exit(1);
+        }
+    }
+    const char* path = optind < argc ? argv[optind] : RECORDER_DEFAULT_PATH;
+    logger_init(NULL, NULL);
+
+    static RecorderFile file;
+    FILE* file_p = fopen(path, "rb");
+    if (file_p == NULL || fread(&file, sizeof(file), 1, file_p) != 1
+        || !_recorder_utils_is_valid(&file))
+    {
+        printf("`%s` is not a multiface flight recorder.\n", path);
+        exit(ERR_FATAL);
+    }
+    fclose(file_p);
+
+    // Slots whose sequence does not match their position were being written when the process
+    // stopped: skip them.
+    static const RecorderRecord* records[RECORDER_CAPACITY];
+    size_t num_records = 0;
+    for (size_t i = 0; i < RECORDER_CAPACITY; i++)
+    {
+        uint64_t sequence = atomic_load(&file.records[i].sequence);
+        if (sequence != 0 && (sequence - 1) % RECORDER_CAPACITY == i)
+        {
+            records[num_records++] = &file.records[i];
+        }
+    }
+    qsort(records, num_records, sizeof(records[0]), compare_sequence);
+    for (size_t i = num_records > last ? num_records - last : 0; i < num_records; i++)
+    {
+        if (json)
+        {
+            print_json(records[i]);
+        }
+        else
+        {
+            print_text(records[i]);
+        }
+    }
+    if (!json)
+    {
+        printf(
+            "%zu transactions kept out of %" PRIu64 " recorded\n",
+            num_records,
+            atomic_load(&file.header.next_sequence) - 1);
+    }
+    return ERR_ALL_GOOD;
+}
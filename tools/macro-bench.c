@@ -0,0 +1,428 @@
+// Compares running a sequence of commands as a macro (`run <name>`, see `slave/src/macros.h`)
+// with running it step by step, over a pseudo-terminal. A forked child emulates the firmware with
+// its macro engine, built on the host, and waits a turnaround delay before answering each line it
+// receives: the USB polling interval and the processing of a real board, which every round trip
+// pays once. The answer of every run is checked against the answers of the same steps one by one,
+// and the rejections of `macros_define()` are checked first.
+//
+// Usage: ./build/macro-bench [-n <steps>] [-r <runs>] [-l <turnaround us>] [-e]
+// With -e, the emulated device is only started and its port printed, e.g. to try `multiface -M`.
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <string.h>
+
+#define LOG_LEVEL LEVEL_WARNING
+#include "../src/mylib.c"
+#define DEVICE_ID "emulated"
+#include "../slave/src/commands.h"
+#include "../slave/src/macros.h"
+
+#define BENCH_LINE_SIZE (4096)
+#define BENCH_MACRO "BENCH"
+
+// Short answers, so that the round trips are measured rather than the transfer of the answers.
+static const char* const steps[] = {"who are you?", "stop"};
+
+typedef struct
+{
+    char data[BENCH_LINE_SIZE];
+    size_t size;
+} Line;
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_results(const char* name, uint64_t* latencies, size_t n)
+{
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        total_ns += latencies[i];
+    }
+    qsort(latencies, n, sizeof(uint64_t), compare_u64);
+    printf(
+        "%-12s | sequence mean %9.2f us  p50 %9.2f us  p99 %9.2f us  max %9.2f us\n",
+        name,
+        (double)total_ns / (double)n / 1e3,
+        latencies[n / 2] / 1e3,
+        latencies[(n * 99) / 100] / 1e3,
+        latencies[n - 1] / 1e3);
+}
+
+// ---------- Emulated device ----------
+
+static void append(Line* reply_p, const char* data, size_t size)
+{
+    size = size < BENCH_LINE_SIZE - reply_p->size ? size : BENCH_LINE_SIZE - reply_p->size;
+    memcpy(reply_p->data + reply_p->size, data, size);
+    reply_p->size += size;
+}
+
+// As `answer()` in `slave/src/main.cpp`.
+static void answer(Line* reply_p, const char* line, size_t length)
+{
+    const char* reply = commands_answer(line, length);
+    if (reply != NULL)
+    {
+        append(reply_p, reply, strlen(reply));
+        return;
+    }
+    append(reply_p, "Invalid command `", 17);
+    append(reply_p, line, length);
+    append(reply_p, "`", 1);
+}
+
+// As `loop()` in `slave/src/main.cpp`.
+static void emulate_line(MacroTable* table_p, Line* reply_p, const char* line, size_t length)
+{
+    if (commands_is(line, length, "run "))
+    {
+        const Macro* macro_p = macros_find(table_p, line + 4, length - 4);
+        const char* cursor   = macro_p ? macro_p->body : "";
+        const char* step;
+        size_t step_length;
+        if (macro_p == NULL)
+        {
+            append(reply_p, "Unknown macro `", 15);
+            append(reply_p, line + 4, length - 4);
+            append(reply_p, "`", 1);
+        }
+        while (macros_next_step(&cursor, &step, &step_length))
+        {
+            append(reply_p, "\t", reply_p->size ? 1 : 0);
+            answer(reply_p, step, step_length);
+        }
+    }
+    else if (length == 11 && commands_is(line, length, "macro clear"))
+    {
+        macros_clear(table_p);
+        append(reply_p, "OK", 2);
+    }
+    else if (commands_is(line, length, "macro "))
+    {
+        MacroStatus status  = macros_define(table_p, line + 6, length - 6);
+        const char* message = macros_status_name(status);
+        append(reply_p, "Rejected macro: ", status == MACROS_OK ? 0 : 16);
+        append(reply_p, message, strlen(message));
+    }
+    else
+    {
+        answer(reply_p, line, length);
+    }
+    append(reply_p, "\r\n", 2);
+}
+
+static void emulate_device(int fd, uint64_t turnaround_us)
+{
+    static MacroTable table;
+    Line pending = {0};
+    Line reply;
+    macros_init(&table);
+    while (true)
+    {
+        ssize_t size = read(fd, pending.data + pending.size, BENCH_LINE_SIZE - pending.size);
+        if (size <= 0)
+        {
+            exit(ERR_ALL_GOOD);
+        }
+        pending.size += size;
+        char* end_p;
+        while ((end_p = memchr(pending.data, '\n', pending.size)) != NULL)
+        {
+            size_t length = end_p - pending.data;
+            size_t used   = length + 1;
+            while (length && pending.data[length - 1] == '\r')
+            {
+                length--;
+            }
+            usleep(turnaround_us);
+            reply.size = 0;
+            emulate_line(&table, &reply, pending.data, length);
+            if (write(fd, reply.data, reply.size) != (ssize_t)reply.size)
+            {
+                exit(ERR_FATAL);
+            }
+            pending.size -= used;
+            memmove(pending.data, end_p + 1, pending.size);
+        }
+        if (pending.size == BENCH_LINE_SIZE)
+        {
+            pending.size = 0;
+        }
+    }
+}
+
+// Open a pseudo-terminal in raw mode, the device side on `*device_fd_p`. Returns the host side.
+static int open_pty(int* device_fd_p, char* path, size_t path_size)
+{
+    struct termios options;
+    int device_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (device_fd < 0 || grantpt(device_fd) < 0 || unlockpt(device_fd) < 0)
+    {
+        printf("Failed to open a pseudo-terminal: %s\n", strerror(errno));
+        exit(ERR_FATAL);
+    }
+    snprintf(path, path_size, "%s", ptsname(device_fd));
+    int host_fd = open(path, O_RDWR | O_NOCTTY);
+    if (host_fd < 0 || tcgetattr(host_fd, &options) < 0)
+    {
+        printf("Failed to open `%s`: %s\n", path, strerror(errno));
+        exit(ERR_FATAL);
+    }
+    cfmakeraw(&options);
+    tcsetattr(host_fd, TCSANOW, &options);
+    *device_fd_p = device_fd;
+    return host_fd;
+}
+
+// ---------- Checks of the macro engine ----------
+
+static size_t num_failures = 0;
+
+static void check_define(MacroTable* table_p, const char* line, MacroStatus expected)
+{
+    MacroStatus status = macros_define(table_p, line, strlen(line));
+    if (status != expected)
+    {
+        printf(
+            "`macro %.40s`: %s instead of %s\n",
+            line,
+            macros_status_name(status),
+            macros_status_name(expected));
+        num_failures++;
+    }
+}
+
+// The definitions the firmware must reject, and the slots being freed by `macro clear`.
+static void check_macros_define(void)
+{
+    static MacroTable table;
+    char line[MACROS_BODY_SIZE + 64];
+    macros_init(&table);
+    check_define(&table, "", MACROS_INVALID);
+    check_define(&table, "A", MACROS_INVALID);
+    check_define(&table, "A ", MACROS_INVALID);
+    check_define(&table, " stop", MACROS_INVALID);
+    check_define(&table, "A stop;;stop", MACROS_INVALID);
+    check_define(&table, "A stop;", MACROS_INVALID);
+    check_define(&table, "A stop;run A", MACROS_INVALID);
+    check_define(&table, "A macro B stop", MACROS_INVALID);
+    memset(line, 'N', MACROS_NAME_SIZE);
+    snprintf(line + MACROS_NAME_SIZE, sizeof(line) - MACROS_NAME_SIZE, " stop");
+    check_define(&table, line, MACROS_TOO_LONG);
+    int size = snprintf(line, sizeof(line), "A ");
+    memset(line + size, 's', MACROS_BODY_SIZE);
+    line[size + MACROS_BODY_SIZE] = 0;
+    check_define(&table, line, MACROS_TOO_LONG);
+    size = snprintf(line, sizeof(line), "A stop");
+    for (int i = 1; i <= MACROS_MAX_STEPS; i++)
+    {
+        size += snprintf(line + size, sizeof(line) - size, ";stop");
+    }
+    check_define(&table, line, MACROS_TOO_LONG);
+    for (int i = 0; i < MACROS_MAX; i++)
+    {
+        snprintf(line, sizeof(line), "M%d stop", i);
+        check_define(&table, line, MACROS_OK);
+    }
+    check_define(&table, "M0 stop;stop", MACROS_OK); /* Redefined in its own slot */
+    check_define(&table, "EXTRA stop", MACROS_FULL);
+    macros_clear(&table);
+    if (macros_find(&table, "M0", 2) != NULL)
+    {
+        printf("`macro clear` kept `M0`\n");
+        num_failures++;
+    }
+    check_define(&table, "EXTRA stop", MACROS_OK);
+    check_define(&table, "B running;macros", MACROS_OK); /* Not `run ` nor `macro ` */
+}
+
+// ---------- Host ----------
+
+// Send `message` and read one answer line, without its line ending, into `answer_p`.
+static void round_trip(int fd, const char* message, Line* answer_p)
+{
+    static Line pending = {0};
+    char* end_p;
+    if (write(fd, message, strlen(message)) != (ssize_t)strlen(message))
+    {
+        printf("Failed to write to the device: %s\n", strerror(errno));
+        exit(ERR_FATAL);
+    }
+    while ((end_p = memchr(pending.data, '\n', pending.size)) == NULL)
+    {
+        ssize_t size = read(fd, pending.data + pending.size, BENCH_LINE_SIZE - pending.size);
+        if (size <= 0 || pending.size + size == BENCH_LINE_SIZE)
+        {
+            printf("Failed to read from the device\n");
+            exit(ERR_FATAL);
+        }
+        pending.size += size;
+    }
+    size_t length  = end_p - pending.data;
+    answer_p->size = length && end_p[-1] == '\r' ? length - 1 : length;
+    memcpy(answer_p->data, pending.data, answer_p->size);
+    answer_p->data[answer_p->size] = 0;
+    pending.size -= length + 1;
+    memmove(pending.data, end_p + 1, pending.size);
+}
+
+static void usage(const char* program_name)
+{
+    printf("Usage: %s [-n <steps>] [-r <runs>] [-l <turnaround us>] [-e]\n", program_name);
+    printf("  -n  steps of the sequence (default 10, at most %d)\n", MACROS_MAX_STEPS);
+    printf("  -r  runs of the sequence in each mode (default 200)\n");
+    printf("  -l  delay before the device answers each line (default 1000 us)\n");
+    printf("  -e  only start the emulated device and print its port\n");
+}
+
+int main(int argc, char* argv[])
+{
+    size_t num_steps       = 10;
+    size_t num_runs        = 200;
+    uint64_t turnaround_us = 1000;
+    bool emulate_only      = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:l:e")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            num_steps = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            num_runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            turnaround_us = strtoull(optarg, NULL, 10);
+            break;
+        case 'e':
+            emulate_only = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (num_steps == 0 || num_steps > MACROS_MAX_STEPS || num_runs == 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+    logger_init(NULL, NULL);
+    check_macros_define();
+    if (num_failures)
+    {
+        exit(ERR_FATAL);
+    }
+    char path[128];
+    int device_fd;
+    int host_fd = open_pty(&device_fd, path, sizeof(path));
+    if (emulate_only)
+    {
+        // The host side stays open, or the device side would read EOF until `path` is opened.
+        printf("%s\n", path);
+        fflush(stdout);
+        emulate_device(device_fd, turnaround_us);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(host_fd);
+        emulate_device(device_fd, turnaround_us);
+    }
+    close(device_fd);
+
+    char definition[MACROS_BODY_SIZE + 32];
+    int size = snprintf(definition, sizeof(definition), "macro " BENCH_MACRO " ");
+    for (size_t i = 0; i < num_steps; i++)
+    {
+        size += snprintf(
+            definition + size,
+            sizeof(definition) - size,
+            "%s%s",
+            i ? ";" : "",
+            steps[i % (sizeof(steps) / sizeof(steps[0]))]);
+    }
+    snprintf(definition + size, sizeof(definition) - size, "\n");
+    printf(
+        "Sequence of %zu steps, %zu runs, turnaround %" PRIu64 " us on `%s`\n",
+        num_steps,
+        num_runs,
+        turnaround_us,
+        path);
+
+    Line answer;
+    Line expected;
+    round_trip(host_fd, definition, &answer);
+    if (strcmp(answer.data, "OK") != 0)
+    {
+        printf("The device rejected the macro: %s\n", answer.data);
+        exit(ERR_FATAL);
+    }
+    uint64_t* step_latencies  = malloc(num_runs * sizeof(uint64_t));
+    uint64_t* macro_latencies = malloc(num_runs * sizeof(uint64_t));
+    if (step_latencies == NULL || macro_latencies == NULL)
+    {
+        exit(ERR_FATAL);
+    }
+    for (size_t run = 0; run < num_runs; run++)
+    {
+        char message[64];
+        expected.size  = 0;
+        uint64_t start = get_monotonic_ns();
+        for (size_t i = 0; i < num_steps; i++)
+        {
+            const char* step = steps[i % (sizeof(steps) / sizeof(steps[0]))];
+            snprintf(message, sizeof(message), "%s\n", step);
+            round_trip(host_fd, message, &answer);
+            append(&expected, "\t", i ? 1 : 0);
+            append(&expected, answer.data, answer.size);
+        }
+        step_latencies[run] = get_monotonic_ns() - start;
+
+        start = get_monotonic_ns();
+        round_trip(host_fd, "run " BENCH_MACRO "\n", &answer);
+        macro_latencies[run] = get_monotonic_ns() - start;
+        if (answer.size != expected.size || memcmp(answer.data, expected.data, answer.size) != 0)
+        {
+            printf(
+                "Run %zu: the macro answered `%s` instead of `%.*s`\n",
+                run,
+                answer.data,
+                (int)expected.size,
+                expected.data);
+            exit(ERR_FATAL);
+        }
+    }
+    print_results("step by step", step_latencies, num_runs);
+    print_results("macro", macro_latencies, num_runs);
+    printf("Every macro answer matched the answers of its steps\n");
+
+    close(host_fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free(step_latencies);
+    free(macro_latencies);
+    return ERR_ALL_GOOD;
+}
@@ -0,0 +1,541 @@
+// Microbenchmarks of the hot-path primitives: FIFO and serial line splitting, command lookup,
+// response assembly, the flight recorder, the logging macros (enabled, disabled at runtime and
+// rate-limited) and the timestamp helpers.
+// The daemon itself is compiled in (with `main()` renamed), so the code measured is exactly the
+// code shipped. Every case is warmed up and calibrated so that one repetition lasts about 10 ms,
+// then repeated: the median and the median absolute deviation (MAD) of the time per operation are
+// reported, with the number of allocations per operation.
+// Results are compared with a baseline file. A case is flagged as a regression when its median is
+// both more than the threshold above the baseline and more than 3 MADs away from it.
+//
+// Usage: ./build/microbench [-w] [-b <baseline file>] [-t <threshold %>] [-n <repetitions>]
+//                           [case name filter]
+#include <stdint.h>
+#include <stdlib.h>
+
+// Count the allocations made by the code under test. Defined before the macros below so that the
+// wrappers call the real allocator.
+static uint64_t bench_allocations = 0;
+
+void* bench_malloc(size_t size)
+{
+    bench_allocations++;
+    return malloc(size);
+}
+
+void* bench_calloc(size_t count, size_t size)
+{
+    bench_allocations++;
+    return calloc(count, size);
+}
+
+void* bench_realloc(void* pointer, size_t size)
+{
+    bench_allocations++;
+    return realloc(pointer, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(pointer, size) bench_realloc(pointer, size)
+
+#define main multiface_main
+#include "../src/main.c"
+#undef main
+
+#define BENCH_DEFAULT_BASELINE "artifacts/microbench.baseline"
+#define BENCH_DEFAULT_THRESHOLD_PERCENT (10.0)
+#define BENCH_DEFAULT_REPETITIONS (15)
+#define BENCH_MAX_REPETITIONS (101)
+#define BENCH_TARGET_NS (10 * NS_PER_MS)
+#define BENCH_MAX_ITERATIONS (1u << 28)
+#define BENCH_LINES_PER_BATCH (64)
+#define BENCH_RECORDER_PATH "artifacts/microbench_recorder"
+
+typedef struct
+{
+    const char* name;
+    void (*run)(size_t iterations);
+} BenchCase;
+
+typedef struct
+{
+    double median_ns;
+    double mad_ns;
+    double allocations_per_op;
+} BenchResult;
+
+typedef struct
+{
+    char name[64];
+    double median_ns;
+} BaselineEntry;
+
+static volatile uint64_t bench_sink;
+static int devnull_fd      = -1;
+static int saved_stdout_fd = -1;
+
+// Some primitives print to the standard output: silence it while they are measured.
+static void quiet_begin(void)
+{
+    fflush(stdout);
+    dup2(devnull_fd, STDOUT_FILENO);
+}
+
+static void quiet_end(void)
+{
+    fflush(stdout);
+    dup2(saved_stdout_fd, STDOUT_FILENO);
+}
+
+// ---------- CASES ----------
+
+static const char long_response[]
+    = "This is a very long string but you should not crop it or wrap it or crap it! - "
+      "This is a very long string but you should not crop it or wrap it or crap it!\n";
+
+static int pipe_fds[2] = {-1, -1};
+
+// One `POLL` instruction read from a non-blocking pipe, which behaves like `artifacts/fifo_in`.
+// Includes the writer's share: one write of BENCH_LINES_PER_BATCH lines.
+static void bench_fifo_read_line(size_t iterations)
+{
+    static char batch[BENCH_LINES_PER_BATCH * 5];
+    static SizedBuffer line;
+    for (size_t i = 0; i < sizeof(batch); i += 5)
+    {
+        memcpy(batch + i, "POLL\n", 5);
+    }
+    for (size_t i = 0; i < iterations; i++)
+    {
+        if (i % BENCH_LINES_PER_BATCH == 0 && write(pipe_fds[1], batch, sizeof(batch)) < 0)
+        {
+            exit(ERR_FATAL);
+        }
+        fifo_utils_read_line(&line, pipe_fds[0]);
+        bench_sink += line.size;
+    }
+    // Drain what is left of the last batch.
+    do
+    {
+        fifo_utils_read_line(&line, pipe_fds[0]);
+    } while (line.size);
+}
+
+// One response frame split from the serial input into a pooled buffer.
+static void bench_serial_next_frame(size_t iterations)
+{
+    static SizedBuffer pending;
+    MessageBuffer* frame_p;
+    for (size_t i = 0; i < iterations; i++)
+    {
+        if (pending.size == 0)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                memcpy(pending.buffer + pending.size, long_response, sizeof(long_response) - 1);
+                pending.size += sizeof(long_response) - 1;
+            }
+        }
+        if (usb_utils_next_frame(&pending, &frame_p) == ERR_ALL_GOOD)
+        {
+            bench_sink += frame_p->size;
+            buffer_utils_release(frame_p);
+        }
+    }
+}
+
+static void bench_command_find(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++)
+    {
+        bench_sink += (uintptr_t)command_utils_find("STOP", 4);
+    }
+}
+
+static void bench_command_parse_line(size_t iterations)
+{
+    static const char line[] = "!bulk POLL\n";
+    const Command* command_p;
+    Priority priority;
+    for (size_t i = 0; i < iterations; i++)
+    {
+        command_utils_parse_line(line, sizeof(line) - 1, &command_p, &priority);
+        bench_sink += priority;
+    }
+}
+
+// One transaction encoded as JSON and written to the output FIFO (here `/dev/null`).
+static void bench_response_json(size_t iterations)
+{
+    Request request = {
+        .id            = 1,
+        .command_p     = &g_commands[0],
+        .priority      = PRIORITY_NORMAL,
+        .enqueued_ns   = 1000,
+        .dispatched_ns = 2000,
+        .written_ns    = 3000,
+        .completed_ns  = 12000000,
+        .response_p    = buffer_utils_from(long_response, sizeof(long_response) - 1),
+    };
+    g_fifo_out_fd = devnull_fd;
+    g_output.fd   = devnull_fd;
+    for (size_t i = 0; i < iterations; i++)
+    {
+        publish_json(&request, ERR_ALL_GOOD, 0);
+    }
+    g_fifo_out_fd = -1;
+    buffer_utils_release(request.response_p);
+}
+
+// One transaction stored into the flight recorder.
+static void bench_flight_record(size_t iterations)
+{
+    Request request = {
+        .id            = 1,
+        .command_p     = &g_commands[0],
+        .priority      = PRIORITY_NORMAL,
+        .enqueued_ns   = 1000,
+        .dispatched_ns = 2000,
+        .written_ns    = 3000,
+        .completed_ns  = 12000000,
+        .response_p    = buffer_utils_from(long_response, sizeof(long_response) - 1),
+    };
+    for (size_t i = 0; i < iterations; i++)
+    {
+        recorder_utils_record(&request, ERR_ALL_GOOD);
+    }
+    buffer_utils_release(request.response_p);
+}
+
+// A response identical to the previous one, hashed and compared by the delta suppression.
+static void bench_delta_check(size_t iterations)
+{
+    MessageBuffer* response_p = buffer_utils_from(long_response, sizeof(long_response) - 1);
+    uint32_t unchanged;
+    delta_utils_enable("POLL:3600000");
+    for (size_t i = 0; i < iterations; i++)
+    {
+        bench_sink += delta_utils_check(&g_commands[0], response_p, i, &unchanged);
+    }
+    delta_utils_close();
+    buffer_utils_release(response_p);
+}
+
+// A numeric field parsed from a response and added to a sliding window.
+static void bench_window_observe(size_t iterations)
+{
+    static const char response[] = "temp=21.37 hum=45\n";
+    timer_utils_init(&g_timer_wheel);
+    window_utils_init(&g_aggregator, &g_timer_wheel, NULL);
+    window_utils_add(&g_aggregator, "POLL:temp:10000/1000");
+    for (size_t i = 0; i < iterations; i++)
+    {
+        bench_sink += window_utils_observe(&g_aggregator, &g_commands[0], response);
+    }
+    window_utils_init(&g_aggregator, &g_timer_wheel, NULL);
+}
+
+#define BENCH_LOG(function_name, LOG_MACRO)                                                        \
+    static void function_name(size_t iterations)                                                   \
+    {                                                                                              \
+        for (size_t i = 0; i < iterations; i++)                                                    \
+        {                                                                                          \
+            LOG_MACRO("Read: %s", long_response);                                                  \
+        }                                                                                          \
+    }
+
+BENCH_LOG(bench_log_trace, LOG_TRACE)
+BENCH_LOG(bench_log_debug, LOG_DEBUG)
+BENCH_LOG(bench_log_info, LOG_INFO)
+BENCH_LOG(bench_log_warning, LOG_WARNING)
+BENCH_LOG(bench_log_error, LOG_ERROR)
+
+// A call site disabled at runtime: a single branch on its flag.
+static void bench_log_disabled(size_t iterations)
+{
+    logger_set_level(LEVEL_ERROR);
+    for (size_t i = 0; i < iterations; i++)
+    {
+        LOG_DEBUG("Read: %s", long_response);
+    }
+    logger_set_level(LOG_LEVEL);
+}
+
+// A rate-limited call site, nearly always suppressed.
+static void bench_log_rate_limited(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++)
+    {
+        LOG_INFO_EVERY(1000, "Read: %s", long_response);
+    }
+}
+
+#if LOG_LEVEL > LEVEL_NO_LOGS
+// Compiled out with the logs, like the headers it formats.
+static void bench_get_date_time(size_t iterations)
+{
+    char date_time_str[DATE_TIME_STR_LEN];
+    for (size_t i = 0; i < iterations; i++)
+    {
+        get_date_time(date_time_str);
+        bench_sink += (unsigned char)date_time_str[0];
+    }
+}
+#endif
+
+static void bench_get_monotonic_ns(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++)
+    {
+        bench_sink += get_monotonic_ns();
+    }
+}
+
+static const BenchCase bench_cases[] = {
+    {"fifo_read_line", bench_fifo_read_line},
+    {"serial_next_frame", bench_serial_next_frame},
+    {"command_find", bench_command_find},
+    {"command_parse_line", bench_command_parse_line},
+    {"response_json", bench_response_json},
+    {"flight_record", bench_flight_record},
+    {"delta_check", bench_delta_check},
+    {"window_observe", bench_window_observe},
+    {"log_trace", bench_log_trace},
+    {"log_debug", bench_log_debug},
+    {"log_info", bench_log_info},
+    {"log_warning", bench_log_warning},
+    {"log_error", bench_log_error},
+    {"log_disabled", bench_log_disabled},
+    {"log_rate_limited", bench_log_rate_limited},
+#if LOG_LEVEL > LEVEL_NO_LOGS
+    {"get_date_time", bench_get_date_time},
+#endif
+    {"get_monotonic_ns", bench_get_monotonic_ns},
+};
+
+#define NUM_BENCH_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+// ---------- HARNESS ----------
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double* values, size_t n)
+{
+    qsort(values, n, sizeof(double), compare_double);
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static double time_run(const BenchCase* case_p, size_t iterations)
+{
+    quiet_begin();
+    uint64_t start_ns = get_monotonic_ns();
+    case_p->run(iterations);
+    uint64_t elapsed_ns = get_monotonic_ns() - start_ns;
+    quiet_end();
+    return (double)elapsed_ns;
+}
+
+static BenchResult run_case(const BenchCase* case_p, size_t repetitions)
+{
+    double samples[BENCH_MAX_REPETITIONS];
+    BenchResult result;
+    // Warm up and calibrate at the same time.
+    size_t iterations = 1;
+    while (time_run(case_p, iterations) < BENCH_TARGET_NS && iterations < BENCH_MAX_ITERATIONS)
+    {
+        iterations *= 2;
+    }
+    uint64_t allocations = bench_allocations;
+    for (size_t r = 0; r < repetitions; r++)
+    {
+        samples[r] = time_run(case_p, iterations) / (double)iterations;
+    }
+    result.allocations_per_op
+        = (double)(bench_allocations - allocations) / (double)(repetitions * iterations);
+    result.median_ns = median(samples, repetitions);
+    for (size_t r = 0; r < repetitions; r++)
+    {
+        samples[r] = fabs(samples[r] - result.median_ns);
+    }
+    result.mad_ns = median(samples, repetitions);
+    return result;
+}
+
+static size_t load_baseline(const char* path, BaselineEntry* entries, size_t capacity)
+{
+    size_t num_entries = 0;
+    FILE* file_p       = fopen(path, "r");
+    if (file_p == NULL)
+    {
+        return 0;
+    }
+    while (num_entries < capacity
+           && fscanf(file_p, "%63s %lf", entries[num_entries].name, &entries[num_entries].median_ns)
+                  == 2)
+    {
+        num_entries++;
+    }
+    fclose(file_p);
+    return num_entries;
+}
+
+static const BaselineEntry* find_baseline(
+    const BaselineEntry* entries,
+    size_t num_entries,
+    const char* name)
+{
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        if (strcmp(entries[i].name, name) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void bench_usage(const char* program_name)
+{
+    printf(
+        "Usage: %s [-w] [-b <baseline file>] [-t <threshold %%>] [-n <repetitions>] [filter]\n",
+        program_name);
+    printf("  -w  write the results to the baseline file instead of comparing with it\n");
+    printf("  -b  baseline file (default `%s`)\n", BENCH_DEFAULT_BASELINE);
+    printf(
+        "  -t  slowdown flagged as a regression (default %.0f%%)\n",
+        BENCH_DEFAULT_THRESHOLD_PERCENT);
+    printf(
+        "  -n  repetitions per case (default %d, max %d)\n",
+        BENCH_DEFAULT_REPETITIONS,
+        BENCH_MAX_REPETITIONS);
+    printf("  filter: only run the cases whose name contains it\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* baseline_path = BENCH_DEFAULT_BASELINE;
+    double threshold_percent  = BENCH_DEFAULT_THRESHOLD_PERCENT;
+    size_t repetitions        = BENCH_DEFAULT_REPETITIONS;
+    bool write_baseline       = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "wb:t:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            write_baseline = true;
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 't':
+            threshold_percent = strtod(optarg, NULL);
+            break;
+        case 'n':
+            repetitions = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            bench_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (repetitions == 0 || repetitions > BENCH_MAX_REPETITIONS)
+    {
+        bench_usage(argv[0]);
+        exit(1);
+    }
+    const char* filter = optind < argc ? argv[optind] : "";
+
+    devnull_fd      = open("/dev/null", O_WRONLY);
+    saved_stdout_fd = dup(STDOUT_FILENO);
+    if (devnull_fd < 0 || saved_stdout_fd < 0 || pipe(pipe_fds) < 0
+        || fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK) < 0)
+    {
+        perror("Failed to set up the benchmark");
+        exit(ERR_FATAL);
+    }
+    logger_init("/dev/null", "/dev/null");
+    buffer_utils_init();
+    if (is_err(recorder_utils_open(BENCH_RECORDER_PATH)))
+    {
+        exit(ERR_FATAL);
+    }
+
+    BaselineEntry baseline[NUM_BENCH_CASES];
+    size_t num_baseline
+        = write_baseline ? 0 : load_baseline(baseline_path, baseline, NUM_BENCH_CASES);
+    FILE* baseline_file_p = NULL;
+    if (write_baseline && (baseline_file_p = fopen(baseline_path, "w")) == NULL)
+    {
+        perror(baseline_path);
+        exit(ERR_FATAL);
+    }
+    if (!write_baseline && num_baseline == 0)
+    {
+        printf("No baseline in `%s` (create one with -w)\n", baseline_path);
+    }
+    printf("LOG_LEVEL %s, %zu repetitions per case\n", logger_level_name(LOG_LEVEL), repetitions);
+    printf(
+        "%-20s %10s %8s %10s %10s %8s\n",
+        "case",
+        "ns/op",
+        "MAD",
+        "allocs/op",
+        "baseline",
+        "change");
+
+    size_t regressions = 0;
+    for (size_t i = 0; i < NUM_BENCH_CASES; i++)
+    {
+        if (strstr(bench_cases[i].name, filter) == NULL)
+        {
+            continue;
+        }
+        BenchResult result = run_case(&bench_cases[i], repetitions);
+        printf(
+            "%-20s %10.1f %8.1f %10.2f",
+            bench_cases[i].name,
+            result.median_ns,
+            result.mad_ns,
+            result.allocations_per_op);
+        const BaselineEntry* entry_p = find_baseline(baseline, num_baseline, bench_cases[i].name);
+        if (entry_p != NULL)
+        {
+            double change_percent = (result.median_ns / entry_p->median_ns - 1) * 100;
+            bool regression       = change_percent > threshold_percent
+                              && result.median_ns - entry_p->median_ns > 3 * result.mad_ns;
+            printf(
+                " %10.1f %+7.1f%%%s",
+                entry_p->median_ns,
+                change_percent,
+                regression ? "  REGRESSION" : "");
+            regressions += regression;
+        }
+        printf("\n");
+        if (baseline_file_p != NULL)
+        {
+            fprintf(baseline_file_p, "%s %.3f\n", bench_cases[i].name, result.median_ns);
+        }
+    }
+
+    if (baseline_file_p != NULL)
+    {
+        fclose(baseline_file_p);
+        printf("Baseline written to `%s`\n", baseline_path);
+    }
+    if (regressions)
+    {
+        printf("%zu regression(s) above %.0f%%\n", regressions, threshold_percent);
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    recorder_utils_close();
+    unlink(BENCH_RECORDER_PATH);
+    return regressions ? ERR_INVALID : ERR_ALL_GOOD;
+}
@@ -0,0 +1,384 @@
+// Replays a trace recorded with `multiface -r <trace file>`.
+// The recorded FIFO instructions are written to `artifacts/fifo_in` and a pseudo-terminal stands in
+// for the Serial Device: whenever multiface writes the next recorded serial message, the stand-in
+// answers with the chunks that were read back during the recording.
+// By default, the original pacing (time between instructions and device response times) is
+// preserved. With `-f`, instructions are sent and answered as fast as possible.
+// The macro definitions multiface uploads at startup (`-M`) are not recorded: the stand-in
+// acknowledges them. Peer devices (`-D`) are not recorded either, so such sessions are refused.
+//
+// Usage: ./build/replay [-f] <trace file> <multiface binary> [multiface options]
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <poll.h>
+#include <inttypes.h>
+
+#define COMMUNICATION_BUFF_IN_SIZE (4096)
+#define FIFO_IN "artifacts/fifo_in"
+#define REPLAY_LOG "artifacts/replay.log"
+#define REPLAY_IDLE_TIMEOUT_MS (5000)
+#define MAX_PENDING_READS (64)
+// The options of multiface, see `main()` in `src/main.c`.
+#define MULTIFACE_OPTIONS "mjO:g:r:F:T:p:s:a:o:x:d:D:W:H:M:"
+
+#define LOG_LEVEL LEVEL_WARNING
+#include "../src/mylib.c"
+#include "../src/traceutils.c"
+
+typedef struct
+{
+    TraceRecordType type;
+    uint64_t time_us;
+    size_t size;
+    char* data;
+} ReplayRecord;
+
+typedef struct
+{
+    uint64_t due_ns;
+    const ReplayRecord* record_p;
+} PendingRead;
+
+static ReplayRecord* load_trace(const char* path, size_t* num_records_p)
+{
+    static TraceRecord record;
+    TraceHeader header;
+    size_t capacity       = 1024;
+    ReplayRecord* records = malloc(capacity * sizeof(ReplayRecord));
+    FILE* file_p          = fopen(path, "rb");
+    if (file_p == NULL || records == NULL || is_err(trace_utils_read_header(file_p, &header)))
+    {
+        printf("`%s` is not a multiface trace.\n", path);
+        exit(ERR_FATAL);
+    }
+    Error res;
+    *num_records_p = 0;
+    record.time_us = 0;
+    while ((res = trace_utils_read_record(file_p, &record)) == ERR_ALL_GOOD)
+    {
+        if (*num_records_p == capacity)
+        {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(ReplayRecord));
+        }
+        ReplayRecord* replay_record_p = &records[(*num_records_p)++];
+        replay_record_p->type         = record.type;
+        replay_record_p->time_us      = record.time_us;
+        replay_record_p->size         = record.size;
+        replay_record_p->data         = malloc(record.size);
+        memcpy(replay_record_p->data, record.data, record.size);
+    }
+    if (res == ERR_INVALID)
+    {
+        printf("Trace truncated after %zu records: replaying what is there.\n", *num_records_p);
+    }
+    fclose(file_p);
+    return records;
+}
+
+static size_t next_of_type(const ReplayRecord* records, size_t n, size_t from, TraceRecordType type)
+{
+    while (from < n && records[from].type != type)
+    {
+        from++;
+    }
+    return from;
+}
+
+// Compare ignoring carriage returns, which the tty adds to every '\n' multiface writes.
+static bool same_message(const char* received, size_t received_size, const ReplayRecord* record_p)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (i < received_size && j < record_p->size)
+    {
+        if (received[i] == '\r')
+        {
+            i++;
+        }
+        else if (received[i++] != record_p->data[j++])
+        {
+            return false;
+        }
+    }
+    return i == received_size && j == record_p->size;
+}
+
+static pid_t spawn_multiface(char** multiface_argv)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int log_fd = open(REPLAY_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        execv(multiface_argv[0], multiface_argv);
+        perror("execv");
+        exit(ERR_FATAL);
+    }
+    return pid;
+}
+
+// Whether the multiface options name a peer device, parsed as multiface does so that combined
+// options such as `-mD<path>` are found too.
+static bool has_peers(int num_options, char* options[])
+{
+    // getopt() permutes what it parses: work on a copy, with a program name in front.
+    char** copy = calloc(num_options + 2, sizeof(char*));
+    copy[0]     = "multiface";
+    memcpy(copy + 1, options, num_options * sizeof(char*));
+    bool found       = false;
+    int saved_optind = optind;
+    int opt;
+    opterr = 0;
+    optind = 0;
+    while ((opt = getopt(num_options + 1, copy, MULTIFACE_OPTIONS)) != -1)
+    {
+        found = found || opt == 'D';
+    }
+    optind = saved_optind;
+    free(copy);
+    return found;
+}
+
+int main(int argc, char* argv[])
+{
+    bool fast = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "+f")) != -1)
+    {
+        fast = fast || opt == 'f';
+    }
+    if (argc - optind < 2)
+    {
+        printf("Usage: %s [-f] <trace file> <multiface binary> [multiface options]\n", argv[0]);
+        exit(1);
+    }
+    if (has_peers(argc - optind - 2, argv + optind + 2))
+    {
+        printf("Peer devices (-D) are not recorded and cannot be replayed.\n");
+        exit(1);
+    }
+    logger_init(NULL, NULL);
+    size_t num_records;
+    ReplayRecord* records = load_trace(argv[optind], &num_records);
+
+    int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0)
+    {
+        perror("Failed to create the stand-in device");
+        exit(ERR_FATAL);
+    }
+    // multiface options, followed by the stand-in device path.
+    int num_options       = argc - optind - 2;
+    char** multiface_argv = calloc(num_options + 3, sizeof(char*));
+    multiface_argv[0]     = argv[optind + 1];
+    for (int i = 0; i < num_options; i++)
+    {
+        multiface_argv[i + 1] = argv[optind + 2 + i];
+    }
+    multiface_argv[num_options + 1] = ptsname(master_fd);
+    printf("Stand-in device: %s, multiface log: %s\n", ptsname(master_fd), REPLAY_LOG);
+    fflush(stdout);
+    pid_t pid = spawn_multiface(multiface_argv);
+
+    int fifo_fd = -1;
+    for (int i = 0; i < 5000 && fifo_fd < 0; i++)
+    {
+        fifo_fd = open(FIFO_IN, O_WRONLY | O_NONBLOCK);
+        usleep(1000);
+    }
+    if (fifo_fd < 0)
+    {
+        printf("multiface did not open `%s`.\n", FIFO_IN);
+        kill(pid, SIGTERM);
+        exit(ERR_FATAL);
+    }
+    // Give multiface time to configure the serial port, which flushes it.
+    usleep(200000);
+
+    char received[COMMUNICATION_BUFF_IN_SIZE];
+    size_t received_size = 0;
+    PendingRead pending[MAX_PENDING_READS];
+    bool* answered          = calloc(num_records, sizeof(bool));
+    size_t num_pending      = 0;
+    size_t next_instruction = next_of_type(records, num_records, 0, TRACE_INSTRUCTION);
+    size_t next_write       = next_of_type(records, num_records, 0, TRACE_SERIAL_WRITE);
+    uint64_t first_us = next_instruction < num_records ? records[next_instruction].time_us : 0;
+    uint64_t last_us  = num_records ? records[num_records - 1].time_us : 0;
+
+    size_t matched     = 0;
+    size_t mismatched  = 0;
+    size_t sent        = 0;
+    uint64_t start_ns  = get_monotonic_ns();
+    uint64_t end_ns    = start_ns;
+    uint64_t active_ns = start_ns;
+
+    while (next_instruction < num_records || next_write < num_records || num_pending)
+    {
+        uint64_t now_ns = get_monotonic_ns();
+        if (now_ns - active_ns > REPLAY_IDLE_TIMEOUT_MS * NS_PER_MS)
+        {
+            printf("multiface stopped talking to the device: giving up.\n");
+            break;
+        }
+        // Instructions
+        while (next_instruction < num_records
+               && (fast
+                   || now_ns >= start_ns + (records[next_instruction].time_us - first_us) * 1000))
+        {
+            const ReplayRecord* record_p = &records[next_instruction];
+            if (write(fifo_fd, record_p->data, record_p->size) != (ssize_t)record_p->size)
+            {
+                break; /* FIFO full: retry later */
+            }
+            sent++;
+            active_ns        = now_ns;
+            next_instruction
+                = next_of_type(records, num_records, next_instruction + 1, TRACE_INSTRUCTION);
+        }
+        // Device responses
+        for (size_t i = 0; i < num_pending;)
+        {
+            if (now_ns >= pending[i].due_ns)
+            {
+                if (write(master_fd, pending[i].record_p->data, pending[i].record_p->size) < 0)
+                {
+                    perror("Failed to answer");
+                }
+                end_ns = active_ns = now_ns;
+                pending[i]         = pending[--num_pending];
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        int timeout_ms = 1;
+        if (next_instruction >= num_records && num_pending == 0)
+        {
+            timeout_ms = 10;
+        }
+        struct pollfd polled_fd = {.fd = master_fd, .events = POLLIN};
+        if (poll(&polled_fd, 1, timeout_ms) <= 0 || !(polled_fd.revents & POLLIN))
+        {
+            continue;
+        }
+        ssize_t size = read(master_fd, received + received_size, sizeof(received) - received_size);
+        if (size <= 0)
+        {
+            continue;
+        }
+        received_size += size;
+        if (received_size == sizeof(received) && memchr(received, '\n', received_size) == NULL)
+        {
+            printf("Serial message longer than %zu bytes: giving up.\n", sizeof(received));
+            mismatched++;
+            break;
+        }
+        char* newline_p;
+        while ((newline_p = memchr(received, '\n', received_size)) != NULL)
+        {
+            size_t line_size = newline_p - received + 1;
+            now_ns           = get_monotonic_ns();
+            active_ns        = now_ns;
+            if (line_size >= 6 && strncmp(received, "macro ", 6) == 0)
+            {
+                // A macro uploaded at startup, never part of the recording.
+                if (write(master_fd, "OK\r\n", 4) < 0)
+                {
+                    perror("Failed to acknowledge a macro");
+                }
+            }
+            else if (next_write >= num_records)
+            {
+                printf("Unexpected serial message `%.*s`\n", (int)line_size, received);
+                mismatched++;
+            }
+            else
+            {
+                // Requests may be dispatched in a different order than during the recording
+                // (e.g. priorities in a burst): answer the first pending write with this content.
+                size_t index = next_write;
+                while (index < num_records
+                       && (records[index].type != TRACE_SERIAL_WRITE || answered[index]
+                           || !same_message(received, line_size, &records[index])))
+                {
+                    index++;
+                }
+                if (index < num_records)
+                {
+                    matched++;
+                }
+                else
+                {
+                    printf("Serial message diverged: `%.*s`\n", (int)line_size, received);
+                    mismatched++;
+                    index = next_write;
+                }
+                answered[index] = true;
+                // Answer with the chunks read after this write in the recording.
+                const ReplayRecord* write_p = &records[index];
+                for (size_t i = index + 1;
+                     i < num_records && records[i].type != TRACE_SERIAL_WRITE;
+                     i++)
+                {
+                    if (records[i].type == TRACE_SERIAL_READ && num_pending < MAX_PENDING_READS)
+                    {
+                        uint64_t delay_ns
+                            = fast ? 0 : (records[i].time_us - write_p->time_us) * 1000;
+                        pending[num_pending].due_ns   = now_ns + delay_ns;
+                        pending[num_pending].record_p = &records[i];
+                        num_pending++;
+                    }
+                }
+                while (next_write < num_records
+                       && (records[next_write].type != TRACE_SERIAL_WRITE || answered[next_write]))
+                {
+                    next_write++;
+                }
+            }
+            memmove(received, newline_p + 1, received_size - line_size);
+            received_size -= line_size;
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    double replay_s = (end_ns - start_ns) / 1e9;
+    printf("Mode:                 %s\n", fast ? "as fast as possible" : "original pacing");
+    printf("Records:              %zu\n", num_records);
+    printf("Instructions sent:    %zu\n", sent);
+    printf("Serial exchanges:     %zu matched, %zu diverged\n", matched, mismatched);
+    printf("Original duration:    %.3f s\n", (last_us - first_us) / 1e6);
+    printf("Replay duration:      %.3f s\n", replay_s);
+    if (replay_s > 0)
+    {
+        printf("Exchanges per second: %.1f\n", matched / replay_s);
+    }
+    for (size_t i = 0; i < num_records; i++)
+    {
+        free(records[i].data);
+    }
+    free(records);
+    free(answered);
+    free(multiface_argv);
+    close(fifo_fd);
+    close(master_fd);
+    return mismatched ? ERR_INVALID : ERR_ALL_GOOD;
+}
@@ -0,0 +1,285 @@
+// Compares the FIFO transport with the shared memory transport.
+// A forked child plays the role of multiface and answers every instruction with a fixed response
+// through the same code paths used by the daemon (`fifo_utils_read_line()` and the `shm_utils_*`
+// server functions). The serial device is left out so that only the transport is measured.
+//
+// Usage: ./build/shm-bench [number of messages]
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <poll.h>
+
+#define COMMUNICATION_BUFF_IN_SIZE (4096)
+
+#define FIFO_IN "artifacts/bench_fifo_in"
+#define FIFO_OUT "artifacts/bench_fifo_out"
+#define BENCH_SHM_NAME "/multiface-bench"
+#define BENCH_SHM_DOORBELL "artifacts/bench_shm_doorbell"
+#define BENCH_BATCH (32)
+
+typedef struct
+{
+    char buffer[COMMUNICATION_BUFF_IN_SIZE];
+    ssize_t size;
+} SizedBuffer;
+
+#define LOG_LEVEL LEVEL_WARNING
+#include "../src/mylib.c"
+#include "../src/fifoutils.c"
+#include "../src/shmutils.c"
+
+static const char request[]  = "POLL\n";
+static const char response[] = "This is a very long string but you should not crop it!\n";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_results(const char* name, uint64_t* latencies, size_t n, uint64_t batch_ns)
+{
+    qsort(latencies, n, sizeof(uint64_t), compare_u64);
+    printf(
+        "%-6s | latency p50 %8.2f us  p99 %8.2f us  max %9.2f us | %10.0f msg/s (batch of %d)\n",
+        name,
+        latencies[n / 2] / 1e3,
+        latencies[(n * 99) / 100] / 1e3,
+        latencies[n - 1] / 1e3,
+        (double)n * 1e9 / (double)batch_ns,
+        BENCH_BATCH);
+}
+
+// ---------- FIFO ----------
+
+static void fifo_server(void)
+{
+    SizedBuffer line = {0};
+    int in_fd        = open(FIFO_IN, O_RDWR | O_NONBLOCK);
+    int out_fd       = open(FIFO_OUT, O_RDWR);
+    struct pollfd polled_fd = {.fd = in_fd, .events = POLLIN};
+    while (true)
+    {
+        if (poll(&polled_fd, 1, 500) > 0 && (polled_fd.revents & POLLIN))
+        {
+            fifo_utils_read_line(&line, in_fd);
+            if (line.size && write(out_fd, response, sizeof(response) - 1) < 0)
+            {
+                exit(ERR_FATAL);
+            }
+            bzero(line.buffer, line.size);
+        }
+    }
+}
+
+static void fifo_read_response(FILE* out_p)
+{
+    char buffer[COMMUNICATION_BUFF_IN_SIZE];
+    if (fgets(buffer, sizeof(buffer), out_p) == NULL)
+    {
+        printf("Failed to read from `%s`\n", FIFO_OUT);
+        exit(ERR_FATAL);
+    }
+}
+
+static void bench_fifo(size_t n, uint64_t* latencies)
+{
+    int in_fd   = open(FIFO_IN, O_WRONLY);
+    FILE* out_p = fopen(FIFO_OUT, "r");
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t start = now_ns();
+        if (write(in_fd, request, sizeof(request) - 1) < 0)
+        {
+            exit(ERR_FATAL);
+        }
+        fifo_read_response(out_p);
+        latencies[i] = now_ns() - start;
+    }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i += BENCH_BATCH)
+    {
+        for (size_t j = 0; j < BENCH_BATCH; j++)
+        {
+            if (write(in_fd, request, sizeof(request) - 1) < 0)
+            {
+                exit(ERR_FATAL);
+            }
+        }
+        for (size_t j = 0; j < BENCH_BATCH; j++)
+        {
+            fifo_read_response(out_p);
+        }
+    }
+    print_results("fifo", latencies, n, now_ns() - start);
+    close(in_fd);
+    fclose(out_p);
+}
+
+// ---------- SHARED MEMORY ----------
+
+static void shm_server(ShmSegment* segment_p)
+{
+    ShmRecordHeader header;
+    char buffer[COMMUNICATION_BUFF_IN_SIZE];
+    int doorbell_fd         = open(BENCH_SHM_DOORBELL, O_RDWR | O_NONBLOCK);
+    struct pollfd polled_fd = {.fd = doorbell_fd, .events = POLLIN};
+    while (true)
+    {
+        bool sleeping = shm_utils_server_prepare_sleep(segment_p);
+        if (sleeping)
+        {
+            poll(&polled_fd, 1, 500);
+            shm_utils_server_woken(segment_p, doorbell_fd, polled_fd.revents & POLLIN);
+        }
+        while (shm_utils_ring_pop(&segment_p->requests, &header, buffer, sizeof(buffer)))
+        {
+            shm_utils_server_respond(
+                segment_p, header.tag, ERR_ALL_GOOD, response, sizeof(response) - 1);
+        }
+    }
+}
+
+static void shm_send(ShmSegment* segment_p, int doorbell_fd, uint32_t tag)
+{
+    while (!shm_utils_client_request(segment_p, doorbell_fd, tag, request, sizeof(request) - 1))
+    {
+    }
+}
+
+static void shm_receive(ShmSegment* segment_p, uint32_t tag)
+{
+    ShmRecordHeader header;
+    char buffer[COMMUNICATION_BUFF_IN_SIZE];
+    if (shm_utils_client_response(segment_p, &header, buffer, sizeof(buffer), 1000) != ERR_ALL_GOOD
+        || header.tag != tag)
+    {
+        printf("Missing shared memory response %u\n", tag);
+        exit(ERR_FATAL);
+    }
+}
+
+static void bench_shm(size_t n, uint64_t* latencies)
+{
+    ShmSegment* segment_p = NULL;
+    int doorbell_fd       = -1;
+    // Opening the write end of a FIFO fails with ENXIO until the server has opened it.
+    for (int i = 0; i < 1000 && doorbell_fd < 0; i++)
+    {
+        doorbell_fd = open(BENCH_SHM_DOORBELL, O_WRONLY | O_NONBLOCK);
+        usleep(1000);
+    }
+    if (doorbell_fd < 0 || shm_utils_attach(BENCH_SHM_NAME, &segment_p) != ERR_ALL_GOOD)
+    {
+        exit(ERR_FATAL);
+    }
+    uint32_t tag = 0;
+    for (size_t i = 0; i < n; i++, tag++)
+    {
+        uint64_t start = now_ns();
+        shm_send(segment_p, doorbell_fd, tag);
+        shm_receive(segment_p, tag);
+        latencies[i] = now_ns() - start;
+    }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i += BENCH_BATCH)
+    {
+        for (size_t j = 0; j < BENCH_BATCH; j++)
+        {
+            shm_send(segment_p, doorbell_fd, tag + j);
+        }
+        for (size_t j = 0; j < BENCH_BATCH; j++)
+        {
+            shm_receive(segment_p, tag + j);
+        }
+        tag += BENCH_BATCH;
+    }
+    print_results("shm", latencies, n, now_ns() - start);
+    close(doorbell_fd);
+    shm_utils_detach(segment_p);
+}
+
+static pid_t spawn_server(void (*server)(void))
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // `fifo_utils_read_line()` prints every line it receives: keep that out of the terminal.
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            exit(ERR_FATAL);
+        }
+        server();
+        exit(ERR_ALL_GOOD);
+    }
+    return pid;
+}
+
+static ShmSegment* g_bench_segment_p = NULL;
+static void shm_server_entry(void) { shm_server(g_bench_segment_p); }
+
+int main(int argc, char* argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    n        = n < BENCH_BATCH ? BENCH_BATCH : n - n % BENCH_BATCH;
+    logger_init(NULL, NULL);
+    uint64_t* latencies = malloc(n * sizeof(uint64_t));
+    if (latencies == NULL)
+    {
+        exit(ERR_FATAL);
+    }
+    printf("Round trips: %zu, request `POLL`, response %zu bytes\n", n, sizeof(response) - 1);
+
+    unlink(FIFO_IN);
+    unlink(FIFO_OUT);
+    if (mkfifo(FIFO_IN, 0666) < 0 || mkfifo(FIFO_OUT, 0666) < 0)
+    {
+        printf("Failed to create the benchmark FIFOs\n");
+        exit(ERR_FATAL);
+    }
+    pid_t pid = spawn_server(fifo_server);
+    bench_fifo(n, latencies);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(FIFO_IN);
+    unlink(FIFO_OUT);
+
+    unlink(BENCH_SHM_DOORBELL);
+    if (mkfifo(BENCH_SHM_DOORBELL, 0666) < 0
+        || shm_utils_create(BENCH_SHM_NAME, &g_bench_segment_p) != ERR_ALL_GOOD)
+    {
+        printf("Failed to create the shared memory transport\n");
+        exit(ERR_FATAL);
+    }
+    pid = spawn_server(shm_server_entry);
+    bench_shm(n, latencies);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    shm_utils_destroy(BENCH_SHM_NAME, g_bench_segment_p);
+    unlink(BENCH_SHM_DOORBELL);
+
+    free(latencies);
+    return ERR_ALL_GOOD;
+}
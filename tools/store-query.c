@@ -0,0 +1,307 @@
+// Reads a time range of one command's rows from the time-series store written by multiface (see
+// `src/storeutils.c`). It can be run on the store of a live, crashed or killed process.
+//
+// The segments are numbered in time order: the first one to read is found with a binary search on
+// the time of their first rows, and the first row in it with a binary search of its sparse index.
+// Segments past the end of the range are never opened.
+//
+// Usage: ./build/store-query [-j] [-f <from>] [-t <to>] <store directory> <command>
+// where <from> and <to> are Unix times in ms, or ms before now if negative.
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#define LOG_LEVEL LEVEL_WARNING
+#include "../src/mylib.c"
+#include "../src/jsonutils.c"
+#include "../src/storeutils.c"
+
+#define QUERY_MAX_SEGMENTS (65536)
+
+typedef struct
+{
+    uint32_t number;
+    const StoreSegment* segment_p; /* Mapped on first use */
+    bool invalid;
+} QuerySegment;
+
+static QuerySegment segments[QUERY_MAX_SEGMENTS];
+static size_t num_segments = 0;
+static size_t num_mapped   = 0;
+
+static int compare_number(const void* a, const void* b)
+{
+    uint32_t x = ((const QuerySegment*)a)->number;
+    uint32_t y = ((const QuerySegment*)b)->number;
+    return (x > y) - (x < y);
+}
+
+static const StoreSegment* map_segment(const char* directory, QuerySegment* query_p)
+{
+    if (query_p->segment_p != NULL || query_p->invalid)
+    {
+        return query_p->segment_p;
+    }
+    char path[STORE_PATH_SIZE];
+    struct stat st;
+    _store_utils_path(directory, query_p->number, path);
+    int fd          = open(path, O_RDONLY);
+    void* mapping_p = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(StoreSegment))
+    {
+        mapping_p = mmap(NULL, sizeof(StoreSegment), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (mapping_p == MAP_FAILED || !store_utils_is_valid(mapping_p))
+    {
+        fprintf(stderr, "Skipping `%s`: not a multiface store segment\n", path);
+        query_p->invalid = true;
+        return NULL;
+    }
+    num_mapped++;
+    query_p->segment_p = mapping_p;
+    return query_p->segment_p;
+}
+
+// Wall clock time of the first row, UINT64_MAX for an empty or invalid segment (only the last
+// one, being prepared, can be empty).
+static uint64_t first_time_ns(const char* directory, QuerySegment* query_p)
+{
+    const StoreSegment* segment_p = map_segment(directory, query_p);
+    if (segment_p == NULL
+        || atomic_load_explicit(&segment_p->header.count, memory_order_acquire) == 0)
+    {
+        return UINT64_MAX;
+    }
+    return segment_p->time_ns[0] + segment_p->header.realtime_offset_ns;
+}
+
+// First row of a segment at or after the monotonic time `from_ns`.
+static uint32_t first_row(const StoreSegment* segment_p, uint32_t count, uint64_t from_ns)
+{
+    size_t low  = 0;
+    size_t high = (count + STORE_INDEX_STRIDE - 1) / STORE_INDEX_STRIDE;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (segment_p->index_ns[middle] < from_ns)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    uint32_t row = low ? (uint32_t)(low - 1) * STORE_INDEX_STRIDE : 0;
+    while (row < count && segment_p->time_ns[row] < from_ns)
+    {
+        row++;
+    }
+    return row;
+}
+
+static void print_row(const StoreSegment* segment_p, uint32_t row, bool json)
+{
+    static char json_buffer[4 * UINT16_MAX];
+    const StoreHeader* header_p = &segment_p->header;
+    uint64_t time_ns            = segment_p->time_ns[row] + header_p->realtime_offset_ns;
+    const char* device          = header_p->devices[segment_p->device[row]];
+    const char* command         = header_p->commands[segment_p->command[row]];
+    const char* data            = segment_p->heap + segment_p->offset[row];
+    size_t size                 = segment_p->size[row];
+    if (json)
+    {
+        JsonWriter writer;
+        json_utils_init(&writer, json_buffer, sizeof(json_buffer));
+        json_utils_begin_object(&writer, NULL);
+        json_utils_uint(&writer, "time_ns", time_ns);
+        json_utils_string(&writer, "device", device, strnlen(device, STORE_NAME_SIZE));
+        json_utils_string(&writer, "command", command, strnlen(command, STORE_NAME_SIZE));
+        if (isnan(segment_p->value[row]))
+        {
+            json_utils_string(&writer, "response", data, size);
+        }
+        else
+        {
+            json_utils_double(&writer, "value", segment_p->value[row]);
+        }
+        json_utils_end_object(&writer);
+        if (is_ok(json_utils_finish(&writer)))
+        {
+            fwrite(json_buffer, 1, writer.size, stdout);
+        }
+        return;
+    }
+    char date_time[32];
+    time_t seconds = (time_t)(time_ns / NS_PER_SEC);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    strftime(date_time, sizeof(date_time), "%Y-%m-%d %H:%M:%S", &tm);
+    while (size && (data[size - 1] == '\n' || data[size - 1] == '\r'))
+    {
+        size--;
+    }
+    printf(
+        "%s.%06" PRIu64 " %.*s %.*s ",
+        date_time,
+        (uint64_t)(time_ns % NS_PER_SEC / 1000),
+        STORE_NAME_SIZE,
+        device,
+        STORE_NAME_SIZE,
+        command);
+    if (isnan(segment_p->value[row]))
+    {
+        printf("`%.*s`\n", (int)size, data);
+    }
+    else
+    {
+        printf("%g\n", segment_p->value[row]);
+    }
+}
+
+static uint64_t parse_time_ns(const char* arg, uint64_t now_ns)
+{
+    long long ms = strtoll(arg, NULL, 10);
+    if (ms >= 0)
+    {
+        return (uint64_t)ms * NS_PER_MS;
+    }
+    uint64_t before_ns = (uint64_t)-ms * NS_PER_MS;
+    return before_ns < now_ns ? now_ns - before_ns : 0;
+}
+
+static void query_usage(const char* program_name)
+{
+    printf("Usage: %s [-j] [-f <from>] [-t <to>] <store directory> <command>\n", program_name);
+    printf("  <from> and <to> are Unix times in ms, or ms before now if negative\n");
+}
+
+int main(int argc, char* argv[])
+{
+    bool json        = false;
+    const char* from = NULL;
+    const char* to   = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "jf:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        case 'f':
+            from = optarg;
+            break;
+        case 't':
+            to = optarg;
+            break;
+        default:
+            query_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        query_usage(argv[0]);
+        exit(1);
+    }
+    const char* directory = argv[optind];
+    const char* command   = argv[optind + 1];
+    logger_init(NULL, NULL);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns  = (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+    uint64_t from_ns = from ? parse_time_ns(from, now_ns) : 0;
+    uint64_t to_ns   = to ? parse_time_ns(to, now_ns) : UINT64_MAX;
+
+    DIR* dir_p = opendir(directory);
+    if (dir_p == NULL)
+    {
+        printf("Failed to open the store `%s`: %s\n", directory, strerror(errno));
+        exit(ERR_FATAL);
+    }
+    struct dirent* entry_p;
+    while ((entry_p = readdir(dir_p)) != NULL && num_segments < QUERY_MAX_SEGMENTS)
+    {
+        if (store_utils_parse_name(entry_p->d_name, &segments[num_segments].number))
+        {
+            num_segments++;
+        }
+    }
+    closedir(dir_p);
+    qsort(segments, num_segments, sizeof(segments[0]), compare_number);
+
+    // Last segment starting at or before `from`: the range may begin in the middle of it.
+    size_t low  = 0;
+    size_t high = num_segments;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (first_time_ns(directory, &segments[middle]) <= from_ns)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    uint64_t num_rows = 0;
+    for (size_t i = low ? low - 1 : 0; i < num_segments; i++)
+    {
+        if (first_time_ns(directory, &segments[i]) > to_ns)
+        {
+            break;
+        }
+        const StoreSegment* segment_p = segments[i].segment_p;
+        if (segment_p == NULL)
+        {
+            continue;
+        }
+        const StoreHeader* header_p = &segment_p->header;
+        uint32_t count    = atomic_load_explicit(&header_p->count, memory_order_acquire);
+        int command_index = 0;
+        while (command_index < header_p->num_commands && command_index < STORE_MAX_COMMANDS
+               && strncmp(header_p->commands[command_index], command, STORE_NAME_SIZE) != 0)
+        {
+            command_index++;
+        }
+        if (command_index == header_p->num_commands || command_index == STORE_MAX_COMMANDS)
+        {
+            continue;
+        }
+        uint64_t offset_ns = header_p->realtime_offset_ns;
+        uint32_t row = first_row(segment_p, count, from_ns > offset_ns ? from_ns - offset_ns : 0);
+        for (; row < count && segment_p->time_ns[row] + offset_ns <= to_ns; row++)
+        {
+            if (segment_p->command[row] == command_index)
+            {
+                print_row(segment_p, row, json);
+                num_rows++;
+            }
+        }
+    }
+    if (!json)
+    {
+        printf(
+            "%" PRIu64 " rows, %zu segments read out of %zu\n", num_rows, num_mapped, num_segments);
+    }
+    return ERR_ALL_GOOD;
+}